@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * bench.h - Timing, latency samples and setup shared by the benchmarks
+ *
+ * Latency is sampled in ticks of zus_stats_now, every @every ops so at most
+ * BENCH_MAX_SAMPLES are kept, and converted to ns when percentiles are taken.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+
+#ifndef __ZUS_BENCH_H
+#define __ZUS_BENCH_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "zus.h"
+
+#define BENCH_MAX_SAMPLES	(1 << 14)	/* per thread per kind */
+
+struct bench_lat {
+	ulong *samples;
+	ulong n;
+	ulong every;
+};
+
+static inline ulong bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Measured on first call, which sleeps 20ms. So call it before timing */
+static inline double bench_ns_per_tick(void)
+{
+	static double ns_per_tick;
+	struct timespec nap = { .tv_sec = 0, .tv_nsec = 20 * 1000 * 1000 };
+	ulong t0, n0, t1, n1;
+
+	if (ns_per_tick > 0)
+		return ns_per_tick;
+
+	t0 = zus_stats_now();
+	n0 = bench_now_ns();
+	nanosleep(&nap, NULL);
+	t1 = zus_stats_now();
+	n1 = bench_now_ns();
+
+	ns_per_tick = (t1 > t0) ? (double)(n1 - n0) / (t1 - t0) : 1.0;
+	return ns_per_tick;
+}
+
+static inline int bench_lat_init(struct bench_lat *lat, ulong ops)
+{
+	lat->n = 0;
+	lat->every = ops / BENCH_MAX_SAMPLES + 1;
+	lat->samples = calloc(BENCH_MAX_SAMPLES, sizeof(*lat->samples));
+	return lat->samples ? 0 : -ENOMEM;
+}
+
+static inline void bench_lat_fini(struct bench_lat *lat)
+{
+	free(lat->samples);
+	lat->samples = NULL;
+}
+
+static inline bool bench_lat_want(struct bench_lat *lat, ulong op)
+{
+	return !(op % lat->every) && (lat->n < BENCH_MAX_SAMPLES);
+}
+
+static inline int _bench_cmp_ulong(const void *a, const void *b)
+{
+	ulong x = *(const ulong *)a, y = *(const ulong *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Merges the samples of @nlat bench_lat, each @stride bytes after the one
+ * before (a member of an array of per thread structs). Returns p50 and p99
+ * in ns
+ */
+static inline void bench_lat_percentiles(const struct bench_lat *lat,
+					 uint nlat, size_t stride,
+					 double *p50, double *p99)
+{
+	const char *p = (const char *)lat;
+	ulong *all, n = 0;
+	uint i;
+
+	*p50 = *p99 = 0;
+	all = malloc(nlat * BENCH_MAX_SAMPLES * sizeof(*all));
+	if (!all)
+		return;
+
+	for (i = 0; i < nlat; ++i, p += stride) {
+		lat = (const struct bench_lat *)p;
+		memcpy(all + n, lat->samples, lat->n * sizeof(*all));
+		n += lat->n;
+	}
+	if (n) {
+		qsort(all, n, sizeof(*all), _bench_cmp_ulong);
+		*p50 = bench_ns_per_tick() * all[n / 2];
+		*p99 = bench_ns_per_tick() * all[(n * 99) / 100];
+	}
+	free(all);
+}
+
+/* zus_thread_create needs the NUMA map, which we get from the emulated zuf.
+ * @pa_huge as --pa_huge of zusd, NULL for ZUFS_PA_HUGE or the default.
+ * Undone by bench_emu_fini
+ */
+static inline int bench_emu_init(ssize_t pa_size, const char *pa_huge)
+{
+	int fd, err;
+
+	zus_init_zuf(NULL);
+	err = zuf_emu_start();
+	if (unlikely(err))
+		return err;
+
+	err = zuf_root_open_tmp(&fd);
+	if (unlikely(err))
+		return err;
+	err = zus_numa_map_init(fd);
+	zuf_root_close(&fd);
+	if (unlikely(err))
+		return err;
+
+	err = zus_setup_pa_size(pa_size);
+	if (unlikely(err))
+		return err;
+
+	err = zus_setup_pa_huge(pa_huge);
+	if (unlikely(err))
+		return err;
+
+	return zus_slab_init();
+}
+
+static inline void bench_emu_fini(void)
+{
+	zus_slab_fini();
+	zuf_emu_fini();
+}
+
+#endif /* define __ZUS_BENCH_H */
@@ -0,0 +1,199 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * csum_bench.c - Throughput of each checksum implementation of csum.c
+ *
+ * For each buffer size every implementation this CPU can run checksums the
+ * same random buffer until --mb MB were done. Before timing, results of
+ * each family (crc16, crc32c) are checked against its first implementation
+ * over all sizes. Results are printed as CSV on stdout.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+
+#include "zus.h"
+#include "../bench.h"
+
+#define CB_DEF_MB		1024
+#define CB_DEF_SIZES		"64,512,4096,65536,1048576"
+#define CB_MAX_SIZES		32
+
+struct cb_conf {
+	ulong mb;
+	ulong sizes[CB_MAX_SIZES];
+	uint nsizes;
+	ulong max_size;
+};
+
+static bool _is_crc16(const struct zus_csum_impl *zci)
+{
+	return !strncmp(zci->name, "crc16", 5);
+}
+
+/* All implementations of a family must agree with its first one */
+static int _cb_verify(const struct cb_conf *cbc, const uint8_t *buf)
+{
+	struct zus_csum_impl zci, ref16 = {}, ref32 = {};
+	struct zus_csum_impl *ref;
+	uint32_t seed, want, got;
+	uint i, s;
+	int err = 0;
+
+	for (i = 0; !zus_csum_get_impl(i, &zci); ++i) {
+		if (!zci.avail)
+			continue;
+		ref = _is_crc16(&zci) ? &ref16 : &ref32;
+		if (!ref->fn) {
+			*ref = zci;
+			continue;
+		}
+		seed = _is_crc16(&zci) ? 0xffff : ~0U;
+		for (s = 0; s < cbc->nsizes; ++s) {
+			/* Odd offset and length, for the unaligned paths */
+			want = ref->fn(seed, buf + 1, cbc->sizes[s] - 1);
+			got = zci.fn(seed, buf + 1, cbc->sizes[s] - 1);
+			if (want == got)
+				continue;
+			fprintf(stderr, "# %s: size=%lu 0x%x, %s has 0x%x\n",
+				zci.name, cbc->sizes[s] - 1, got, ref->name,
+				want);
+			err = -EINVAL;
+		}
+	}
+	return err;
+}
+
+static void _cb_run(const struct cb_conf *cbc, const void *buf,
+		    const struct zus_csum_impl *zci, ulong size)
+{
+	ulong n, iters = (cbc->mb << 20) / size ?: 1;
+	ulong start, ns;
+	uint32_t sum = 0;
+
+	/* Warm up the caches and the dispatch */
+	for (n = 0; n < iters / 16; ++n)
+		sum ^= zci->fn(~0U, buf, size);
+
+	start = bench_now_ns();
+	for (n = 0; n < iters; ++n)
+		sum ^= zci->fn(sum, buf, size);
+	ns = bench_now_ns() - start;
+
+	printf("%s,%d,%lu,%lu,%.6f,%.2f,%.2f\n", zci->name, zci->active,
+	       size, iters, ns / 1e9, (double)ns / iters,
+	       (double)size * iters / ns);
+	fflush(stdout);
+	if (sum == 0x5EED5EED)	/* Keeps @sum used */
+		fprintf(stderr, "# %s: lucky\n", zci->name);
+}
+
+static int _parse_sizes(struct cb_conf *cbc, char *list)
+{
+	char *tok, *save;
+
+	cbc->nsizes = 0;
+	for (tok = strtok_r(list, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		ulong size = strtoul(tok, NULL, 0);
+
+		if (size < 2 || cbc->nsizes == CB_MAX_SIZES)
+			return -EINVAL;
+		cbc->sizes[cbc->nsizes++] = size;
+		if (cbc->max_size < size)
+			cbc->max_size = size;
+	}
+	return cbc->nsizes ? 0 : -EINVAL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	"usage: %s [options]\n"
+	"	--mb=N		MB checksummed per implementation and size.\n"
+	"			Default %u\n"
+	"	--sizes=LIST	Comma separated buffer sizes, in bytes.\n"
+	"			Default %s\n"
+	"\n"
+	"Implementations this CPU cannot run are skipped. active is 1 for\n"
+	"those zus_crc16/zus_crc32c use.\n"
+	"Prints CSV: impl,active,size,iters,secs,ns_per_buf,gb_per_sec\n",
+	prog, CB_DEF_MB, CB_DEF_SIZES);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option opt[] = {
+		{.name = "mb", .has_arg = 1, .flag = NULL, .val = 'm'},
+		{.name = "sizes", .has_arg = 1, .flag = NULL, .val = 's'},
+		{.name = "help", .has_arg = 0, .flag = NULL, .val = 'h'},
+		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+	};
+	const char *shortopt = "m:s:h";
+	struct cb_conf cbc = {
+		.mb = CB_DEF_MB,
+	};
+	char sizes[] = CB_DEF_SIZES;
+	struct zus_csum_impl zci;
+	uint8_t *buf;
+	uint i, s;
+	ulong n;
+	int op, err;
+
+	_parse_sizes(&cbc, sizes);
+	while ((op = getopt_long(argc, argv, shortopt, opt, NULL)) != -1) {
+		switch (op) {
+		case 'm':
+			cbc.mb = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			cbc.max_size = 0;
+			if (_parse_sizes(&cbc, optarg)) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!cbc.mb) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	buf = malloc(cbc.max_size);
+	if (unlikely(!buf))
+		return 1;
+	srand(1);
+	for (n = 0; n < cbc.max_size; ++n)
+		buf[n] = rand();
+
+	err = _cb_verify(&cbc, buf);
+	if (unlikely(err)) {
+		free(buf);
+		return 1;
+	}
+
+	printf("impl,active,size,iters,secs,ns_per_buf,gb_per_sec\n");
+	fflush(stdout);
+
+	for (s = 0; s < cbc.nsizes; ++s) {
+		for (i = 0; !zus_csum_get_impl(i, &zci); ++i) {
+			if (zci.avail)
+				_cb_run(&cbc, buf, &zci, cbc.sizes[s]);
+		}
+	}
+
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,927 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * emu_bench.c - toyfs metadata ops, file and t2cache I/O through emulated zuf
+ *
+ * Formats a toyfs image on a tmpfs file with mkfs.toyfs and mounts it with
+ * zuf_emu_mount. Then, as the Kernel would for a create, drop from cache,
+ * stat and unlink of --files files, it runs each phase over all the files
+ * through zuf_emu_dispatch, on the ZTs of all online CPUs in turn. Every op
+ * is checked, and the free inodes must be back to what statfs first said,
+ * so this is also a smoke test of the emulator.
+ * lookup_t<N> looks up (and drops) all files from N threads at once, each
+ * on the ZTs of its own share of the CPUs, for N of 1, 2, 4 and so on up to
+ * --threads. Its ops_per_sec shows how toyfs_iget scales with them.
+ * statfs_1zt sends all its ops to one ZT, back to back. With --poll_us the
+ * ZTs poll the emulator's ring, and each phase's spin_hits and sleeps say
+ * how many ops found the ZT polling, and how often it gave up and slept.
+ * With --t2_size the mount also gets a T2 image, and t2cache.c is run over
+ * it, its I/O served by the emulator's IOMAP_EXEC: all blocks are written
+ * in order (read-ahead on the misses, eviction of what was synced), synced
+ * and forgotten, then read back and checked, in order and at random.
+ * Unless --io_max is 0, files of 1MB, 4MB and so on up to --io_max are
+ * written and read back in order, EB_IO_CHUNK per op, and checked. The ns
+ * per page of each size show whether finding a file's blocks costs the
+ * same however big the file is.
+ * Results are printed as CSV on stdout.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "zus.h"
+#include "zusd.h"
+#include "../bench.h"
+
+#define EB_DEF_FILES		4096
+#define EB_DEF_SIZE_MB		64
+#define EB_DEF_DIR		"/dev/shm"
+#define EB_DEF_MKFS		"mkfs.toyfs"
+#define EB_FS_NAME		"toyfs"
+#define EB_DEV_UUID		"5a5e6ab1-e2f3-4c05-9b1e-0e5b3e4c4d01"
+#define EB_DEF_T2_SIZE_MB	16
+#define EB_DEF_T2C_PAGES	1024
+/* Block 0 of a T2 is where its copy of the device table goes */
+#define EB_T2_FIRST		1
+#define EB_DEF_IO_MAX_MB	64
+#define EB_IO_CHUNK		(1UL << 20)	/* per write or read op */
+
+struct eb_conf {
+	ulong files;
+	ulong size_mb;
+	ulong t2_mb;
+	ulong t2c_pages;
+	const char *dir;
+	const char *mkfs;
+	ssize_t pa_size;
+	uint poll_us;
+	ulong io_max_mb;
+	uint threads;
+};
+
+struct eb_run {
+	char *t1_path;
+	char *t2_path;
+	struct zuf_emu_mount zem;
+	struct zus_inode_info **zii;	/* per file */
+	uint *cpus;			/* online */
+	uint ncpus;
+	uint cpu;
+	ulong ffree;			/* of the last statfs */
+	ulong t2_blocks;		/* from EB_T2_FIRST */
+	ulong t2_sync_every;
+	uint seed;
+	void *io_buf;			/* EB_IO_CHUNK */
+};
+
+struct eb_phase {
+	const char *name;
+	int (*op)(struct eb_run *ebr, ulong i);
+	/* Or runs, and prints, all of itself */
+	int (*run)(const struct eb_conf *ebc, struct eb_run *ebr);
+	bool t2;	/* Over the T2 blocks, not the files */
+};
+
+/* A lookup_t<N> thread, over files [begin, end) */
+struct eb_thread {
+	struct eb_run *ebr;
+	pthread_t thread;
+	pthread_rwlock_t *start;	/* Write locked until all may go */
+	bool *abort;
+	uint first;		/* Its ZTs are those of ebr->cpus[first], */
+	uint step;		/* [first + step] ... */
+	ulong begin;
+	ulong end;
+};
+
+/* @app, if any, is at offset 0 of the ZT's app window */
+static int _eb_dispatch_to(uint cpu, struct zufs_ioc_hdr *hdr,
+			   uint operation, uint len, void *app, size_t app_len)
+{
+	hdr->operation = operation;
+	hdr->in_len = len;
+	hdr->offset = 0;
+	return zuf_emu_dispatch(0, cpu, hdr, app, app_len);
+}
+
+/* Each op goes to the ZT of the next online CPU */
+static int _eb_dispatch(struct eb_run *ebr, struct zufs_ioc_hdr *hdr,
+			uint operation, uint len)
+{
+	do {
+		ebr->cpu = (ebr->cpu + 1) % zus_num_possible_cpus();
+	} while (!zus_cpu_online(ebr->cpu));
+
+	return _eb_dispatch_to(ebr->cpu, hdr, operation, len, NULL, 0);
+}
+
+static void _eb_name(struct zufs_str *str, ulong i)
+{
+	str->len = snprintf(str->name, sizeof(str->name), "f%lu", i);
+}
+
+/* ~~~ phases ~~~ */
+
+static int _eb_statfs(struct eb_run *ebr, ulong i)
+{
+	struct zufs_ioc_statfs ioc_statfs = {};
+	int err;
+
+	ioc_statfs.sb_id = ebr->zem.sb_id;
+	ioc_statfs.zus_sbi = ebr->zem.sbi;
+	err = _eb_dispatch(ebr, &ioc_statfs.hdr, ZUFS_OP_STATFS,
+			   sizeof(ioc_statfs));
+	if (!err)
+		ebr->ffree = ioc_statfs.statfs_out.f_ffree;
+	return err;
+}
+
+/* Always the same ZT, so it is still polling when the next op comes */
+static int _eb_statfs_1zt(struct eb_run *ebr, ulong i)
+{
+	struct zufs_ioc_statfs ioc_statfs = {};
+
+	ioc_statfs.sb_id = ebr->zem.sb_id;
+	ioc_statfs.zus_sbi = ebr->zem.sbi;
+	return _eb_dispatch_to(ebr->cpu, &ioc_statfs.hdr, ZUFS_OP_STATFS,
+			       sizeof(ioc_statfs), NULL, 0);
+}
+
+static int _eb_create(struct eb_run *ebr, ulong i)
+{
+	struct zufs_ioc_new_inode ioc_new = {};
+	int err;
+
+	ioc_new.zi.i_mode = S_IFREG | 0644;
+	ioc_new.dir_ii = ebr->zem.root_ii;
+	_eb_name(&ioc_new.str, i);
+	err = _eb_dispatch(ebr, &ioc_new.hdr, ZUFS_OP_NEW_INODE,
+			   sizeof(ioc_new));
+	ebr->zii[i] = err ? NULL : ioc_new.zus_ii;
+	return err;
+}
+
+static int _eb_put(struct eb_run *ebr, ulong i, uint operation)
+{
+	struct zufs_ioc_evict_inode ziei = {};
+	int err;
+
+	ziei.zus_ii = ebr->zii[i];
+	err = _eb_dispatch(ebr, &ziei.hdr, operation, sizeof(ziei));
+	ebr->zii[i] = NULL;
+	return err;
+}
+
+static int _eb_evict(struct eb_run *ebr, ulong i)
+{
+	return _eb_put(ebr, i, ZUFS_OP_EVICT_INODE);
+}
+
+static int _eb_lookup(struct eb_run *ebr, ulong i)
+{
+	struct zufs_ioc_lookup lookup = {};
+	int err;
+
+	lookup.dir_ii = ebr->zem.root_ii;
+	_eb_name(&lookup.str, i);
+	err = _eb_dispatch(ebr, &lookup.hdr, ZUFS_OP_LOOKUP, sizeof(lookup));
+	ebr->zii[i] = err ? NULL : lookup.zus_ii;
+	return err;
+}
+
+static int _eb_unlink(struct eb_run *ebr, ulong i)
+{
+	struct zufs_ioc_dentry zid = {};
+
+	zid.zus_dir_ii = ebr->zem.root_ii;
+	zid.zus_ii = ebr->zii[i];
+	_eb_name(&zid.str, i);
+	return _eb_dispatch(ebr, &zid.hdr, ZUFS_OP_REMOVE_DENTRY, sizeof(zid));
+}
+
+static int _eb_free(struct eb_run *ebr, ulong i)
+{
+	return _eb_put(ebr, i, ZUFS_OP_FREE_INODE);
+}
+
+/* ~~~ t2cache phases ~~~ */
+
+static void _eb_t2_fill(ulong *p, ulong bn)
+{
+	ulong k;
+
+	for (k = 0; k < PAGE_SIZE / sizeof(*p); ++k)
+		p[k] = bn * PAGE_SIZE + k;
+}
+
+static bool _eb_t2_check(const ulong *p, ulong bn)
+{
+	ulong k;
+
+	for (k = 0; k < PAGE_SIZE / sizeof(*p); ++k)
+		if (p[k] != bn * PAGE_SIZE + k)
+			return false;
+	return true;
+}
+
+static int _eb_t2_write(struct eb_run *ebr, ulong i)
+{
+	struct zus_sb_info *sbi = ebr->zem.sbi;
+	ulong bn = EB_T2_FIRST + i;
+	void *addr;
+	int err;
+
+	err = zus_t2cache_get(sbi, bn, &addr);
+	if (unlikely(err))
+		return err;
+	_eb_t2_fill(addr, bn);
+	zus_t2cache_dirty(sbi, bn);
+	zus_t2cache_put(sbi, bn);
+
+	/* Only clean blocks are evicted */
+	if (!((i + 1) % ebr->t2_sync_every) || i + 1 == ebr->t2_blocks)
+		err = zus_t2cache_sync(sbi);
+	return err;
+}
+
+static int _eb_t2_forget(struct eb_run *ebr, ulong i)
+{
+	zus_t2cache_forget(ebr->zem.sbi, EB_T2_FIRST + i);
+	return 0;
+}
+
+static int _eb_t2_read(struct eb_run *ebr, ulong bn)
+{
+	struct zus_sb_info *sbi = ebr->zem.sbi;
+	void *addr;
+	bool ok;
+	int err;
+
+	err = zus_t2cache_get(sbi, bn, &addr);
+	if (unlikely(err))
+		return err;
+	ok = _eb_t2_check(addr, bn);
+	zus_t2cache_put(sbi, bn);
+	if (unlikely(!ok)) {
+		fprintf(stderr, "# t2 bn=%lu is not what was written\n", bn);
+		return -EIO;
+	}
+	return 0;
+}
+
+static int _eb_t2_seq_read(struct eb_run *ebr, ulong i)
+{
+	return _eb_t2_read(ebr, EB_T2_FIRST + i);
+}
+
+static int _eb_t2_rand_read(struct eb_run *ebr, ulong i)
+{
+	return _eb_t2_read(ebr, EB_T2_FIRST +
+				rand_r(&ebr->seed) % ebr->t2_blocks);
+}
+
+/* forward declaration */
+static int _eb_lookup_mt(const struct eb_conf *ebc, struct eb_run *ebr);
+
+static const struct eb_phase eb_phases[] = {
+	{ .name = "statfs", .op = _eb_statfs },
+	{ .name = "statfs_1zt", .op = _eb_statfs_1zt },
+	{ .name = "create", .op = _eb_create },
+	{ .name = "evict", .op = _eb_evict },
+	{ .name = "lookup_mt", .run = _eb_lookup_mt },
+	{ .name = "lookup", .op = _eb_lookup },
+	{ .name = "unlink", .op = _eb_unlink },
+	{ .name = "free", .op = _eb_free },
+	{ .name = "t2_write", .op = _eb_t2_write, .t2 = true },
+	{ .name = "t2_forget", .op = _eb_t2_forget, .t2 = true },
+	{ .name = "t2_seq_read", .op = _eb_t2_seq_read, .t2 = true },
+	{ .name = "t2_rand_read", .op = _eb_t2_rand_read, .t2 = true },
+};
+
+/* Whatever was created is gone, so is its dentry */
+static int _eb_verify(struct eb_run *ebr)
+{
+	ulong ffree = ebr->ffree;
+	int err;
+
+	err = _eb_lookup(ebr, 0);
+	if (err != -ENOENT) {
+		fprintf(stderr, "# lookup of an unlinked file => %d\n", err);
+		return -EINVAL;
+	}
+
+	err = _eb_statfs(ebr, 0);
+	if (unlikely(err))
+		return err;
+	if (ebr->ffree != ffree) {
+		fprintf(stderr, "# ffree %lu, before all %lu\n", ebr->ffree,
+			ffree);
+		return -EINVAL;
+	}
+	return 0;
+}
+
+/* ~~~ file I/O ~~~ */
+
+static void _eb_row(const char *name, ulong n, ulong ns,
+		    const struct zus_zt_poll_stats *ps0)
+{
+	struct zus_zt_poll_stats ps1;
+
+	zus_zt_poll_stats(&ps1);
+	printf("%s,%lu,%.6f,%.0f,%.0f,%lu,%lu\n", name, n, ns / 1e9,
+	       (double)ns / n, n * 1e9 / ns, ps1.spin_hits - ps0->spin_hits,
+	       ps1.sleeps - ps0->sleeps);
+	fflush(stdout);
+}
+
+/* Each page starts with its index in the file */
+static int _eb_io(struct eb_run *ebr, struct zus_inode_info *zii,
+		  ulong size, bool wr)
+{
+	struct zufs_ioc_IO io;
+	ulong off, pg;
+	int err;
+
+	for (off = 0; off < size; off += EB_IO_CHUNK) {
+		if (wr)
+			for (pg = 0; pg < EB_IO_CHUNK; pg += PAGE_SIZE)
+				*(ulong *)(ebr->io_buf + pg) =
+						(off + pg) / PAGE_SIZE;
+
+		memset(&io, 0, sizeof(io));
+		io.zus_ii = zii;
+		io.filepos = off;
+		io.hdr.len = EB_IO_CHUNK;
+		err = _eb_dispatch_to(ebr->cpu, &io.hdr,
+				      wr ? ZUFS_OP_WRITE : ZUFS_OP_READ,
+				      sizeof(io), ebr->io_buf, EB_IO_CHUNK);
+		if (unlikely(err))
+			return err;
+		if (unlikely(io.last_pos != off + EB_IO_CHUNK))
+			return -EIO;
+
+		if (!wr)
+			for (pg = 0; pg < EB_IO_CHUNK; pg += PAGE_SIZE)
+				if (*(ulong *)(ebr->io_buf + pg) !=
+				    (off + pg) / PAGE_SIZE)
+					return -EIO;
+	}
+	return 0;
+}
+
+/* A new file of @size is written, read back, then unlinked and freed */
+static int _eb_io_size(struct eb_run *ebr, ulong size)
+{
+	struct zufs_ioc_new_inode ioc_new = {};
+	struct zufs_ioc_evict_inode ziei = {};
+	struct zufs_ioc_dentry zid = {};
+	struct zus_zt_poll_stats ps0;
+	ulong pages = size / PAGE_SIZE;
+	ulong start;
+	char name[32];
+	int err, rerr;
+
+	ioc_new.zi.i_mode = S_IFREG | 0644;
+	ioc_new.dir_ii = ebr->zem.root_ii;
+	ioc_new.str.len = snprintf(ioc_new.str.name,
+				   sizeof(ioc_new.str.name), "io%lu", size);
+	err = _eb_dispatch(ebr, &ioc_new.hdr, ZUFS_OP_NEW_INODE,
+			   sizeof(ioc_new));
+	if (unlikely(err))
+		return err;
+
+	snprintf(name, sizeof(name), "write_%luM", size >> 20);
+	zus_zt_poll_stats(&ps0);
+	start = bench_now_ns();
+	err = _eb_io(ebr, ioc_new.zus_ii, size, true);
+	if (likely(!err))
+		_eb_row(name, pages, bench_now_ns() - start, &ps0);
+
+	if (likely(!err)) {
+		snprintf(name, sizeof(name), "read_%luM", size >> 20);
+		zus_zt_poll_stats(&ps0);
+		start = bench_now_ns();
+		err = _eb_io(ebr, ioc_new.zus_ii, size, false);
+		if (likely(!err))
+			_eb_row(name, pages, bench_now_ns() - start, &ps0);
+	}
+	if (unlikely(err))
+		fprintf(stderr, "# io of %luM => %d\n", size >> 20, err);
+
+	zid.zus_dir_ii = ebr->zem.root_ii;
+	zid.zus_ii = ioc_new.zus_ii;
+	zid.str = ioc_new.str;
+	rerr = _eb_dispatch(ebr, &zid.hdr, ZUFS_OP_REMOVE_DENTRY, sizeof(zid));
+	if (likely(!rerr)) {
+		ziei.zus_ii = ioc_new.zus_ii;
+		rerr = _eb_dispatch(ebr, &ziei.hdr, ZUFS_OP_FREE_INODE,
+				    sizeof(ziei));
+	}
+	return err ?: rerr;
+}
+
+/* ~~~ lookup from many threads ~~~ */
+
+static void *_eb_lookup_thread(void *arg)
+{
+	struct eb_thread *et = arg;
+	struct eb_run *ebr = et->ebr;
+	uint c = et->first;
+	ulong i;
+	int err = 0;
+
+	pthread_rwlock_rdlock(et->start);
+	pthread_rwlock_unlock(et->start);
+	if (*et->abort)
+		return NULL;
+
+	for (i = et->begin; i < et->end; ++i) {
+		struct zufs_ioc_lookup lookup = {};
+		struct zufs_ioc_evict_inode ziei = {};
+		uint cpu = ebr->cpus[c];
+
+		c += et->step;
+		if (c >= ebr->ncpus)
+			c = et->first;
+
+		lookup.dir_ii = ebr->zem.root_ii;
+		_eb_name(&lookup.str, i);
+		err = _eb_dispatch_to(cpu, &lookup.hdr, ZUFS_OP_LOOKUP,
+				      sizeof(lookup), NULL, 0);
+		if (unlikely(err))
+			break;
+
+		ziei.zus_ii = lookup.zus_ii;
+		err = _eb_dispatch_to(cpu, &ziei.hdr, ZUFS_OP_EVICT_INODE,
+				      sizeof(ziei), NULL, 0);
+		if (unlikely(err))
+			break;
+	}
+	if (unlikely(err))
+		fprintf(stderr, "# lookup f%lu => %d\n", i, err);
+	return (void *)(long)err;
+}
+
+/* All files looked up and dropped again, split between @nthreads */
+static int _eb_lookup_mt_n(const struct eb_conf *ebc, struct eb_run *ebr,
+			   uint nthreads)
+{
+	struct zus_zt_poll_stats ps0;
+	struct eb_thread *ets;
+	pthread_rwlock_t start;
+	uint i, created = 0;
+	bool abort = false;
+	char name[32];
+	ulong t0;
+	int err = 0;
+
+	ets = calloc(nthreads, sizeof(*ets));
+	if (unlikely(!ets))
+		return -ENOMEM;
+
+	pthread_rwlock_init(&start, NULL);
+	pthread_rwlock_wrlock(&start);
+
+	for (i = 0; i < nthreads; ++i) {
+		struct eb_thread *et = &ets[i];
+		struct zus_thread_params tp;
+
+		et->ebr = ebr;
+		et->start = &start;
+		et->abort = &abort;
+		et->first = i % ebr->ncpus;
+		et->step = nthreads;
+		et->begin = ebc->files * i / nthreads;
+		et->end = ebc->files * (i + 1) / nthreads;
+
+		ZTP_INIT(&tp);
+		tp.name = "emu_bench";
+		err = zus_thread_create(&et->thread, &tp, _eb_lookup_thread,
+					et);
+		if (unlikely(err))
+			break;
+		++created;
+	}
+
+	/* If not all could be created, the others just exit */
+	abort = (created < nthreads);
+	zus_zt_poll_stats(&ps0);
+	t0 = bench_now_ns();
+	pthread_rwlock_unlock(&start);
+
+	for (i = 0; i < created; ++i) {
+		void *tret;
+
+		pthread_join(ets[i].thread, &tret);
+		if (tret && !err)
+			err = (long)tret;
+	}
+
+	if (!err) {
+		snprintf(name, sizeof(name), "lookup_t%u", nthreads);
+		_eb_row(name, ebc->files, bench_now_ns() - t0, &ps0);
+	}
+
+	pthread_rwlock_destroy(&start);
+	free(ets);
+	return err;
+}
+
+/* 1, 2, 4 ... threads, and --threads last */
+static int _eb_lookup_mt(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	uint n;
+	int err;
+
+	for (n = 1; n < ebc->threads; n *= 2) {
+		err = _eb_lookup_mt_n(ebc, ebr, n);
+		if (unlikely(err))
+			return err;
+	}
+	return _eb_lookup_mt_n(ebc, ebr, ebc->threads);
+}
+
+/* 1MB, then 4 times as big each time, and --io_max last */
+static int _eb_io_run(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	ulong mb;
+	int err;
+
+	for (mb = 1; mb < ebc->io_max_mb; mb *= 4) {
+		err = _eb_io_size(ebr, mb << 20);
+		if (unlikely(err))
+			return err;
+	}
+	return _eb_io_size(ebr, ebc->io_max_mb << 20);
+}
+
+static int _eb_run(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	struct zus_zt_poll_stats ps0;
+	ulong i, n, start;
+	uint p;
+	int err = 0;
+
+	for (p = 0; p < ARRAY_SIZE(eb_phases); ++p) {
+		const struct eb_phase *ebp = &eb_phases[p];
+
+		if (ebp->run) {
+			err = ebp->run(ebc, ebr);
+			if (unlikely(err))
+				return err;
+			continue;
+		}
+
+		n = ebp->t2 ? ebr->t2_blocks : ebc->files;
+		if (!n)
+			continue;
+
+		zus_zt_poll_stats(&ps0);
+		start = bench_now_ns();
+		for (i = 0; i < n; ++i) {
+			err = ebp->op(ebr, i);
+			if (unlikely(err)) {
+				fprintf(stderr, "# %s %lu => %d\n", ebp->name,
+					i, err);
+				return err;
+			}
+		}
+		_eb_row(ebp->name, n, bench_now_ns() - start, &ps0);
+	}
+
+	if (ebc->io_max_mb) {
+		err = _eb_io_run(ebc, ebr);
+		if (unlikely(err))
+			return err;
+	}
+
+	return _eb_verify(ebr);
+}
+
+/* ~~~ image ~~~ */
+
+/* A new file of @size_mb in --dir, its name returned in @path */
+static int _eb_image(const struct eb_conf *ebc, const char *name,
+		     ulong size_mb, char **path)
+{
+	int fd, err;
+
+	if (asprintf(path, "%s/%s.XXXXXX", ebc->dir, name) < 0) {
+		*path = NULL;
+		return -ENOMEM;
+	}
+	fd = mkstemp(*path);
+	if (fd < 0) {
+		err = -errno;
+		free(*path);
+		*path = NULL;
+		return err;
+	}
+	err = ftruncate(fd, size_mb << 20) ? -errno : 0;
+	close(fd);
+	return err;
+}
+
+static int _eb_mkfs(const struct eb_conf *ebc, const char *path)
+{
+	int status;
+	pid_t pid;
+
+	pid = fork();
+	if (pid < 0)
+		return -errno;
+	if (!pid) {
+		/* Its chatter is not CSV */
+		dup2(STDERR_FILENO, STDOUT_FILENO);
+		execlp(ebc->mkfs, ebc->mkfs, EB_DEV_UUID, path, NULL);
+		_exit(127);
+	}
+
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "# %s %s failed\n", ebc->mkfs, path);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* toyfs has no use for T2, but md maps whatever T2 the device table lists.
+ * So one is added to the table mkfs wrote, at toyfs' rfi.dt_offset of 0.
+ */
+static int _eb_add_t2(const char *t1_path, ulong t2_mb)
+{
+	struct md_dev_table *mdt;
+	struct md_dev_id *dev_id;
+	int fd, err = 0;
+
+	mdt = malloc(sizeof(*mdt));
+	if (unlikely(!mdt))
+		return -ENOMEM;
+
+	fd = open(t1_path, O_RDWR);
+	if (fd < 0) {
+		err = -errno;
+		goto out;
+	}
+	if (pread(fd, mdt, sizeof(*mdt), 0) != (ssize_t)sizeof(*mdt)) {
+		err = -EIO;
+		goto out_close;
+	}
+
+	dev_id = &mdt->s_dev_list.dev_ids[mdt->s_dev_list.t1_count];
+	memset(dev_id, 0, sizeof(*dev_id));
+	memset(&dev_id->uuid, 0xe2, sizeof(dev_id->uuid));
+	dev_id->blocks = md_o2p(t2_mb << 20);
+	mdt->s_dev_list.t2_count = 1;
+	mdt->s_sum = md_calc_csum(mdt);
+
+	if (pwrite(fd, mdt, sizeof(*mdt), 0) != (ssize_t)sizeof(*mdt))
+		err = -EIO;
+
+out_close:
+	close(fd);
+out:
+	free(mdt);
+	return err;
+}
+
+static int _eb_images(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	int err;
+
+	err = _eb_image(ebc, "zus_emu_bench", ebc->size_mb, &ebr->t1_path);
+	if (unlikely(err))
+		return err;
+	err = _eb_mkfs(ebc, ebr->t1_path);
+	if (unlikely(err) || !ebc->t2_mb)
+		return err;
+
+	err = _eb_image(ebc, "zus_emu_bench_t2", ebc->t2_mb, &ebr->t2_path);
+	if (unlikely(err))
+		return err;
+	ebr->zem.t2_path = ebr->t2_path;
+	return _eb_add_t2(ebr->t1_path, ebc->t2_mb);
+}
+
+static void _eb_images_free(struct eb_run *ebr)
+{
+	if (ebr->t1_path)
+		unlink(ebr->t1_path);
+	if (ebr->t2_path)
+		unlink(ebr->t2_path);
+	free(ebr->t1_path);
+	free(ebr->t2_path);
+}
+
+/* The t2cache is torn down, and written back, by zus at umount */
+static int _eb_t2_init(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	struct zus_sb_info *sbi = ebr->zem.sbi;
+	ulong blocks = md_t2_blocks(&sbi->md);
+
+	if (unlikely(blocks <= EB_T2_FIRST)) {
+		fprintf(stderr, "# no T2 at mount\n");
+		return -ENODEV;
+	}
+	ebr->t2_blocks = blocks - EB_T2_FIRST;
+	ebr->t2_sync_every = ebc->t2c_pages / 2 ?: 1;
+	ebr->seed = 1;
+	return zus_t2cache_init(sbi, ebc->t2c_pages);
+}
+
+static int _eb_mount_run(const struct eb_conf *ebc, struct eb_run *ebr)
+{
+	struct zus_thread_params tp;
+	int err, uerr;
+	uint cpu;
+
+	ebr->zii = calloc(ebc->files, sizeof(*ebr->zii));
+	ebr->io_buf = malloc(EB_IO_CHUNK);
+	ebr->cpus = calloc(zus_num_possible_cpus(), sizeof(*ebr->cpus));
+	if (unlikely(!ebr->zii || !ebr->io_buf || !ebr->cpus)) {
+		err = -ENOMEM;
+		goto out;
+	}
+	zus_for_each_cpu(cpu, zus_cpu_online_mask)
+		ebr->cpus[ebr->ncpus++] = cpu;
+
+	ZTP_INIT(&tp);
+	tp.poll_us = ebc->poll_us;
+	err = zus_mount_thread_start(&tp, NULL);
+	if (unlikely(err))
+		goto out;
+
+	ebr->zem.fs_name = EB_FS_NAME;
+	ebr->zem.pmem_path = ebr->t1_path;
+	err = zuf_emu_mount(&ebr->zem);
+	if (unlikely(err)) {
+		fprintf(stderr, "# mount %s => %d\n", ebr->t1_path, err);
+		goto stop;
+	}
+
+	if (ebc->t2_mb)
+		err = _eb_t2_init(ebc, ebr);
+	if (likely(!err)) {
+		printf("op,n,secs,ns_per_op,ops_per_sec,spin_hits,sleeps\n");
+		fflush(stdout);
+		err = _eb_run(ebc, ebr);
+	}
+
+	uerr = zuf_emu_umount(&ebr->zem);
+	if (unlikely(uerr)) {
+		fprintf(stderr, "# umount => %d\n", uerr);
+		err = err ?: uerr;
+	}
+
+stop:
+	zuf_emu_stop();
+	zus_mount_thread_stop();
+out:
+	free(ebr->cpus);
+	free(ebr->io_buf);
+	free(ebr->zii);
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	"usage: %s [options]\n"
+	"	--files=N	Files of each phase. Default %u\n"
+	"	--size=MB	Size of the image. Default %u\n"
+	"	--t2_size=MB	Size of the T2 image, 0 for none. Default %u\n"
+	"	--t2_cache=N	Pages the t2cache holds. Default %u\n"
+	"	--dir=PATH	Where the image is made, best a tmpfs.\n"
+	"			Default %s\n"
+	"	--mkfs=PATH	Of mkfs.toyfs. Default %s from $PATH\n"
+	"	--pa_size=B	Size of the zus page allocator\n"
+	"	--poll_us=USEC	ZTs poll the ring this long after an op.\n"
+	"			Default 0, they sleep at once\n"
+	"	--io_max=MB	Largest file of the I/O phases, 0 for none.\n"
+	"			--size grows to fit it. Default %u\n"
+	"	--threads=N	Most threads of lookup_t<N>.\n"
+	"			Default the online CPUs\n"
+	"\n"
+	"libtoyfs.so is loaded as by zusd, from %s or LD_LIBRARY_PATH,\n"
+	"unless %s says otherwise.\n"
+	"Prints CSV: op,n,secs,ns_per_op,ops_per_sec,spin_hits,sleeps\n",
+	prog, EB_DEF_FILES, EB_DEF_SIZE_MB, EB_DEF_T2_SIZE_MB,
+	EB_DEF_T2C_PAGES, EB_DEF_DIR, EB_DEF_MKFS, EB_DEF_IO_MAX_MB,
+	ZUS_LIBFS_DIR, ZUFS_LIBFS_LIST);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option opt[] = {
+		{.name = "files", .has_arg = 1, .flag = NULL, .val = 'f'},
+		{.name = "size", .has_arg = 1, .flag = NULL, .val = 's'},
+		{.name = "t2_size", .has_arg = 1, .flag = NULL, .val = 't'},
+		{.name = "t2_cache", .has_arg = 1, .flag = NULL, .val = 'c'},
+		{.name = "dir", .has_arg = 1, .flag = NULL, .val = 'd'},
+		{.name = "mkfs", .has_arg = 1, .flag = NULL, .val = 'm'},
+		{.name = "pa_size", .has_arg = 1, .flag = NULL, .val = 'p'},
+		{.name = "poll_us", .has_arg = 1, .flag = NULL, .val = 'u'},
+		{.name = "io_max", .has_arg = 1, .flag = NULL, .val = 'i'},
+		{.name = "threads", .has_arg = 1, .flag = NULL, .val = 'T'},
+		{.name = "help", .has_arg = 0, .flag = NULL, .val = 'h'},
+		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+	};
+	const char *shortopt = "f:s:t:c:d:m:p:u:i:T:h";
+	struct eb_conf ebc = {
+		.files = EB_DEF_FILES,
+		.size_mb = EB_DEF_SIZE_MB,
+		.t2_mb = EB_DEF_T2_SIZE_MB,
+		.t2c_pages = EB_DEF_T2C_PAGES,
+		.dir = EB_DEF_DIR,
+		.mkfs = EB_DEF_MKFS,
+		.io_max_mb = EB_DEF_IO_MAX_MB,
+	};
+	struct eb_run ebr = {};
+	int op, err;
+
+	while ((op = getopt_long(argc, argv, shortopt, opt, NULL)) != -1) {
+		switch (op) {
+		case 'f':
+			ebc.files = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			ebc.size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			ebc.t2_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			ebc.t2c_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			ebc.dir = optarg;
+			break;
+		case 'm':
+			ebc.mkfs = optarg;
+			break;
+		case 'p':
+			ebc.pa_size = atol(optarg);
+			break;
+		case 'u':
+			ebc.poll_us = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			ebc.io_max_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'T':
+			ebc.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!ebc.files || !ebc.size_mb || !ebc.t2c_pages) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* The largest file, its tree nodes and what the other phases use */
+	if (ebc.size_mb < ebc.io_max_mb + ebc.io_max_mb / 8 + EB_DEF_SIZE_MB)
+		ebc.size_mb = ebc.io_max_mb + ebc.io_max_mb / 8 +
+			      EB_DEF_SIZE_MB;
+
+	/* The default, for when toyfs is where the linker finds it */
+	setenv(ZUFS_LIBFS_LIST, EB_FS_NAME, 0);
+
+	err = _eb_images(&ebc, &ebr);
+	if (unlikely(err)) {
+		fprintf(stderr, "images => %d\n", err);
+		_eb_images_free(&ebr);
+		return 1;
+	}
+
+	err = bench_emu_init(ebc.pa_size, NULL);
+	if (unlikely(err)) {
+		fprintf(stderr, "init => %d\n", err);
+		_eb_images_free(&ebr);
+		return 1;
+	}
+
+	/* The NUMA map is known from here on */
+	if (!ebc.threads)
+		ebc.threads = zus_num_online_cpus();
+	err = _eb_mount_run(&ebc, &ebr);
+
+	bench_emu_fini();
+	_eb_images_free(&ebr);
+	return err ? 1 : 0;
+}
@@ -0,0 +1,352 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * pa_bench.c - Stress of pa_alloc_order/pa_put_page under fragmentation
+ *
+ * Each thread owns a table of slots. It first fills all of them with blocks
+ * of random orders, then frees every other one, which leaves the free lists
+ * fragmented. The timed phase then picks random slots: a full slot is
+ * freed, an empty one gets a new block of a random order. Threads are
+ * created by zus_thread_create, each pinned to its own CPU. Results are
+ * printed as CSV on stdout.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+
+#include "zus.h"
+#include "../bench.h"
+
+#define PB_DEF_ITERS		(1 << 18)
+#define PB_DEF_SLOTS		4096
+
+struct pb_thread {
+	pthread_t thread;
+	struct zus_sb_info *sbi;
+	struct pa_page **slot;
+	int *order;
+	uint nslots;
+	int max_order;
+	uint seed;
+	ulong iters;
+	ulong ops;
+	ulong ns;
+	struct bench_lat lat_alloc;
+	struct bench_lat lat_free;
+	pthread_barrier_t *start;
+	bool *abort;		/* Not all threads could be created */
+};
+
+/* ~~~ stress ~~~ */
+
+static int _pb_alloc(struct pb_thread *pt, uint s, struct bench_lat *lat,
+		     ulong op)
+{
+	int order = rand_r(&pt->seed) % (pt->max_order + 1);
+	ulong start = 0;
+	bool want = lat && bench_lat_want(lat, op);
+
+	if (want)
+		start = zus_stats_now();
+	pt->slot[s] = pa_alloc_order(pt->sbi, order);
+	if (want)
+		lat->samples[lat->n++] = zus_stats_now() - start;
+
+	if (unlikely(!pt->slot[s]))
+		return -ENOMEM;
+	pt->order[s] = order;
+	return 0;
+}
+
+static void _pb_free(struct pb_thread *pt, uint s, struct bench_lat *lat,
+		     ulong op)
+{
+	struct pa_page *page = pt->slot[s];
+	ulong start = 0;
+	bool want = lat && bench_lat_want(lat, op);
+	int i;
+
+	if (want)
+		start = zus_stats_now();
+	for (i = 0; i < (1 << pt->order[s]); ++i)
+		pa_put_page(page + i);
+	if (want)
+		lat->samples[lat->n++] = zus_stats_now() - start;
+
+	pt->slot[s] = NULL;
+}
+
+/* Fills all slots then frees every other one */
+static int _pb_fragment(struct pb_thread *pt)
+{
+	uint s;
+	int err;
+
+	for (s = 0; s < pt->nslots; ++s) {
+		err = _pb_alloc(pt, s, NULL, 0);
+		if (unlikely(err))
+			return err;
+	}
+	for (s = 0; s < pt->nslots; s += 2)
+		_pb_free(pt, s, NULL, 0);
+	return 0;
+}
+
+static void _pb_release(struct pb_thread *pt)
+{
+	uint s;
+
+	for (s = 0; s < pt->nslots; ++s)
+		if (pt->slot[s])
+			_pb_free(pt, s, NULL, 0);
+}
+
+static int _pb_run(struct pb_thread *pt)
+{
+	ulong op;
+	uint s;
+	int err;
+
+	for (op = 0; op < pt->iters; ++op) {
+		s = rand_r(&pt->seed) % pt->nslots;
+		if (pt->slot[s]) {
+			_pb_free(pt, s, &pt->lat_free, op);
+		} else {
+			err = _pb_alloc(pt, s, &pt->lat_alloc, op);
+			if (unlikely(err))
+				return err;
+		}
+	}
+	pt->ops = op;
+	return 0;
+}
+
+static void *_pb_thread(void *arg)
+{
+	struct pb_thread *pt = arg;
+	ulong start;
+	int err;
+
+	err = _pb_fragment(pt);
+	pthread_barrier_wait(pt->start);
+	if (*pt->abort || err)
+		goto out;
+
+	start = bench_now_ns();
+	err = _pb_run(pt);
+	pt->ns = bench_now_ns() - start;
+
+out:
+	_pb_release(pt);
+	return (void *)(long)err;
+}
+
+/* ~~~ driver ~~~ */
+
+struct pb_conf {
+	uint max_threads;
+	ulong iters;
+	uint nslots;
+	int max_order;
+};
+
+static void _pb_thread_free(struct pb_thread *pt)
+{
+	free(pt->slot);
+	free(pt->order);
+	bench_lat_fini(&pt->lat_alloc);
+	bench_lat_fini(&pt->lat_free);
+}
+
+static int _pb_thread_init(struct pb_thread *pt, const struct pb_conf *pbc,
+			   int max_order, uint i)
+{
+	int err;
+
+	pt->sbi = zus_global_sbi();
+	pt->nslots = pbc->nslots;
+	pt->max_order = max_order;
+	pt->iters = pbc->iters;
+	pt->seed = i + 1;
+	pt->slot = calloc(pt->nslots, sizeof(*pt->slot));
+	pt->order = calloc(pt->nslots, sizeof(*pt->order));
+	if (!pt->slot || !pt->order)
+		return -ENOMEM;
+
+	err = bench_lat_init(&pt->lat_alloc, pt->iters);
+	if (!err)
+		err = bench_lat_init(&pt->lat_free, pt->iters);
+	return err;
+}
+
+static int _run_one(const struct pb_conf *pbc, int max_order, uint nthreads)
+{
+	struct pb_thread *pts;
+	pthread_barrier_t start;
+	double mops, a50, a99, f50, f99;
+	ulong ops = 0, ns = 0;
+	uint i, cpu, created = 0;
+	bool abort = false;
+	int err = 0;
+
+	pts = calloc(nthreads, sizeof(*pts));
+	if (!pts)
+		return -ENOMEM;
+
+	pthread_barrier_init(&start, NULL, nthreads);
+
+	cpu = zus_cpumask_next(-1, zus_cpu_online_mask);
+	for (i = 0; i < nthreads; ++i) {
+		struct pb_thread *pt = &pts[i];
+		struct zus_thread_params tp;
+
+		pt->start = &start;
+		pt->abort = &abort;
+		err = _pb_thread_init(pt, pbc, max_order, i);
+		if (err)
+			break;
+
+		ZTP_INIT(&tp);
+		tp.name = "pa_bench";
+		tp.one_cpu = cpu;
+		err = zus_thread_create(&pt->thread, &tp, _pb_thread, pt);
+		if (err)
+			break;
+		++created;
+		cpu = zus_cpumask_next(cpu, zus_cpu_online_mask);
+	}
+
+	/* Release those who wait for the ones never created */
+	abort = (created < nthreads);
+	for (i = created; i < nthreads; ++i)
+		pthread_barrier_wait(&start);
+
+	for (i = 0; i < created; ++i) {
+		void *tret;
+
+		pthread_join(pts[i].thread, &tret);
+		if (tret && !err)
+			err = (long)tret;
+		ops += pts[i].ops;
+		if (pts[i].ns > ns)
+			ns = pts[i].ns;
+	}
+
+	if (!err && ns) {
+		mops = (double)ops * 1000.0 / ns;
+		bench_lat_percentiles(&pts->lat_alloc, nthreads, sizeof(*pts),
+				      &a50, &a99);
+		bench_lat_percentiles(&pts->lat_free, nthreads, sizeof(*pts),
+				      &f50, &f99);
+		printf("%d,%u,%u,%lu,%.6f,%.3f,%.0f,%.0f,%.0f,%.0f\n",
+		       max_order, nthreads, pbc->nslots, ops, ns / 1e9, mops,
+		       a50, a99, f50, f99);
+		fflush(stdout);
+	} else if (err) {
+		fprintf(stderr, "# %d,%u failed => %d\n", max_order, nthreads,
+			err);
+	}
+
+	pthread_barrier_destroy(&start);
+	for (i = 0; i < nthreads; ++i)
+		_pb_thread_free(&pts[i]);
+	free(pts);
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	"usage: %s [options]\n"
+	"	--threads=N	Up to N threads, doubling from 1.\n"
+	"			Default is the number of online CPUs\n"
+	"	--iters=N	Operations per thread. Default %u\n"
+	"	--slots=N	Blocks held per thread at most. Default %u\n"
+	"	--max_order=N	Orders up to N, in turn from 0. Default %u\n"
+	"	--pa_size=B	Size of the zus page allocator\n"
+	"\n"
+	"Prints CSV: max_order,threads,slots,ops,secs,mops,\n"
+	"	alloc_p50_ns,alloc_p99_ns,free_p50_ns,free_p99_ns\n",
+	prog, PB_DEF_ITERS, PB_DEF_SLOTS, PA_MAX_ORDER);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option opt[] = {
+		{.name = "threads", .has_arg = 1, .flag = NULL, .val = 't'},
+		{.name = "iters", .has_arg = 1, .flag = NULL, .val = 'i'},
+		{.name = "slots", .has_arg = 1, .flag = NULL, .val = 's'},
+		{.name = "max_order", .has_arg = 1, .flag = NULL, .val = 'o'},
+		{.name = "pa_size", .has_arg = 1, .flag = NULL, .val = 'p'},
+		{.name = "help", .has_arg = 0, .flag = NULL, .val = 'h'},
+		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+	};
+	const char *shortopt = "t:i:s:o:p:h";
+	struct pb_conf pbc = {
+		.max_threads = get_nprocs(),
+		.iters = PB_DEF_ITERS,
+		.nslots = PB_DEF_SLOTS,
+		.max_order = PA_MAX_ORDER,
+	};
+	ssize_t pa_size = 0;
+	uint nthreads;
+	int op, max_order, err;
+
+	while ((op = getopt_long(argc, argv, shortopt, opt, NULL)) != -1) {
+		switch (op) {
+		case 't':
+			pbc.max_threads = atoi(optarg);
+			break;
+		case 'i':
+			pbc.iters = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			pbc.nslots = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			pbc.max_order = atoi(optarg);
+			break;
+		case 'p':
+			pa_size = atol(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!pbc.max_threads || !pbc.nslots || !pbc.iters ||
+	    pbc.max_order < 0 || PA_MAX_ORDER < pbc.max_order) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	err = bench_emu_init(pa_size, NULL);
+	if (unlikely(err)) {
+		fprintf(stderr, "init => %d\n", err);
+		return 1;
+	}
+	if (pbc.max_threads > zus_num_online_cpus())
+		pbc.max_threads = zus_num_online_cpus();
+
+	bench_ns_per_tick();
+
+	printf("max_order,threads,slots,ops,secs,mops,"
+	       "alloc_p50_ns,alloc_p99_ns,free_p50_ns,free_p99_ns\n");
+
+	for (max_order = 0; max_order <= pbc.max_order; ++max_order)
+		for (nthreads = 1; nthreads <= pbc.max_threads; nthreads *= 2)
+			_run_one(&pbc, max_order, nthreads);
+
+	bench_emu_fini();
+	return 0;
+}
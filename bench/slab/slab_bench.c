@@ -0,0 +1,458 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * slab_bench.c - Throughput and latency of zus_malloc/zus_free
+ *
+ * Runs, for each allocator, size and number of threads, two patterns:
+ *  same	- Each thread allocates a batch then frees it, LIFO.
+ *  cross	- Threads are paired. A producer allocates and hands the
+ *		  pointers, through a ring, to its consumer which frees them.
+ * Threads are created by zus_thread_create, each pinned to its own CPU.
+ * glibc malloc and, when it can be dlopen'ed, jemalloc run the same
+ * patterns as baselines. Results are printed as CSV on stdout.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+
+#include "zus.h"
+#include "../bench.h"
+
+#define SB_BATCH		64
+#define SB_RING_SIZE		1024	/* power of 2 */
+#define SB_DEF_ITERS		(1 << 20)
+#define SB_JEMALLOC_LIB		"libjemalloc.so.2"
+#define SB_NOMEM		((void *)-1L)	/* producer failed */
+
+struct sb_alloc {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+};
+
+enum { SB_SAME, SB_CROSS };
+static const char *sb_pattern_name[] = { "same", "cross" };
+
+struct sb_ring {
+	volatile ulong head __aligned(64);	/* producer */
+	volatile ulong tail __aligned(64);	/* consumer */
+	void *slot[SB_RING_SIZE] __aligned(64);
+};
+
+struct sb_thread {
+	pthread_t thread;
+	const struct sb_alloc *sa;
+	struct sb_ring *ring;	/* cross only, shared with the peer */
+	bool producer;
+	int pattern;
+	size_t size;
+	ulong iters;
+	ulong ops;
+	ulong ns;
+	struct bench_lat lat_malloc;
+	struct bench_lat lat_free;
+	pthread_barrier_t *start;
+	bool *abort;		/* Not all threads could be created */
+};
+
+static inline void _cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__sync_synchronize();
+#endif
+}
+
+/* ~~~ allocators ~~~ */
+
+static void *_zus_malloc(size_t size)
+{
+	return zus_malloc(size);
+}
+
+static void _zus_free(void *ptr)
+{
+	zus_free(ptr);
+}
+
+static struct sb_alloc sb_allocs[] = {
+	{ .name = "zus", .malloc = _zus_malloc, .free = _zus_free },
+	{ .name = "glibc", .malloc = malloc, .free = free },
+	{ .name = "jemalloc", },	/* Filled if found */
+};
+
+#define SB_NALLOCS	(sizeof(sb_allocs) / sizeof(sb_allocs[0]))
+
+static void _jemalloc_load(struct sb_alloc *sa)
+{
+	void *handle = dlopen(SB_JEMALLOC_LIB, RTLD_NOW | RTLD_LOCAL);
+
+	if (!handle) {
+		fprintf(stderr, "# %s not found, skipping jemalloc\n",
+			SB_JEMALLOC_LIB);
+		return;
+	}
+	sa->malloc = dlsym(handle, "malloc");
+	sa->free = dlsym(handle, "free");
+	if (!sa->malloc || !sa->free)
+		sa->malloc = NULL;
+}
+
+/* ~~~ patterns ~~~ */
+
+static void *_sb_malloc(struct sb_thread *st, ulong op)
+{
+	ulong start;
+	void *ptr;
+
+	if (!bench_lat_want(&st->lat_malloc, op)) {
+		ptr = st->sa->malloc(st->size);
+	} else {
+		start = zus_stats_now();
+		ptr = st->sa->malloc(st->size);
+		st->lat_malloc.samples[st->lat_malloc.n++] =
+						zus_stats_now() - start;
+	}
+	if (likely(ptr))
+		*(char *)ptr = 1; /* touch */
+	return ptr;
+}
+
+static void _sb_free(struct sb_thread *st, void *ptr, ulong op)
+{
+	ulong start;
+
+	if (!bench_lat_want(&st->lat_free, op)) {
+		st->sa->free(ptr);
+	} else {
+		start = zus_stats_now();
+		st->sa->free(ptr);
+		st->lat_free.samples[st->lat_free.n++] =
+						zus_stats_now() - start;
+	}
+}
+
+static int _run_same(struct sb_thread *st)
+{
+	void *ptrs[SB_BATCH];
+	ulong op = 0;
+	int i;
+
+	while (op < st->iters) {
+		for (i = 0; i < SB_BATCH; ++i) {
+			ptrs[i] = _sb_malloc(st, op + i);
+			if (unlikely(!ptrs[i]))
+				goto nomem;
+		}
+		for (i = SB_BATCH - 1; i >= 0; --i)
+			_sb_free(st, ptrs[i], op + i);
+		op += SB_BATCH;
+	}
+	st->ops = op * 2;
+	return 0;
+
+nomem:
+	while (--i >= 0)
+		st->sa->free(ptrs[i]);
+	return -ENOMEM;
+}
+
+static int _run_producer(struct sb_thread *st)
+{
+	struct sb_ring *ring = st->ring;
+	ulong op;
+	void *ptr;
+
+	for (op = 0; op < st->iters; ++op) {
+		ptr = _sb_malloc(st, op);
+		if (unlikely(!ptr))
+			ptr = SB_NOMEM;
+		while (ring->head - __atomic_load_n(&ring->tail,
+						    __ATOMIC_ACQUIRE) >=
+		       SB_RING_SIZE)
+			_cpu_relax();
+		ring->slot[ring->head & (SB_RING_SIZE - 1)] = ptr;
+		__atomic_store_n(&ring->head, ring->head + 1,
+				 __ATOMIC_RELEASE);
+		if (unlikely(ptr == SB_NOMEM))
+			return -ENOMEM;
+	}
+	st->ops = op;
+	return 0;
+}
+
+static int _run_consumer(struct sb_thread *st)
+{
+	struct sb_ring *ring = st->ring;
+	ulong op;
+	void *ptr;
+
+	for (op = 0; op < st->iters; ++op) {
+		while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) ==
+		       ring->tail)
+			_cpu_relax();
+		ptr = ring->slot[ring->tail & (SB_RING_SIZE - 1)];
+		__atomic_store_n(&ring->tail, ring->tail + 1,
+				 __ATOMIC_RELEASE);
+		if (unlikely(ptr == SB_NOMEM))
+			return -ENOMEM;
+		_sb_free(st, ptr, op);
+	}
+	st->ops = op;
+	return 0;
+}
+
+static void *_sb_thread(void *arg)
+{
+	struct sb_thread *st = arg;
+	ulong start;
+	int err;
+
+	pthread_barrier_wait(st->start);
+	if (*st->abort)
+		return NULL;
+	start = bench_now_ns();
+
+	if (st->pattern == SB_SAME)
+		err = _run_same(st);
+	else if (st->producer)
+		err = _run_producer(st);
+	else
+		err = _run_consumer(st);
+
+	st->ns = bench_now_ns() - start;
+	return (void *)(long)err;
+}
+
+/* ~~~ driver ~~~ */
+
+struct sb_conf {
+	uint max_threads;
+	ulong iters;
+	size_t min_size;
+	size_t max_size;
+	const char *only;	/* Only this allocator */
+};
+
+static int _run_one(const struct sb_conf *sbc, const struct sb_alloc *sa,
+		    int pattern, size_t size, uint nthreads)
+{
+	struct sb_thread *sts;
+	struct sb_ring *rings = NULL;
+	pthread_barrier_t start;
+	double mops, m50, m99, f50, f99;
+	ulong ops = 0, ns = 0;
+	uint i, cpu, created = 0;
+	bool abort = false;
+	int err = 0;
+
+	sts = calloc(nthreads, sizeof(*sts));
+	if (!sts)
+		return -ENOMEM;
+
+	if (pattern == SB_CROSS) {
+		err = posix_memalign((void **)&rings, 64,
+				     (nthreads / 2) * sizeof(*rings));
+		if (err) {
+			free(sts);
+			return -err;
+		}
+		memset(rings, 0, (nthreads / 2) * sizeof(*rings));
+	}
+
+	pthread_barrier_init(&start, NULL, nthreads);
+
+	cpu = zus_cpumask_next(-1, zus_cpu_online_mask);
+	for (i = 0; i < nthreads; ++i) {
+		struct sb_thread *st = &sts[i];
+		struct zus_thread_params tp;
+
+		st->sa = sa;
+		st->pattern = pattern;
+		st->size = size;
+		st->iters = sbc->iters;
+		st->start = &start;
+		st->abort = &abort;
+		if (pattern == SB_CROSS) {
+			st->ring = &rings[i / 2];
+			st->producer = !(i % 2);
+		}
+		err = bench_lat_init(&st->lat_malloc, st->iters);
+		if (!err)
+			err = bench_lat_init(&st->lat_free, st->iters);
+		if (err)
+			break;
+
+		ZTP_INIT(&tp);
+		tp.name = "slab_bench";
+		tp.one_cpu = cpu;
+		err = zus_thread_create(&st->thread, &tp, _sb_thread, st);
+		if (err)
+			break;
+		++created;
+		cpu = zus_cpumask_next(cpu, zus_cpu_online_mask);
+	}
+
+	/* Release those who wait for the ones never created */
+	abort = (created < nthreads);
+	for (i = created; i < nthreads; ++i)
+		pthread_barrier_wait(&start);
+
+	for (i = 0; i < created; ++i) {
+		void *tret;
+
+		pthread_join(sts[i].thread, &tret);
+		if (tret && !err)
+			err = (long)tret;
+		ops += sts[i].ops;
+		if (sts[i].ns > ns)
+			ns = sts[i].ns;
+	}
+
+	if (!err && ns) {
+		mops = (double)ops * 1000.0 / ns;
+		bench_lat_percentiles(&sts->lat_malloc, nthreads, sizeof(*sts),
+				      &m50, &m99);
+		bench_lat_percentiles(&sts->lat_free, nthreads, sizeof(*sts),
+				      &f50, &f99);
+		printf("%s,%s,%zu,%u,%lu,%.6f,%.3f,%.0f,%.0f,%.0f,%.0f\n",
+		       sa->name, sb_pattern_name[pattern], size, nthreads, ops,
+		       ns / 1e9, mops, m50, m99, f50, f99);
+		fflush(stdout);
+	} else if (err) {
+		fprintf(stderr, "# %s,%s,%zu,%u failed => %d\n", sa->name,
+			sb_pattern_name[pattern], size, nthreads, err);
+	}
+
+	pthread_barrier_destroy(&start);
+	for (i = 0; i < nthreads; ++i) {
+		bench_lat_fini(&sts[i].lat_malloc);
+		bench_lat_fini(&sts[i].lat_free);
+	}
+	free(rings);
+	free(sts);
+	return err;
+}
+
+/* 1, 2, 4... threads, the cross pattern needs at least a pair */
+static void _run_threads(const struct sb_conf *sbc, const struct sb_alloc *sa,
+			 int pattern, size_t size)
+{
+	uint nthreads = (pattern == SB_CROSS) ? 2 : 1;
+
+	for (; nthreads <= sbc->max_threads; nthreads *= 2)
+		_run_one(sbc, sa, pattern, size, nthreads);
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	"usage: %s [options]\n"
+	"	--threads=N	Up to N threads, doubling from 1.\n"
+	"			Default is the number of online CPUs\n"
+	"	--iters=N	Allocations per thread. Default %u\n"
+	"	--min_size=B	Smallest size. Default 32\n"
+	"	--max_size=B	Largest size, doubling from min. Default 4096\n"
+	"	--alloc=NAME	Only run zus, glibc or jemalloc\n"
+	"	--pa_size=B	Size of the zus page allocator\n"
+	"\n"
+	"Prints CSV: alloc,pattern,size,threads,ops,secs,mops,\n"
+	"	malloc_p50_ns,malloc_p99_ns,free_p50_ns,free_p99_ns\n",
+	prog, SB_DEF_ITERS);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option opt[] = {
+		{.name = "threads", .has_arg = 1, .flag = NULL, .val = 't'},
+		{.name = "iters", .has_arg = 1, .flag = NULL, .val = 'i'},
+		{.name = "min_size", .has_arg = 1, .flag = NULL, .val = 'm'},
+		{.name = "max_size", .has_arg = 1, .flag = NULL, .val = 'M'},
+		{.name = "alloc", .has_arg = 1, .flag = NULL, .val = 'a'},
+		{.name = "pa_size", .has_arg = 1, .flag = NULL, .val = 'p'},
+		{.name = "help", .has_arg = 0, .flag = NULL, .val = 'h'},
+		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+	};
+	const char *shortopt = "t:i:m:M:a:p:h";
+	struct sb_conf sbc = {
+		.max_threads = get_nprocs(),
+		.iters = SB_DEF_ITERS,
+		.min_size = 32,
+		.max_size = 4096,
+	};
+	ssize_t pa_size = 0;
+	uint a;
+	size_t size;
+	int op, pattern, err;
+
+	while ((op = getopt_long(argc, argv, shortopt, opt, NULL)) != -1) {
+		switch (op) {
+		case 't':
+			sbc.max_threads = atoi(optarg);
+			break;
+		case 'i':
+			sbc.iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			sbc.min_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'M':
+			sbc.max_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			sbc.only = optarg;
+			break;
+		case 'p':
+			pa_size = atol(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!sbc.max_threads || !sbc.min_size || !sbc.iters) {
+		usage(argv[0]);
+		return 1;
+	}
+	/* Whole batches, and an even split for the cross pattern */
+	sbc.iters = ALIGN(sbc.iters, SB_BATCH);
+
+	err = bench_emu_init(pa_size, NULL);
+	if (unlikely(err)) {
+		fprintf(stderr, "init => %d\n", err);
+		return 1;
+	}
+	if (sbc.max_threads > zus_num_online_cpus())
+		sbc.max_threads = zus_num_online_cpus();
+
+	bench_ns_per_tick();
+	_jemalloc_load(&sb_allocs[2]);
+
+	printf("alloc,pattern,size,threads,ops,secs,mops,"
+	       "malloc_p50_ns,malloc_p99_ns,free_p50_ns,free_p99_ns\n");
+
+	for (a = 0; a < SB_NALLOCS; ++a) {
+		const struct sb_alloc *sa = &sb_allocs[a];
+
+		if (!sa->malloc || (sbc.only && strcmp(sbc.only, sa->name)))
+			continue;
+		for (size = sbc.min_size; size <= sbc.max_size; size *= 2)
+			for (pattern = SB_SAME; pattern <= SB_CROSS; ++pattern)
+				_run_threads(&sbc, sa, pattern, size);
+	}
+
+	bench_emu_fini();
+	return 0;
+}
@@ -0,0 +1,251 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * tlb_bench.c - dTLB misses of random loads from pa pages per backing mode
+ *
+ * For each --pa_huge mode a child process sets up the page allocator with
+ * it, allocates --size MB of PA_MAX_ORDER blocks and faults them in. It then
+ * loads from random offsets of random pages, counting dTLB load misses with
+ * a perf_event counter. Each mode gets a process of its own because the
+ * backing is chosen once, at pa_init. Results are printed as CSV on stdout.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+
+#include "zus.h"
+#include "../bench.h"
+
+#define TB_DEF_SIZE_MB		512
+#define TB_DEF_ACCESSES		(1UL << 25)
+#define TB_DEF_MODES		"none,thp,2M,1G"
+
+struct tb_conf {
+	ulong size_mb;
+	ulong accesses;
+	ssize_t pa_size;
+};
+
+/* Returns the fd of a disabled counter of this thread, or -errno */
+static int _dtlb_open(void)
+{
+	struct perf_event_attr attr;
+	int fd;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		      (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	return fd < 0 ? -errno : fd;
+}
+
+static inline ulong _xorshift(ulong *x)
+{
+	*x ^= *x << 13;
+	*x ^= *x >> 7;
+	*x ^= *x << 17;
+	return *x;
+}
+
+/* Random loads, their sum is returned so they are not optimized away */
+static ulong _tb_loads(char **pg, ulong npages, ulong accesses)
+{
+	ulong i, r, x = 88172645463325252UL, sum = 0;
+
+	for (i = 0; i < accesses; ++i) {
+		r = _xorshift(&x);
+		sum += *(ulong *)(pg[r % npages] +
+				  ((r >> 40) & (PAGE_SIZE - sizeof(ulong))));
+	}
+	return sum;
+}
+
+/* Runs in a child of its own */
+static int _run_mode(const struct tb_conf *tbc, const char *mode)
+{
+	ulong npages = tbc->size_mb * (1UL << 20) / PAGE_SIZE;
+	ulong bpages = 1UL << PA_MAX_ORDER;
+	struct zus_sb_info *sbi;
+	struct pa *pa;
+	struct pa_page *page;
+	long long misses = -1;
+	ulong i, j, start, ns, sum;
+	char **pg;
+	int fd, err;
+
+	err = bench_emu_init(tbc->pa_size, mode);
+	if (unlikely(err)) {
+		fprintf(stderr, "# %s: init => %d\n", mode, err);
+		return err;
+	}
+	sbi = zus_global_sbi();
+	pa = &sbi->pa[POOL_NUM];
+
+	npages &= ~(bpages - 1);
+	pg = calloc(npages, sizeof(*pg));
+	if (unlikely(!pg)) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < npages; i += bpages) {
+		page = pa_alloc_order(sbi, PA_MAX_ORDER);
+		if (unlikely(!page)) {
+			fprintf(stderr, "# %s: pa_alloc_order failed at %luM\n",
+				mode, i * PAGE_SIZE >> 20);
+			npages = i;
+			err = -ENOMEM;
+			goto release;
+		}
+		for (j = 0; j < bpages; ++j) {
+			pg[i + j] = pa_page_address(sbi, page + j);
+			memset(pg[i + j], (int)j, PAGE_SIZE);
+		}
+	}
+
+	fd = _dtlb_open();
+	if (fd < 0)
+		fprintf(stderr, "# %s: perf_event_open => %d\n", mode, fd);
+
+	/* One pass to warm up the caches and the page tables */
+	sum = _tb_loads(pg, npages, tbc->accesses / 8);
+
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	start = bench_now_ns();
+	sum += _tb_loads(pg, npages, tbc->accesses);
+	ns = bench_now_ns() - start;
+	if (fd >= 0) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &misses, sizeof(misses)) != sizeof(misses))
+			misses = -1;
+		close(fd);
+	}
+
+	printf("%s,%lu,%lu,%lu,%.6f,%.2f,%lld,%.2f\n", mode,
+	       pa->hpage_size >> 10, tbc->size_mb, tbc->accesses, ns / 1e9,
+	       (double)ns / tbc->accesses, misses,
+	       misses < 0 ? -1.0 : misses * 1000.0 / tbc->accesses);
+	fflush(stdout);
+	if (!sum)	/* Never, but keeps @sum used */
+		fprintf(stderr, "# %s: all zero\n", mode);
+
+release:
+	for (i = 0; i < npages; i += bpages) {
+		page = pa_virt_to_page(sbi, pg[i]);
+		for (j = 0; j < bpages; ++j)
+			pa_put_page(page + j);
+	}
+	free(pg);
+out:
+	bench_emu_fini();
+	return err;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+	"usage: %s [options]\n"
+	"	--size=MB	Of pa pages loaded from. Default %u\n"
+	"	--accesses=N	Random loads timed. Default %lu\n"
+	"	--modes=LIST	Comma separated --pa_huge modes, in turn.\n"
+	"			Default %s\n"
+	"	--pa_size=B	Size of the zus page allocator\n"
+	"\n"
+	"Modes whose huge pages are not available fall back to 4K pages,\n"
+	"hpage_kb is then 0.\n"
+	"Prints CSV: mode,hpage_kb,size_mb,accesses,secs,ns_per_access,\n"
+	"	dtlb_load_misses,misses_per_kaccess\n",
+	prog, TB_DEF_SIZE_MB, TB_DEF_ACCESSES, TB_DEF_MODES);
+}
+
+int main(int argc, char *argv[])
+{
+	struct option opt[] = {
+		{.name = "size", .has_arg = 1, .flag = NULL, .val = 's'},
+		{.name = "accesses", .has_arg = 1, .flag = NULL, .val = 'a'},
+		{.name = "modes", .has_arg = 1, .flag = NULL, .val = 'm'},
+		{.name = "pa_size", .has_arg = 1, .flag = NULL, .val = 'p'},
+		{.name = "help", .has_arg = 0, .flag = NULL, .val = 'h'},
+		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
+	};
+	const char *shortopt = "s:a:m:p:h";
+	struct tb_conf tbc = {
+		.size_mb = TB_DEF_SIZE_MB,
+		.accesses = TB_DEF_ACCESSES,
+	};
+	char *modes = NULL, *mode, *save;
+	int op, status, ret = 0;
+	pid_t pid;
+
+	while ((op = getopt_long(argc, argv, shortopt, opt, NULL)) != -1) {
+		switch (op) {
+		case 's':
+			tbc.size_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			tbc.accesses = strtoul(optarg, NULL, 0);
+			break;
+		case 'm':
+			modes = optarg;
+			break;
+		case 'p':
+			tbc.pa_size = atol(optarg);
+			break;
+		case 'h':
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!tbc.size_mb || !tbc.accesses) {
+		usage(argv[0]);
+		return 1;
+	}
+	modes = strdup(modes ?: TB_DEF_MODES);
+	if (!modes)
+		return 1;
+
+	printf("mode,hpage_kb,size_mb,accesses,secs,ns_per_access,"
+	       "dtlb_load_misses,misses_per_kaccess\n");
+	fflush(stdout);
+
+	for (mode = strtok_r(modes, ",", &save); mode;
+	     mode = strtok_r(NULL, ",", &save)) {
+		pid = fork();
+		if (pid < 0) {
+			ret = 1;
+			break;
+		}
+		if (!pid)
+			exit(_run_mode(&tbc, mode) ? 1 : 0);
+
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+		    WEXITSTATUS(status))
+			ret = 1;
+	}
+
+	free(modes);
+	return ret;
+}
@@ -0,0 +1,290 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * csum.c - CRCs for on-media metadata
+ *
+ * zus_crc16 is the CRC16 of md_calc_csum (reflected 0xA001, "ARC"), done
+ * slice-by-8. zus_crc32c is CRC32C (Castagnoli), for new metadata. It uses
+ * the SSE4.2 crc32 instruction when the CPU has it. With PCLMULQDQ as well,
+ * long buffers are cut in three, each CRCed as its own stream so the
+ * instruction's latency is hidden, and the three are folded back into one
+ * by carry-less multiplication. Without SSE4.2 it is slice-by-4 in software.
+ * Implementations are chosen at load, by cpuid like nvml_movnt.c does.
+ *
+ * Both take and return the raw CRC register: no inversion is done here, a
+ * caller seeds with ~0 (and may invert the result) if its format says so.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#include <cpuid.h>
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+
+#include "zus.h"
+
+#define CRC16_POLY		0xA001		/* Reflected 0x8005 */
+#define CRC32C_POLY		0x82F63B78	/* Reflected 0x1EDC6F41 */
+
+#define CPUID1_ECX_PCLMUL	(1 << 1)
+#define CPUID1_ECX_SSE42	(1 << 20)
+
+/* Lengths of each of the 3 streams, a long round first if it fits */
+#define CRC32C_3WAY_LONG	2048
+#define CRC32C_3WAY_SHORT	256
+
+/* Each table no more than 4K (-Wlarger-than) */
+static uint16_t _crc16_tbl[8][256];
+static uint32_t _crc32c_tbl[4][256];
+
+/* Multipliers of the 3-way fold, see _crc32c_xpow */
+static struct {
+	ulong long1, long2;
+	ulong short1, short2;
+} _k3way;
+
+static inline ulong _load64(const uint8_t *p)
+{
+	ulong v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/* The table md_zus.c used to have. For zus_csum_get_impl only */
+static uint32_t _crc16_byte(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--)
+		crc = _crc16_tbl[0][(crc ^ *p++) & 0xff] ^
+		      ((crc & 0xffff) >> 8);
+	return crc & 0xffff;
+}
+
+static uint32_t _crc16_slice8(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ulong v;
+
+	crc &= 0xffff;
+	for (; len >= 8; len -= 8, p += 8) {
+		v = _load64(p) ^ crc;
+		crc = _crc16_tbl[7][v & 0xff] ^
+		      _crc16_tbl[6][(v >> 8) & 0xff] ^
+		      _crc16_tbl[5][(v >> 16) & 0xff] ^
+		      _crc16_tbl[4][(v >> 24) & 0xff] ^
+		      _crc16_tbl[3][(v >> 32) & 0xff] ^
+		      _crc16_tbl[2][(v >> 40) & 0xff] ^
+		      _crc16_tbl[1][(v >> 48) & 0xff] ^
+		      _crc16_tbl[0][v >> 56];
+	}
+	while (len--)
+		crc = _crc16_tbl[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+uint16_t zus_crc16(uint16_t crc, const void *data, size_t len)
+{
+	return _crc16_slice8(crc, data, len);
+}
+
+static uint32_t _crc32c_slice4(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t v;
+
+	for (; len >= 4; len -= 4, p += 4) {
+		memcpy(&v, p, sizeof(v));
+		v ^= crc;
+		crc = _crc32c_tbl[3][v & 0xff] ^
+		      _crc32c_tbl[2][(v >> 8) & 0xff] ^
+		      _crc32c_tbl[1][(v >> 16) & 0xff] ^
+		      _crc32c_tbl[0][v >> 24];
+	}
+	while (len--)
+		crc = _crc32c_tbl[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t _crc32c_sse42(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	ulong crc64;
+
+	for (; len && ((ulong)p & 7); --len)
+		crc = _mm_crc32_u8(crc, *p++);
+	crc64 = crc;
+	for (; len >= 8; len -= 8, p += 8)
+		crc64 = _mm_crc32_u64(crc64, _load64(p));
+	crc = crc64;
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
+}
+
+/* @a * @k of the reflected domain, reduced to 32 bits by the crc32
+ * instruction. With @k = x^(8n - 33) it is @a followed by @n zero bytes.
+ */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t _crc32c_shift(uint32_t a, ulong k)
+{
+	__m128i m = _mm_clmulepi64_si128(_mm_cvtsi64_si128(a),
+					 _mm_cvtsi64_si128(k), 0);
+
+	return _mm_crc32_u64(0, _mm_cvtsi128_si64(m));
+}
+
+/* One round over 3 * @n bytes of @p */
+__attribute__((target("sse4.2,pclmul")))
+static inline uint32_t _crc32c_3way(uint32_t crc, const uint8_t *p, size_t n,
+				    ulong k1, ulong k2)
+{
+	const uint8_t *end = p + n;
+	ulong a = crc, b = 0, c = 0;
+
+	for (; p < end; p += 8) {
+		a = _mm_crc32_u64(a, _load64(p));
+		b = _mm_crc32_u64(b, _load64(p + n));
+		c = _mm_crc32_u64(c, _load64(p + 2 * n));
+	}
+	return _crc32c_shift(a, k2) ^ _crc32c_shift(b, k1) ^ c;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t _crc32c_pclmul(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	if (len < 3 * CRC32C_3WAY_SHORT)
+		return _crc32c_sse42(crc, data, len);
+
+	for (; (ulong)p & 7; --len)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	for (; len >= 3 * CRC32C_3WAY_LONG; len -= 3 * CRC32C_3WAY_LONG,
+					    p += 3 * CRC32C_3WAY_LONG)
+		crc = _crc32c_3way(crc, p, CRC32C_3WAY_LONG, _k3way.long1,
+				   _k3way.long2);
+	for (; len >= 3 * CRC32C_3WAY_SHORT; len -= 3 * CRC32C_3WAY_SHORT,
+					     p += 3 * CRC32C_3WAY_SHORT)
+		crc = _crc32c_3way(crc, p, CRC32C_3WAY_SHORT, _k3way.short1,
+				   _k3way.short2);
+
+	return _crc32c_sse42(crc, p, len);
+}
+
+/* Without SSE4.2 we default to software */
+static uint32_t (*_crc32c)(uint32_t crc, const void *data, size_t len) =
+								_crc32c_slice4;
+
+uint32_t zus_crc32c(uint32_t crc, const void *data, size_t len)
+{
+	return _crc32c(crc, data, len);
+}
+
+static struct zus_csum_impl _impls[] = {
+	{ .name = "crc16-byte", .fn = _crc16_byte, .avail = true, },
+	{ .name = "crc16-slice8", .fn = _crc16_slice8, .avail = true, },
+	{ .name = "crc32c-slice4", .fn = _crc32c_slice4, .avail = true, },
+	{ .name = "crc32c-sse42", .fn = _crc32c_sse42, },
+	{ .name = "crc32c-pclmul", .fn = _crc32c_pclmul, },
+};
+
+int zus_csum_get_impl(uint i, struct zus_csum_impl *zci)
+{
+	if (i >= ARRAY_SIZE(_impls))
+		return -ENOENT;
+
+	*zci = _impls[i];
+	zci->active = (_impls[i].fn == _crc32c) ||
+		      (_impls[i].fn == _crc16_slice8);
+	return 0;
+}
+
+/* a * b modulo CRC32C_POLY, reflected: x^0 is bit 31 */
+static uint32_t _crc32c_multmod(uint32_t a, uint32_t b)
+{
+	uint32_t m = 1U << 31, p = 0;
+
+	for (;;) {
+		if (a & m) {
+			p ^= b;
+			if (!(a & (m - 1)))
+				break;
+		}
+		m >>= 1;
+		b = b & 1 ? (b >> 1) ^ CRC32C_POLY : b >> 1;
+	}
+	return p;
+}
+
+static uint32_t _crc32c_xpow(ulong n)
+{
+	uint32_t p = 1U << 31, x = 1U << 30;
+
+	for (; n; n >>= 1) {
+		if (n & 1)
+			p = _crc32c_multmod(p, x);
+		x = _crc32c_multmod(x, x);
+	}
+	return p;
+}
+
+static void _tables_init(void)
+{
+	uint32_t c16, c32;
+	uint i, k;
+
+	for (i = 0; i < 256; ++i) {
+		c16 = c32 = i;
+		for (k = 0; k < 8; ++k) {
+			c16 = c16 & 1 ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+			c32 = c32 & 1 ? (c32 >> 1) ^ CRC32C_POLY : c32 >> 1;
+		}
+		_crc16_tbl[0][i] = c16;
+		_crc32c_tbl[0][i] = c32;
+	}
+	/* Entry of table k is that of table k-1 followed by a zero byte */
+	for (i = 0; i < 256; ++i) {
+		for (k = 1; k < 8; ++k) {
+			c16 = _crc16_tbl[k - 1][i];
+			_crc16_tbl[k][i] = _crc16_tbl[0][c16 & 0xff] ^
+					   (c16 >> 8);
+		}
+		for (k = 1; k < 4; ++k) {
+			c32 = _crc32c_tbl[k - 1][i];
+			_crc32c_tbl[k][i] = _crc32c_tbl[0][c32 & 0xff] ^
+					    (c32 >> 8);
+		}
+	}
+}
+
+__attribute__((constructor))
+static void csum_init(void)
+{
+	uint eax, ebx, ecx = 0, edx;
+
+	_tables_init();
+
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) ||
+	    !(ecx & CPUID1_ECX_SSE42))
+		return;
+
+	_impls[3].avail = true;
+	_crc32c = _crc32c_sse42;
+	if (!(ecx & CPUID1_ECX_PCLMUL))
+		return;
+
+	_k3way.long1 = _crc32c_xpow(8 * CRC32C_3WAY_LONG - 33);
+	_k3way.long2 = _crc32c_xpow(8 * 2 * CRC32C_3WAY_LONG - 33);
+	_k3way.short1 = _crc32c_xpow(8 * CRC32C_3WAY_SHORT - 33);
+	_k3way.short2 = _crc32c_xpow(8 * 2 * CRC32C_3WAY_SHORT - 33);
+	_impls[4].avail = true;
+	_crc32c = _crc32c_pclmul;
+}
@@ -0,0 +1,299 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * The toyfs reference file-system implementation via zufs
+ *
+ * Per-inode block-map: a radix tree keyed by file's page index which maps
+ * to the inode's iblkref of that page. The iblkrefs themselves remain on
+ * the ordered ti->list_head so that range iterations stay sequential, but
+ * all point lookups go through the tree and cost a few levels at most.
+ *
+ * Each tree node occupies a single pmem block. The root pointer and tree
+ * height are kept in the regular-file part of the toyfs_inode's union.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ *
+ * Authors:
+ *	Shachar Sharon <sshachar@netapp.com>
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+
+#include "zus.h"
+#include "toyfs.h"
+
+#define TOYFS_BMAP_SHIFT	(9)
+#define TOYFS_BMAP_FANOUT	(1UL << TOYFS_BMAP_SHIFT)
+#define TOYFS_BMAP_MASK		(TOYFS_BMAP_FANOUT - 1)
+#define TOYFS_BMAP_HEIGHT_MAX	(5) /* 45 bits of page-index >= ISIZE_MAX */
+
+struct toyfs_bmap_node {
+	void *slot[TOYFS_BMAP_FANOUT];
+};
+
+static struct _t_reg *_bmap_of(struct toyfs_inode_info *tii)
+{
+	return &tii->ti->i_reg;
+}
+
+static size_t _bmap_maxindex(uint32_t height)
+{
+	if (height >= TOYFS_BMAP_HEIGHT_MAX)
+		return ULONG_MAX;
+	return (1UL << (height * TOYFS_BMAP_SHIFT)) - 1;
+}
+
+static size_t _bmap_slot(size_t index, uint32_t height)
+{
+	return (index >> ((height - 1) * TOYFS_BMAP_SHIFT)) & TOYFS_BMAP_MASK;
+}
+
+static struct toyfs_bmap_node *_bmap_new_node(struct toyfs_sb_info *sbi)
+{
+	/* pmem blocks come zeroed */
+	return (struct toyfs_bmap_node *)toyfs_acquire_pmemb(sbi);
+}
+
+static void _bmap_free_node(struct toyfs_sb_info *sbi,
+			    struct toyfs_bmap_node *node)
+{
+	toyfs_release_pmemb(sbi, (struct toyfs_pmemb *)node);
+}
+
+static bool _bmap_node_isempty(const struct toyfs_bmap_node *node)
+{
+	size_t i;
+
+	for (i = 0; i < TOYFS_BMAP_FANOUT; ++i)
+		if (node->slot[i])
+			return false;
+	return true;
+}
+
+void toyfs_bmap_init(struct toyfs_inode_info *tii)
+{
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	bmap->bmap_root = NULL;
+	bmap->bmap_height = 0;
+	bmap->reserved = 0;
+}
+
+struct toyfs_iblkref *toyfs_bmap_lookup(struct toyfs_inode_info *tii,
+					size_t index)
+{
+	uint32_t height;
+	struct toyfs_bmap_node *node;
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	height = bmap->bmap_height;
+	if (!height || (index > _bmap_maxindex(height)))
+		return NULL;
+
+	node = bmap->bmap_root;
+	while (node && (height > 1)) {
+		node = node->slot[_bmap_slot(index, height)];
+		--height;
+	}
+	return node ? node->slot[index & TOYFS_BMAP_MASK] : NULL;
+}
+
+static struct toyfs_iblkref *
+_bmap_lookup_from(struct toyfs_bmap_node *node, uint32_t height, size_t index)
+{
+	size_t i, first;
+	void *child;
+	struct toyfs_iblkref *iblkref;
+
+	first = _bmap_slot(index, height);
+	for (i = first; i < TOYFS_BMAP_FANOUT; ++i) {
+		child = node->slot[i];
+		if (!child)
+			continue;
+		if (height == 1)
+			return child;
+
+		/* Only the left-most sub-tree is bounded by index */
+		iblkref = _bmap_lookup_from(child, height - 1,
+					    (i == first) ? index : 0);
+		if (iblkref)
+			return iblkref;
+	}
+	return NULL;
+}
+
+struct toyfs_iblkref *toyfs_bmap_lookup_from(struct toyfs_inode_info *tii,
+					     size_t index)
+{
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	if (!bmap->bmap_height || (index > _bmap_maxindex(bmap->bmap_height)))
+		return NULL;
+
+	return _bmap_lookup_from(bmap->bmap_root, bmap->bmap_height, index);
+}
+
+static int _bmap_grow(struct toyfs_inode_info *tii, size_t index)
+{
+	struct toyfs_bmap_node *node;
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	if (!bmap->bmap_root) {
+		node = _bmap_new_node(tii->sbi);
+		if (!node)
+			return -ENOSPC;
+		/* High enough for index, no empty leaf below slot 0 */
+		bmap->bmap_root = node;
+		bmap->bmap_height = 1;
+		while (index > _bmap_maxindex(bmap->bmap_height))
+			bmap->bmap_height++;
+		return 0;
+	}
+	while (index > _bmap_maxindex(bmap->bmap_height)) {
+		node = _bmap_new_node(tii->sbi);
+		if (!node)
+			return -ENOSPC;
+		node->slot[0] = bmap->bmap_root;
+		bmap->bmap_root = node;
+		bmap->bmap_height++;
+	}
+	return 0;
+}
+
+/* Makes sure the leaf node of index exists, its slot is left as is */
+static struct toyfs_bmap_node *
+_bmap_leaf(struct toyfs_inode_info *tii, size_t index)
+{
+	uint32_t height;
+	size_t slot;
+	struct toyfs_bmap_node *node, *child;
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	if (_bmap_grow(tii, index))
+		return NULL;
+
+	node = bmap->bmap_root;
+	for (height = bmap->bmap_height; height > 1; --height) {
+		slot = _bmap_slot(index, height);
+		child = node->slot[slot];
+		if (!child) {
+			child = _bmap_new_node(tii->sbi);
+			if (!child)
+				return NULL;
+			node->slot[slot] = child;
+		}
+		node = child;
+	}
+	return node;
+}
+
+int toyfs_bmap_insert(struct toyfs_inode_info *tii, size_t index,
+		      struct toyfs_iblkref *iblkref)
+{
+	struct toyfs_bmap_node *node = _bmap_leaf(tii, index);
+
+	if (!node)
+		return -ENOSPC;
+
+	toyfs_assert(!node->slot[index & TOYFS_BMAP_MASK]);
+	node->slot[index & TOYFS_BMAP_MASK] = iblkref;
+	return 0;
+}
+
+/*
+ * Allocates the nodes a later toyfs_bmap_move to index needs. Nodes which
+ * end up with no entry are released by toyfs_bmap_prune, also those of a
+ * reservation which failed half way down.
+ */
+int toyfs_bmap_reserve(struct toyfs_inode_info *tii, size_t index)
+{
+	return _bmap_leaf(tii, index) ? 0 : -ENOSPC;
+}
+
+/*
+ * Moves the entry at from to the free slot at to, which must be reserved.
+ * No node is released, so a reservation of a later move is kept.
+ */
+void toyfs_bmap_move(struct toyfs_inode_info *tii, size_t from, size_t to)
+{
+	struct toyfs_bmap_node *src = _bmap_leaf(tii, from);
+	struct toyfs_bmap_node *dst = _bmap_leaf(tii, to);
+
+	toyfs_assert(src && dst);
+	toyfs_assert(!dst->slot[to & TOYFS_BMAP_MASK]);
+	dst->slot[to & TOYFS_BMAP_MASK] = src->slot[from & TOYFS_BMAP_MASK];
+	src->slot[from & TOYFS_BMAP_MASK] = NULL;
+}
+
+static void _bmap_shrink(struct toyfs_inode_info *tii)
+{
+	size_t i;
+	struct toyfs_bmap_node *root;
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	while (bmap->bmap_height > 1) {
+		root = bmap->bmap_root;
+		for (i = 1; i < TOYFS_BMAP_FANOUT; ++i)
+			if (root->slot[i])
+				return;
+
+		bmap->bmap_root = root->slot[0];
+		bmap->bmap_height--;
+		_bmap_free_node(tii->sbi, root);
+	}
+}
+
+void toyfs_bmap_remove(struct toyfs_inode_info *tii, size_t index)
+{
+	int depth;
+	uint32_t height;
+	struct toyfs_bmap_node *node, *child;
+	struct toyfs_bmap_node *path[TOYFS_BMAP_HEIGHT_MAX];
+	size_t slots[TOYFS_BMAP_HEIGHT_MAX];
+	struct _t_reg *bmap = _bmap_of(tii);
+
+	height = bmap->bmap_height;
+	if (!height || (index > _bmap_maxindex(height)))
+		return;
+
+	/* Down to the leaf, or as far as a failed _bmap_leaf got */
+	depth = 0;
+	node = bmap->bmap_root;
+	for (;;) {
+		path[depth] = node;
+		slots[depth] = _bmap_slot(index, height);
+		if (height == 1)
+			break;
+		child = node->slot[slots[depth]];
+		if (!child)
+			break;
+		node = child;
+		++depth;
+		--height;
+	}
+
+	/* Clear the lowest slot and release any node that became empty */
+	for (; depth >= 0; --depth) {
+		node = path[depth];
+		node->slot[slots[depth]] = NULL;
+		if (!_bmap_node_isempty(node))
+			break;
+
+		_bmap_free_node(tii->sbi, node);
+		if (!depth)
+			toyfs_bmap_init(tii);
+	}
+	_bmap_shrink(tii);
+}
+
+/* Releases the nodes of a free index which became empty */
+void toyfs_bmap_prune(struct toyfs_inode_info *tii, size_t index)
+{
+	if (!toyfs_bmap_lookup(tii, index))
+		toyfs_bmap_remove(tii, index);
+}
@@ -75,6 +75,24 @@ static struct toyfs_dentries *_dentries_of(struct toyfs_list_head *head)
 	return container_of(head, struct toyfs_dentries, head);
 }
 
+static struct toyfs_dentries *_dentries_of_de(struct toyfs_dirent *de)
+{
+	return (struct toyfs_dentries *)((uintptr_t)de & ~(PAGE_SIZE - 1));
+}
+
+static int64_t _d_off_of(const struct toyfs_dentries *dentries,
+			 const struct toyfs_dirent *de)
+{
+	return 2 + ((int64_t)dentries->d_pgno * ARRAY_SIZE(dentries->de)) +
+	       (de - dentries->de);
+}
+
+static int64_t _last_d_off(const struct toyfs_dentries *dentries)
+{
+	return _d_off_of(dentries,
+			 &dentries->de[ARRAY_SIZE(dentries->de) - 1]);
+}
+
 static struct toyfs_dirent *_next_dirent(struct toyfs_dirent *de)
 {
 	size_t step;
@@ -104,6 +122,9 @@ _search_free(struct toyfs_dentries *dentries, size_t nlen)
 	struct toyfs_dirent *itr = &dentries->de[0];
 	struct toyfs_dirent *end = itr + ARRAY_SIZE(dentries->de);
 
+	if (dentries->d_nfree < required)
+		return NULL;
+
 	while (itr < end) {
 		count = _count_free_de(itr, end);
 		if (count >= required)
@@ -133,6 +154,197 @@ static void _reset_dirent(struct toyfs_dirent *de)
 
 	toyfs_assert(de->d_nlen > 0);
 	memset(de, 0, nde * sizeof(*de));
+	_dentries_of_de(de)->d_nfree += nde;
+}
+
+void toyfs_init_dir(struct toyfs_inode_info *dir_tii)
+{
+	struct toyfs_inode *ti = dir_tii->ti;
+
+	toyfs_list_init(toyfs_childs_list_of(dir_tii));
+	ti->i_dir.d_index = NULL;
+	ti->i_dir.d_nslots = 0;
+	ti->i_dir.d_count = 0;
+	ti->i_dir.d_free = NULL;
+}
+
+/*
+ * Name-hash index: an open-addressing (linear probing) table of pointers to
+ * the directory's dirents, kept in a contiguous run of pmem blocks and
+ * doubled when more than 3/4 full. Should a large enough run be missing,
+ * the old index is filled further, and growing is retried only once the
+ * count doubled. An index which would be left without an empty slot is
+ * dropped, lookups then scan the dentries pages. Dirents never move once
+ * placed, so their d_off (readdir cookie) is not affected by the index.
+ */
+#define TOYFS_DINDEX_PER_PAGE	(PAGE_SIZE / sizeof(struct toyfs_dindex_ent))
+
+static uint64_t _hash_name(const char *name, size_t nlen)
+{
+	size_t i;
+	uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+	for (i = 0; i < nlen; ++i) {
+		h ^= (uint8_t)name[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h ? h : 1;
+}
+
+static struct toyfs_dindex_ent *_dindex_of(struct toyfs_inode_info *dir_tii)
+{
+	return dir_tii->ti->i_dir.d_index;
+}
+
+static size_t _dindex_npages(uint32_t nslots)
+{
+	return nslots / TOYFS_DINDEX_PER_PAGE;
+}
+
+static void _dindex_put(struct toyfs_dindex_ent *ents, uint32_t nslots,
+			uint64_t hash, struct toyfs_dirent *de)
+{
+	size_t i = hash & (nslots - 1);
+
+	while (ents[i].hash)
+		i = (i + 1) & (nslots - 1);
+	ents[i].hash = hash;
+	ents[i].de = de;
+}
+
+static void _dindex_free(struct toyfs_inode_info *dir_tii)
+{
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+	const size_t npages = _dindex_npages(d->d_nslots);
+
+	if (!d->d_index)
+		return;
+
+	toyfs_release_pmembs(dir_tii->sbi, d->d_index, npages);
+	dir_tii->ti->i_blocks -= npages;
+	d->d_index = NULL;
+	d->d_nslots = 0;
+}
+
+/* Re-creates the index with nslots entries out of the dentries pages. The
+ * old index is kept should a large enough run be missing.
+ */
+static int _dindex_rebuild(struct toyfs_inode_info *dir_tii, uint32_t nslots)
+{
+	size_t cnt, npages = _dindex_npages(nslots);
+	struct toyfs_pmemb *pmemb;
+	struct toyfs_dindex_ent *ents;
+	struct toyfs_dirent *itr, *end;
+	struct toyfs_list_head *childs, *pos;
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+
+	pmemb = toyfs_acquire_pmembs(dir_tii->sbi, 0, npages, &cnt);
+	if (!pmemb)
+		return -ENOSPC;
+	if (cnt < npages) {
+		toyfs_release_pmembs(dir_tii->sbi, pmemb, cnt);
+		return -ENOSPC;
+	}
+
+	_dindex_free(dir_tii);
+
+	ents = (struct toyfs_dindex_ent *)pmemb;
+	childs = toyfs_childs_list_of(dir_tii);
+	for (pos = childs->next; pos != childs; pos = pos->next) {
+		itr = &_dentries_of(pos)->de[0];
+		end = itr + ARRAY_SIZE(_dentries_of(pos)->de);
+		for (; itr < end; itr = _next_dirent(itr))
+			if (_is_active(itr))
+				_dindex_put(ents, nslots,
+					    _hash_name(itr->d_name,
+						       itr->d_nlen), itr);
+	}
+	d->d_index = ents;
+	d->d_nslots = nslots;
+	dir_tii->ti->i_blocks += npages;
+	return 0;
+}
+
+static void _dindex_insert(struct toyfs_inode_info *dir_tii,
+			   struct toyfs_dirent *de)
+{
+	uint32_t nslots;
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+
+	d->d_count++;
+	if (d->d_index &&
+	    (4 * (uint64_t)d->d_count <= 3 * (uint64_t)d->d_nslots))
+		goto put;
+
+	if (d->d_count >= dir_tii->dindex_retry) {
+		nslots = d->d_nslots ? d->d_nslots : TOYFS_DINDEX_PER_PAGE;
+		while (4 * (uint64_t)d->d_count > 3 * (uint64_t)nslots)
+			nslots *= 2;
+		if (!_dindex_rebuild(dir_tii, nslots))
+			return; /* de is already in place */
+
+		/* Not before d_count doubles, each try walks all dentries */
+		dir_tii->dindex_retry = 2 * d->d_count;
+	}
+
+	/* Over-full is still better than none, while a slot stays empty */
+	if (!d->d_index)
+		return;
+	if (d->d_count >= d->d_nslots) {
+		_dindex_free(dir_tii);
+		return;
+	}
+put:
+	_dindex_put(d->d_index, d->d_nslots,
+		    _hash_name(de->d_name, de->d_nlen), de);
+}
+
+static void _dindex_remove(struct toyfs_inode_info *dir_tii,
+			   struct toyfs_dirent *de)
+{
+	size_t i, j, k, mask;
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+	struct toyfs_dindex_ent *ents = d->d_index;
+
+	toyfs_assert(d->d_count > 0);
+	d->d_count--;
+	if (!ents)
+		return;
+
+	mask = d->d_nslots - 1;
+	i = _hash_name(de->d_name, de->d_nlen) & mask;
+	while (ents[i].de != de) {
+		toyfs_assert(ents[i].hash);
+		i = (i + 1) & mask;
+	}
+
+	/* Backward-shift deletion keeps probe sequences tombstone free */
+	for (j = (i + 1) & mask; ents[j].hash; j = (j + 1) & mask) {
+		k = ents[j].hash & mask;
+		if (((j > i) && ((k <= i) || (k > j))) ||
+		    ((j < i) && ((k <= i) && (k > j)))) {
+			ents[i] = ents[j];
+			i = j;
+		}
+	}
+	ents[i].hash = 0;
+	ents[i].de = NULL;
+}
+
+static struct toyfs_dirent *
+_dindex_lookup(struct toyfs_inode_info *dir_tii, const struct zufs_str *str)
+{
+	size_t i, mask;
+	uint64_t hash;
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+	struct toyfs_dindex_ent *ents = d->d_index;
+
+	mask = d->d_nslots - 1;
+	hash = _hash_name(str->name, str->len);
+	for (i = hash & mask; ents[i].hash; i = (i + 1) & mask)
+		if ((ents[i].hash == hash) && _hasname(ents[i].de, str))
+			return ents[i].de;
+	return NULL;
 }
 
 struct toyfs_dirent *toyfs_lookup_dirent(struct toyfs_inode_info *dir_tii,
@@ -141,6 +353,9 @@ struct toyfs_dirent *toyfs_lookup_dirent(struct toyfs_inode_info *dir_tii,
 	struct toyfs_dirent *dirent;
 	struct toyfs_list_head *childs, *itr;
 
+	if (_dindex_of(dir_tii))
+		return _dindex_lookup(dir_tii, str);
+
 	childs = toyfs_childs_list_of(dir_tii);
 	itr = childs->next;
 	while (itr != childs) {
@@ -152,26 +367,28 @@ struct toyfs_dirent *toyfs_lookup_dirent(struct toyfs_inode_info *dir_tii,
 	return NULL;
 }
 
+/*
+ * i_dir.d_free points at the first dentries page which has any free slot;
+ * all pages before it are full, so creates do not re-scan them. NULL means
+ * all pages are full.
+ */
 static struct toyfs_dirent *
 _acquire_dirent(struct toyfs_inode_info *dir_tii, size_t nlen)
 {
-	int64_t d_off = 2;
 	struct toyfs_dirent *dirent;
 	struct toyfs_list_head *childs, *itr;
 	struct toyfs_pmemb *pmemb;
 	struct toyfs_dentries *dentries;
+	struct _t_dir *d = &dir_tii->ti->i_dir;
 
 	childs = toyfs_childs_list_of(dir_tii);
-	itr = childs->next;
+	itr = d->d_free ? &((struct toyfs_dentries *)d->d_free)->head : childs;
 	while (itr != childs) {
 		dentries = _dentries_of(itr);
 		dirent = _search_free(dentries, nlen);
-		if (dirent != NULL) {
-			d_off += dirent - dentries->de;
+		if (dirent != NULL)
 			goto out;
-		}
 		itr = itr->next;
-		d_off += (int64_t)ARRAY_SIZE(dentries->de);
 	}
 
 	pmemb = toyfs_acquire_pmemb(dir_tii->sbi);
@@ -181,11 +398,21 @@ _acquire_dirent(struct toyfs_inode_info *dir_tii, size_t nlen)
 	dir_tii->ti->i_blocks += 1;
 
 	dentries = (struct toyfs_dentries *)pmemb;
+	dentries->d_pgno = toyfs_list_empty(childs) ? 0 :
+			   _dentries_of(childs->prev)->d_pgno + 1;
+	dentries->d_nfree = ARRAY_SIZE(dentries->de);
 	toyfs_list_add_tail(&dentries->head, childs);
+	if (!d->d_free)
+		d->d_free = dentries;
 	dirent = dentries->de;
 
 out:
-	dirent->d_off = d_off;
+	dentries->d_nfree -= _namelen_to_nde(NULL, nlen);
+	while (d->d_free && !((struct toyfs_dentries *)d->d_free)->d_nfree) {
+		itr = ((struct toyfs_dentries *)d->d_free)->head.next;
+		d->d_free = (itr != childs) ? _dentries_of(itr) : NULL;
+	}
+	dirent->d_off = _d_off_of(dentries, dirent);
 	return dirent;
 }
 
@@ -194,6 +421,7 @@ static void _add_dirent(struct toyfs_inode_info *dir_tii,
 			struct toyfs_dirent *dirent)
 {
 	_set_dirent(dirent, str->name, str->len, tii, dirent->d_off);
+	_dindex_insert(dir_tii, dirent);
 	/* Can not inc/dec by 1 because readdir will fail (it checks i_size) */
 	dir_tii->ti->i_size += PAGE_SIZE;
 	zus_std_add_dentry(dir_tii->zii.zi, tii->zii.zi);
@@ -233,7 +461,14 @@ void toyfs_remove_dirent(struct toyfs_inode_info *dir_tii,
 			 struct toyfs_inode_info *tii,
 			 struct toyfs_dirent *dirent)
 {
+	struct toyfs_dentries *dentries = _dentries_of_de(dirent);
+	struct _t_dir *d = &dir_tii->ti->i_dir;
+
+	_dindex_remove(dir_tii, dirent);
 	_reset_dirent(dirent);
+	if (!d->d_free ||
+	    (dentries->d_pgno < ((struct toyfs_dentries *)d->d_free)->d_pgno))
+		d->d_free = dentries;
 	dir_tii->ti->i_size -= PAGE_SIZE;
 	zus_std_remove_dentry(dir_tii->zii.zi, tii->zii.zi);
 }
@@ -367,6 +602,10 @@ static bool _iterate_dir(struct toyfs_inode_info *dir_tii,
 	childs = toyfs_childs_list_of(dir_tii);
 	itr = childs->next;
 	while (ok && (itr != childs)) {
+		if (_last_d_off(_dentries_of(itr)) < ctx->pos) {
+			itr = itr->next;
+			continue;
+		}
 		ok = _iterate_dentries(_dentries_of(itr), ctx);
 		if (ok)
 			itr = itr->next;
@@ -398,6 +637,9 @@ void toyfs_release_dir(struct toyfs_inode_info *dir_tii)
 	struct toyfs_dentries *dentries;
 	struct toyfs_pmemb *pmemb;
 
+	_dindex_free(dir_tii);
+	dir_tii->ti->i_dir.d_free = NULL;
+
 	childs = toyfs_childs_list_of(dir_tii);
 	itr = childs->next;
 	while (itr != childs) {
@@ -40,30 +40,37 @@ static void _drop_iblkref(struct toyfs_inode_info *tii,
 			  struct toyfs_iblkref *iblkref);
 
 static struct toyfs_iblkref *
-_require_iblkref(struct toyfs_inode_info *tii, loff_t off);
+_require_iblkref(struct toyfs_inode_info *tii, loff_t off, loff_t end);
 
 static struct toyfs_pmemb *
 _unique_pmemb(struct toyfs_sb_info *sbi, struct toyfs_iblkref *iblkref);
 
 
-static struct toyfs_dblkref *_new_dblkref(struct toyfs_sb_info *sbi)
+static struct toyfs_dblkref *_new_dblkref_of(struct toyfs_sb_info *sbi,
+					     struct toyfs_pmemb *pmemb)
 {
-	struct toyfs_pmemb *pmemb;
-	struct toyfs_dblkref *dblkref = NULL;
-
-	pmemb = toyfs_acquire_pmemb(sbi);
-	if (!pmemb)
-		goto out;
+	struct toyfs_dblkref *dblkref;
 
 	dblkref = toyfs_acquire_dblkref(sbi);
 	if (!dblkref)
-		goto out;
+		return NULL;
 
 	dblkref->bn = toyfs_addr2bn(sbi, pmemb);
 	dblkref->refcnt = 1;
+	return dblkref;
+}
 
-out:
-	if (pmemb && !dblkref)
+static struct toyfs_dblkref *_new_dblkref(struct toyfs_sb_info *sbi)
+{
+	struct toyfs_pmemb *pmemb;
+	struct toyfs_dblkref *dblkref;
+
+	pmemb = toyfs_acquire_pmemb(sbi);
+	if (!pmemb)
+		return NULL;
+
+	dblkref = _new_dblkref_of(sbi, pmemb);
+	if (!dblkref)
 		toyfs_release_pmemb(sbi, pmemb);
 	return dblkref;
 }
@@ -92,28 +99,28 @@ static void _decref_dblkref(struct toyfs_sb_info *sbi,
 		_free_dblkref(sbi, dblkref);
 }
 
+/* On failure the caller still owns pmemb */
 static struct toyfs_iblkref *
-_new_iblkref(struct toyfs_inode_info *tii, loff_t off)
+_new_iblkref(struct toyfs_inode_info *tii, loff_t off,
+	     struct toyfs_pmemb *pmemb)
 {
-	struct toyfs_dblkref *dblkref = NULL;
-	struct toyfs_iblkref *iblkref = NULL;
+	struct toyfs_dblkref *dblkref;
+	struct toyfs_iblkref *iblkref;
 	struct zus_inode *zi = tii->zii.zi;
 
-	dblkref = _new_dblkref(tii->sbi);
+	dblkref = _new_dblkref_of(tii->sbi, pmemb);
 	if (!dblkref)
-		goto out;
+		return NULL;
 
 	iblkref = toyfs_acquire_iblkref(tii->sbi);
-	if (!iblkref)
-		goto out;
+	if (!iblkref) {
+		toyfs_release_dblkref(tii->sbi, dblkref);
+		return NULL;
+	}
 
 	iblkref->dblkref = dblkref;
 	iblkref->off = off;
 	zi->i_blocks++;
-
-out:
-	if (!iblkref && dblkref)
-		_decref_dblkref(tii->sbi, dblkref);
 	return iblkref;
 }
 
@@ -165,11 +172,11 @@ static size_t _nbytes_in_range(loff_t off, loff_t next, loff_t end)
 	return (size_t)((next < end) ? (next - off) : (end - off));
 }
 
+/* pmemb may be the first of a run of physically contiguous blocks */
 static void _copy_out(void *tgt, const struct toyfs_pmemb *pmemb,
 		      loff_t off, size_t len)
 {
-	toyfs_assert(len <= sizeof(pmemb->dat));
-	toyfs_assert((size_t)off + len <= sizeof(pmemb->dat));
+	toyfs_assert((size_t)off < sizeof(pmemb->dat));
 	memcpy(tgt, &pmemb->dat[off], len);
 }
 
@@ -177,8 +184,7 @@ static void _copy_in(struct toyfs_pmemb *pmemb, const void *src,
 		     loff_t off, size_t len)
 {
 	toyfs_assert(pmemb != NULL);
-	toyfs_assert(len <= sizeof(pmemb->dat));
-	toyfs_assert((size_t)off + len <= sizeof(pmemb->dat));
+	toyfs_assert((size_t)off < sizeof(pmemb->dat));
 	pmem_memmove_persist(&pmemb->dat[off], src, len);
 }
 
@@ -267,42 +273,63 @@ struct toyfs_list_head *toyfs_iblkrefs_list_of(struct toyfs_inode_info *tii)
 	return &tii->ti->list_head;
 }
 
+static size_t _off_to_index(loff_t off)
+{
+	return (size_t)off / PAGE_SIZE;
+}
+
 static struct toyfs_iblkref *
 _fetch_iblkref(struct toyfs_inode_info *tii, loff_t off)
 {
-	struct toyfs_list_head *itr;
-	struct toyfs_list_head *iblkrefs;
-	struct toyfs_iblkref *iblkref;
-	const loff_t boff = _off_to_boff(off);
-
-	iblkrefs = toyfs_iblkrefs_list_of(tii);
-	itr = iblkrefs->next;
-	while (itr != iblkrefs) {
-		iblkref = iblkref_of(itr);
-		if (iblkref->off == boff)
-			return iblkref;
-		itr = itr->next;
-	}
-	return NULL;
+	return toyfs_bmap_lookup(tii, _off_to_index(off));
 }
 
 static struct toyfs_iblkref *
 _fetch_iblkref_from(struct toyfs_inode_info *tii, loff_t off)
 {
-	struct toyfs_list_head *itr;
-	struct toyfs_list_head *iblkrefs;
-	struct toyfs_iblkref *iblkref;
-	const loff_t boff = _off_to_boff(off);
+	return toyfs_bmap_lookup_from(tii, _off_to_index(off));
+}
 
-	iblkrefs = toyfs_iblkrefs_list_of(tii);
-	itr = iblkrefs->next;
-	while (itr != iblkrefs) {
-		iblkref = iblkref_of(itr);
-		if (iblkref->off >= boff)
-			return iblkref;
-		itr = itr->next;
+static struct toyfs_iblkref *
+_next_iblkref(struct toyfs_inode_info *tii, struct toyfs_iblkref *iblkref)
+{
+	struct toyfs_list_head *iblkrefs = toyfs_iblkrefs_list_of(tii);
+
+	if (iblkref->head.next == iblkrefs)
+		return NULL;
+	return iblkref_of(iblkref->head.next);
+}
+
+/*
+ * Returns the end offset of the run of pages starting at iblkref which are
+ * both logically and physically contiguous (and, if unique is set, not
+ * shared with other inodes), bounded by end.
+ */
+static loff_t _extent_end(struct toyfs_inode_info *tii,
+			  struct toyfs_iblkref *iblkref, loff_t end,
+			  bool unique)
+{
+	struct toyfs_iblkref *next;
+	loff_t nxt = _next_page(iblkref->off);
+
+	while (nxt < end) {
+		next = _next_iblkref(tii, iblkref);
+		if (!next || (next->off != nxt) ||
+		    (next->dblkref->bn != iblkref->dblkref->bn + 1))
+			break;
+		if (unique && (next->dblkref->refcnt > 1))
+			break;
+		iblkref = next;
+		nxt = _next_page(nxt);
 	}
-	return NULL;
+	return nxt;
+}
+
+static loff_t _hole_end(struct toyfs_inode_info *tii, loff_t off, loff_t end)
+{
+	struct toyfs_iblkref *next = _fetch_iblkref_from(tii, off);
+
+	return (next && (next->off < end)) ? next->off : end;
 }
 
 static struct toyfs_pmemb *
@@ -326,6 +353,7 @@ static ssize_t _read(struct toyfs_inode_info *tii,
 	int err;
 	size_t cnt = 0;
 	loff_t end, nxt;
+	struct toyfs_iblkref *iblkref;
 	struct toyfs_pmemb *pmemb;
 
 	DBG("read: ino=%ld off=%ld len=%lu\n", tii->ino, off, len);
@@ -334,15 +362,20 @@ static ssize_t _read(struct toyfs_inode_info *tii,
 	if (err)
 		return err;
 
+	/* One copy per contiguous extent, one memset per hole */
 	end = _tin_offset(off, len, tii->ti->i_size);
 	while (off < end) {
-		pmemb = _fetch_pmemb_by_offset(tii, off);
-		nxt = _next_page(off);
-		len = _nbytes_in_range(off, nxt, end);
-		if (pmemb)
+		iblkref = _fetch_iblkref(tii, off);
+		if (iblkref) {
+			nxt = _extent_end(tii, iblkref, end, false);
+			len = _nbytes_in_range(off, nxt, end);
+			pmemb = toyfs_bn2pmemb(tii->sbi, iblkref->dblkref->bn);
 			_copy_out(buf, pmemb, _off_in_page(off), len);
-		else
+		} else {
+			nxt = _hole_end(tii, off, end);
+			len = _nbytes_in_range(off, nxt, end);
 			_fill_zeros(buf, len);
+		}
 
 		cnt += len;
 		off = nxt;
@@ -384,33 +417,89 @@ static void _clone_data(struct toyfs_sb_info *sbi,
 	toyfs_sbi_unlock(sbi);
 }
 
-static struct toyfs_iblkref *
-_require_iblkref(struct toyfs_inode_info *tii, loff_t off)
+static int _link_iblkref(struct toyfs_inode_info *tii,
+			 struct toyfs_iblkref *iblkref)
 {
+	int err;
 	struct toyfs_list_head *itr;
-	struct toyfs_dblkref *dblkref;
-	struct toyfs_iblkref *iblkref = NULL;
-	struct toyfs_list_head *iblkrefs;
-	const loff_t boff = _off_to_boff(off);
+	struct toyfs_iblkref *next;
+	struct toyfs_list_head *iblkrefs = toyfs_iblkrefs_list_of(tii);
+	const size_t index = _off_to_index(iblkref->off);
 
-	iblkrefs = toyfs_iblkrefs_list_of(tii);
-	itr = iblkrefs->next;
-	while (itr != iblkrefs) {
-		iblkref = iblkref_of(itr);
-		if (iblkref->off == boff)
+	err = toyfs_bmap_insert(tii, index, iblkref);
+	if (err)
+		return err;
+
+	/* Common case of appending pages at end-of-file */
+	itr = iblkrefs->prev;
+	if ((itr == iblkrefs) || (iblkref_of(itr)->off < iblkref->off)) {
+		toyfs_list_add_tail(&iblkref->head, iblkrefs);
+		return 0;
+	}
+
+	next = toyfs_bmap_lookup_from(tii, index + 1);
+	toyfs_assert(next != NULL);
+	toyfs_list_add_before(&iblkref->head, &next->head);
+	return 0;
+}
+
+/*
+ * Allocates blocks for the hole at boff, up to end or the next existing
+ * block, as a single physically contiguous run when possible. The run is
+ * placed right after the block of the preceding page, if it has one.
+ */
+static int _fill_hole(struct toyfs_inode_info *tii, loff_t boff, loff_t end)
+{
+	int err = 0;
+	size_t i, want, cnt, goal_bn = 0;
+	struct toyfs_pmemb *pmemb;
+	struct toyfs_iblkref *iblkref;
+
+	want = (size_t)(_hole_end(tii, boff, end) - boff + PAGE_SIZE - 1) /
+		PAGE_SIZE;
+	if (boff) {
+		iblkref = _fetch_iblkref(tii, boff - (loff_t)PAGE_SIZE);
+		if (iblkref)
+			goal_bn = iblkref->dblkref->bn + 1;
+	}
+
+	pmemb = toyfs_acquire_pmembs(tii->sbi, goal_bn, want, &cnt);
+	if (!pmemb)
+		return -ENOSPC;
+
+	for (i = 0; i < cnt; ++i) {
+		iblkref = _new_iblkref(tii, boff + (loff_t)(i * PAGE_SIZE),
+				       &pmemb[i]);
+		if (!iblkref) {
+			err = -ENOSPC;
 			break;
-		if (iblkref->off > boff) {
-			iblkref = NULL;
+		}
+		err = _link_iblkref(tii, iblkref);
+		if (err) {
+			_free_iblkref(tii, iblkref); /* releases pmemb[i] */
+			++i;
 			break;
 		}
-		itr = itr->next;
-		iblkref = NULL;
 	}
+	if (err && (i < cnt))
+		toyfs_release_pmembs(tii->sbi, &pmemb[i], cnt - i);
+	return err;
+}
+
+static struct toyfs_iblkref *
+_require_iblkref(struct toyfs_inode_info *tii, loff_t off, loff_t end)
+{
+	int err;
+	struct toyfs_dblkref *dblkref;
+	struct toyfs_iblkref *iblkref;
+	const loff_t boff = _off_to_boff(off);
+
+	iblkref = _fetch_iblkref(tii, boff);
 	if (!iblkref) {
-		iblkref = _new_iblkref(tii, boff);
-		if (!iblkref)
+		err = _fill_hole(tii, boff, end);
+		if (err)
 			return NULL;
-		toyfs_list_add_before(&iblkref->head, itr);
+		iblkref = _fetch_iblkref(tii, boff);
 	} else if (iblkref->dblkref->refcnt > 1) {
 		dblkref = _new_dblkref(tii->sbi);
 		if (!dblkref)
@@ -421,11 +510,12 @@ _require_iblkref(struct toyfs_inode_info *tii, loff_t off)
 	return iblkref;
 }
 
-uint64_t toyfs_require_pmem_bn(struct toyfs_inode_info *tii, loff_t off)
+uint64_t toyfs_require_pmem_bn(struct toyfs_inode_info *tii, loff_t off,
+			       size_t len)
 {
 	struct toyfs_iblkref *iblkref;
 
-	iblkref = _require_iblkref(tii, off);
+	iblkref = _require_iblkref(tii, off, off + (loff_t)len);
 	return iblkref ? iblkref->dblkref->bn : 0;
 }
 
@@ -447,12 +537,13 @@ static ssize_t _write(struct toyfs_inode_info *tii,
 
 	end = off + (loff_t)len;
 	while (off < end) {
-		iblkref = _require_iblkref(tii, off);
+		iblkref = _require_iblkref(tii, off, end);
 		if (!iblkref)
 			return -ENOSPC;
 		pmemb = toyfs_bn2pmemb(tii->sbi, iblkref->dblkref->bn);
 
-		nxt = _next_page(off);
+		/* One copy per contiguous extent */
+		nxt = _extent_end(tii, iblkref, end, true);
 		len = _nbytes_in_range(off, nxt, end);
 		_copy_in(pmemb, buf, _off_in_page(off), len);
 
@@ -511,17 +602,17 @@ static int _punch_hole(struct toyfs_inode_info *tii, loff_t from, size_t nbytes)
 {
 	size_t len;
 	loff_t off, end, nxt;
-	struct toyfs_iblkref *iblkref;
+	struct toyfs_iblkref *iblkref, *next;
 
-	off = from;
-	end = off + (loff_t)nbytes;
-	while (off < end) {
-		iblkref = _fetch_iblkref(tii, off);
-		nxt = _next_page(off);
+	end = from + (loff_t)nbytes;
+	iblkref = _fetch_iblkref_from(tii, from);
+	while (iblkref && (iblkref->off < end)) {
+		next = _next_iblkref(tii, iblkref);
+		off = (iblkref->off < from) ? from : iblkref->off;
+		nxt = _next_page(iblkref->off);
 		len = _nbytes_in_range(off, nxt, end);
-		if (iblkref)
-			_punch_hole_at(tii, iblkref, off, len);
-		off = nxt;
+		_punch_hole_at(tii, iblkref, off, len);
+		iblkref = next;
 	}
 	return 0;
 }
@@ -557,25 +648,49 @@ static int _collapse_range(struct toyfs_inode_info *tii,
 			   loff_t from, size_t nbytes)
 {
 	int err;
-	struct toyfs_list_head *itr;
-	struct toyfs_iblkref *iblkref;
-	struct toyfs_list_head *iblkrefs = toyfs_iblkrefs_list_of(tii);
+	size_t index, shift = nbytes / PAGE_SIZE;
+	struct toyfs_iblkref *first, *iblkref, *itr;
 
 	err = _punch_hole(tii, from, nbytes);
 	if (err)
 		return err;
+
+	/*
+	 * Allocate all tree nodes of the new indexes up front, so running out
+	 * of space fails before any block is re-keyed.
+	 */
+	first = _fetch_iblkref_from(tii, from);
+	for (iblkref = first; iblkref; iblkref = _next_iblkref(tii, iblkref)) {
+		index = _off_to_index(iblkref->off);
+		err = toyfs_bmap_reserve(tii, index - shift);
+		if (err)
+			goto out_unreserve;
+	}
+
 	if (nbytes <= tii->zii.zi->i_size)
 		tii->ti->i_size -= nbytes;
-	iblkref = _fetch_iblkref_from(tii, from);
-	if (iblkref) {
-		itr = &iblkref->head;
-		while (itr != iblkrefs) {
-			iblkref = iblkref_of(itr);
-			iblkref->off -= (loff_t)nbytes;
-			itr = itr->next;
-		}
+
+	/*
+	 * Re-key in ascending order: the new index is either within the
+	 * punched range or was vacated by a previous iteration.
+	 */
+	for (iblkref = first; iblkref; iblkref = _next_iblkref(tii, iblkref)) {
+		index = _off_to_index(iblkref->off);
+		toyfs_bmap_move(tii, index, index - shift);
+		iblkref->off -= (loff_t)nbytes;
 	}
+	for (iblkref = first; iblkref; iblkref = _next_iblkref(tii, iblkref))
+		toyfs_bmap_prune(tii, _off_to_index(iblkref->off) + shift);
 	return 0;
+
+out_unreserve:
+	/* Including the failed one, which may have allocated some nodes */
+	for (itr = first; ; itr = _next_iblkref(tii, itr)) {
+		toyfs_bmap_prune(tii, _off_to_index(itr->off) - shift);
+		if (itr == iblkref)
+			break;
+	}
+	return err;
 }
 
 static int _falloc_range(struct toyfs_inode_info *tii,
@@ -588,7 +703,7 @@ static int _falloc_range(struct toyfs_inode_info *tii,
 	off = from;
 	end = off + (loff_t)nbytes;
 	while (off < end) {
-		iblkref = _require_iblkref(tii, off);
+		iblkref = _require_iblkref(tii, off, end);
 		if (!iblkref)
 			return -ENOSPC;
 
@@ -651,18 +766,30 @@ static int _seek_block(struct toyfs_inode_info *tii, loff_t from,
 		       bool seek_exist, loff_t *out_off)
 {
 	loff_t off, end;
-	const struct toyfs_pmemb *pmemb;
+	struct toyfs_iblkref *iblkref;
 
 	off = from;
 	end = (loff_t)(tii->ti->i_size);
-	while (off < end) {
-		pmemb = _fetch_pmemb_by_offset(tii, off);
-		if ((pmemb && seek_exist) || (!pmemb && !seek_exist)) {
+	if (off >= end)
+		return 0;
+
+	if (seek_exist) {
+		iblkref = _fetch_iblkref_from(tii, off);
+		if (iblkref && (iblkref->off > off))
+			off = iblkref->off;
+		if (iblkref && (off < end))
 			*out_off = off;
-			break;
-		}
-		off = _next_page(off);
+		return 0;
+	}
+
+	/* Skip over the consecutive pages starting at from */
+	iblkref = _fetch_iblkref(tii, off);
+	while (iblkref && (iblkref->off <= off)) {
+		off = _next_page(iblkref->off);
+		iblkref = _next_iblkref(tii, iblkref);
 	}
+	if (off < end)
+		*out_off = off;
 	return 0;
 }
 
@@ -703,6 +830,7 @@ static void _drop_iblkref(struct toyfs_inode_info *tii,
 	if (iblkref) {
 		DBG_("drop page: ino=%lu off=%ld bn=%lu\n",
 		     tii->ino, iblkref->off, iblkref->dblkref->bn);
+		toyfs_bmap_remove(tii, _off_to_index(iblkref->off));
 		toyfs_list_del(&iblkref->head);
 		_free_iblkref(tii, iblkref);
 	}
@@ -710,20 +838,16 @@ static void _drop_iblkref(struct toyfs_inode_info *tii,
 
 static void _drop_range(struct toyfs_inode_info *tii, loff_t pos)
 {
-	struct toyfs_list_head *itr;
-	struct toyfs_iblkref *iblkref = NULL;
-	struct toyfs_list_head *iblkrefs = toyfs_iblkrefs_list_of(tii);
+	struct toyfs_iblkref *iblkref, *next;
 
 	if (pos % PAGE_SIZE)
 		pos = _next_page(pos);
 
-	itr = iblkrefs->next;
-	while (itr != iblkrefs) {
-		iblkref = iblkref_of(itr);
-		itr = itr->next;
-
-		if (iblkref->off >= pos)
-			_drop_iblkref(tii, iblkref);
+	iblkref = _fetch_iblkref_from(tii, pos);
+	while (iblkref) {
+		next = _next_iblkref(tii, iblkref);
+		_drop_iblkref(tii, iblkref);
+		iblkref = next;
 	}
 }
 
@@ -772,6 +896,7 @@ int toyfs_truncate(struct toyfs_inode_info *tii, size_t size)
 static int _clone_entire_file_range(struct toyfs_inode_info *src_tii,
 				    struct toyfs_inode_info *dst_tii)
 {
+	int err;
 	struct toyfs_list_head *itr;
 	struct toyfs_iblkref *src_iblkref, *dst_iblkref;
 	struct zus_inode *src_zi = src_tii->zii.zi;
@@ -793,6 +918,13 @@ static int _clone_entire_file_range(struct toyfs_inode_info *src_tii,
 			return -ENOSPC;
 		}
 		dst_iblkref->off = src_iblkref->off;
+		err = toyfs_bmap_insert(dst_tii, _off_to_index(dst_iblkref->off),
+					dst_iblkref);
+		if (err) {
+			toyfs_release_iblkref(dst_tii->sbi, dst_iblkref);
+			toyfs_sbi_unlock(dst_tii->sbi);
+			return err;
+		}
 		dst_iblkref->dblkref = src_iblkref->dblkref;
 		dst_iblkref->dblkref->refcnt++;
 		toyfs_list_add_tail(&dst_iblkref->head, dst_iblkrefs);
@@ -862,7 +994,8 @@ static int _clone_range(struct toyfs_inode_info *src_tii,
 	src_iblkref = _fetch_iblkref(src_tii, src_off);
 
 	if (src_iblkref) {
-		dst_iblkref = _require_iblkref(dst_tii, dst_off);
+		dst_iblkref = _require_iblkref(dst_tii, dst_off,
+					       dst_off + (loff_t)len);
 		if (!dst_iblkref)
 			return -ENOSPC;
 		_share_page(sbi, src_iblkref, dst_iblkref);
@@ -963,11 +1096,11 @@ static int _fiemap(struct toyfs_inode_info *tii,
 		   loff_t offset, size_t len)
 {
 	int err = 0;
-	uint32_t flags = 0;
+	bool shared;
+	uint32_t flags;
 	uint64_t length;
-	loff_t logical, phys;
-	struct toyfs_list_head *iblkrefs, *itr;
-	struct toyfs_iblkref *iblkref, *iblkref_next;
+	loff_t logical, phys, end;
+	struct toyfs_iblkref *iblkref, *next;
 	struct zus_inode *zi = tii->zii.zi;
 	struct toyfs_sb_info *sbi = tii->sbi;
 
@@ -976,33 +1109,31 @@ static int _fiemap(struct toyfs_inode_info *tii,
 	if (!S_ISREG(zi->i_mode))
 		return -ENOTSUP;
 
+	end = (len < TOYFS_ISIZE_MAX) ? offset + (loff_t)len :
+					(loff_t)TOYFS_ISIZE_MAX;
+
 	toyfs_sbi_lock(sbi);
-	iblkrefs = toyfs_iblkrefs_list_of(tii);
 	iblkref = _fetch_iblkref_from(tii, offset);
-	if (!iblkref)
-		goto out;
-
-	itr = &iblkref->head;
-	while ((itr != iblkrefs) && !(flags & FIEMAP_EXTENT_LAST)) {
-		iblkref = iblkref_of(itr);
-		flags = 0;
-		length = 0;
+	while (iblkref && (iblkref->off < end)) {
 		logical = iblkref->off;
 		phys = (loff_t)physaddr_of(sbi, iblkref);
-		while (itr != iblkrefs) {
+		shared = (iblkref->dblkref->refcnt > 1);
+		length = PAGE_SIZE;
+
+		/* Merge pages which are logically and physically contiguous */
+		next = _next_iblkref(tii, iblkref);
+		while (next && (next->off == iblkref->off + (loff_t)PAGE_SIZE) &&
+		       (next->dblkref->bn == iblkref->dblkref->bn + 1) &&
+		       ((next->dblkref->refcnt > 1) == shared)) {
 			length += PAGE_SIZE;
-			itr = itr->next;
-			if (iblkref->dblkref->refcnt > 1)
-				flags |= FIEMAP_EXTENT_SHARED;
-			if (itr == iblkrefs)
-				flags |= FIEMAP_EXTENT_LAST;
-			if (flags)
-				break;
-
-			iblkref_next = iblkref_of(itr);
-			if (iblkref_next->off > (iblkref->off + PAGE_SIZE))
-				break;
+			iblkref = next;
+			next = _next_iblkref(tii, iblkref);
 		}
+
+		flags = shared ? FIEMAP_EXTENT_SHARED : 0;
+		if (!next)
+			flags |= FIEMAP_EXTENT_LAST;
+
 		err = zufs_fiemap_fill_next_extent(fieinfo, (__u64)logical,
 						   (__u64)phys, length, flags);
 		if (err) {
@@ -1010,8 +1141,8 @@ static int _fiemap(struct toyfs_inode_info *tii,
 				err = 0;
 			break;
 		}
+		iblkref = next;
 	}
-out:
 	toyfs_sbi_unlock(sbi);
 	DBG("fiemap: ino=%ld extents_max=%u extents_mapped=%u\n",
 		tii->ino, fieinfo->fi_extents_max, fieinfo->fi_extents_mapped);
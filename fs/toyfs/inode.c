@@ -84,13 +84,14 @@ toyfs_new_inode(struct zus_sb_info *zsbi,
 
 	if (zi_isdir(zi)) {
 		DBG("new_inode(dir): ino=%lu\n", ino);
-		toyfs_list_init(toyfs_childs_list_of(tii));
+		toyfs_init_dir(tii);
 		ti->i_size = 0;
 		ti->i_dir.parent = dir_tii->ti->i_ino;
 		zus_std_new_dir(dir_tii->zii.zi, toyfs_ti2zi(ti));
 	} else if (zi_isreg(zi)) {
 		DBG("new_inode(reg): ino=%lu\n", ino);
 		toyfs_list_init(toyfs_iblkrefs_list_of(tii));
+		toyfs_bmap_init(tii);
 		if (ioc_new->flags & ZI_TMPFILE)
 			ti->i_nlink = 1;
 	} else if (zi_islnk(zi)) {
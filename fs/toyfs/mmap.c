@@ -27,6 +27,11 @@
 
 #define GB_WRITE 1
 
+static loff_t _off_in_page(loff_t off)
+{
+	return off % (loff_t)PAGE_SIZE;
+}
+
 
 static uint64_t _resolve_bn(const struct toyfs_inode_info *tii,
 			    struct toyfs_pmemb *pmemb)
@@ -34,56 +39,70 @@ static uint64_t _resolve_bn(const struct toyfs_inode_info *tii,
 	return pmemb ? toyfs_addr2bn(tii->sbi, (void *)pmemb) : 0;
 }
 
-static int _get_block_rd(struct toyfs_inode_info *tii, loff_t off,
-			 struct zufs_ioc_IO *get_block)
+/* Number of pages asked for, bounded by what fits in the reply */
+static size_t _multy_npages(struct zufs_ioc_IO *io)
 {
-	struct toyfs_pmemb *pmemb;
-	struct zus_iomap_build iomb = {};
+	size_t npages, max_npages;
 
-	_zus_iom_init_4_ioc_io(&iomb, &tii->sbi->s_zus_sbi,
-			       get_block, ZUS_MAX_OP_SIZE);
-	pmemb = toyfs_resolve_pmemb(tii, off);
-
-	_zus_iom_start(&iomb, NULL, NULL);
-	_ziom_enc_t1_bn(&iomb, _resolve_bn(tii, pmemb), 0);
-	_zus_iom_end(&iomb);
-	get_block->ret_flags = 0;
-	get_block->hdr.out_len = _ioc_IO_size(1);
+	npages = (_off_in_page(io->filepos) + io->hdr.len + PAGE_SIZE - 1) /
+		 PAGE_SIZE;
+	max_npages = (ZUS_MAX_OP_SIZE - _ioc_IO_size(0)) / sizeof(__u64) - 1;
 
-	return 0;
+	if (!npages)
+		return 1;
+	return (npages < max_npages) ? npages : max_npages;
 }
 
-static int _get_block_wr(struct toyfs_inode_info *tii, loff_t off,
-			 struct zufs_ioc_IO *get_block)
+/*
+ * Maps the run of consecutive file pages starting at off. A read mapping
+ * stops at the first hole (a hole at off itself is encoded as bn 0) and a
+ * write mapping stops where new and existing blocks meet, so that
+ * ZUFS_RET_NEW applies to the whole reply.
+ */
+static int _get_blocks(struct toyfs_inode_info *tii, loff_t off,
+		       struct zufs_ioc_IO *get_block, bool wr)
 {
+	size_t i, npages;
 	uint64_t pmem_bn;
+	bool new_block = false;
 	struct toyfs_pmemb *pmemb;
 	struct zus_iomap_build iomb = {};
 
 	_zus_iom_init_4_ioc_io(&iomb, &tii->sbi->s_zus_sbi,
 			       get_block, ZUS_MAX_OP_SIZE);
+	_zus_iom_start(&iomb, NULL, NULL);
 
-	pmemb = toyfs_resolve_pmemb(tii, off);
-	if (pmemb) {
-		_zus_iom_start(&iomb, NULL, NULL);
-		_ziom_enc_t1_bn(&iomb, _resolve_bn(tii, pmemb), 0);
-		_zus_iom_end(&iomb);
-		get_block->ret_flags = 0;
-		get_block->hdr.out_len = _ioc_IO_size(1);
-
-		return 0;
-	}
-	pmem_bn = toyfs_require_pmem_bn(tii, off);
-	if (pmem_bn) {
-		_zus_iom_start(&iomb, NULL, NULL);
+	off -= _off_in_page(off);
+	npages = _multy_npages(get_block);
+	for (i = 0; i < npages; ++i, off += PAGE_SIZE) {
+		pmemb = toyfs_resolve_pmemb(tii, off);
+		if (pmemb) {
+			if (new_block)
+				break;
+			pmem_bn = _resolve_bn(tii, pmemb);
+		} else if (wr) {
+			if (i && !new_block)
+				break;
+			pmem_bn = toyfs_require_pmem_bn(tii, off,
+						(npages - i) * PAGE_SIZE);
+			if (!pmem_bn) {
+				if (!i)
+					return -ENOSPC;
+				break;
+			}
+			new_block = true;
+		} else {
+			if (i)
+				break;
+			pmem_bn = 0;
+		}
 		_ziom_enc_t1_bn(&iomb, pmem_bn, 0);
-		_zus_iom_end(&iomb);
-		get_block->ret_flags = ZUFS_RET_NEW;
-		get_block->hdr.out_len = _ioc_IO_size(1);
-
-		return 0;
 	}
-	return -ENOSPC;
+	_zus_iom_end(&iomb);
+	get_block->ret_flags = new_block ? ZUFS_RET_NEW : 0;
+	get_block->hdr.out_len = _ioc_IO_size(_zus_iom_len(&iomb));
+
+	return 0;
 }
 
 static int _get_multy(struct zus_inode_info *zii, struct zufs_ioc_IO *io)
@@ -98,10 +117,7 @@ static int _get_multy(struct zus_inode_info *zii, struct zufs_ioc_IO *io)
 	if (!(io->rw & ZUFS_RW_MMAP))
 		return -ENOTSUP;
 
-	if (io->rw & GB_WRITE)
-		err = _get_block_wr(tii, off, io);
-	else
-		err = _get_block_rd(tii, off, io);
+	err = _get_blocks(tii, off, io, io->rw & GB_WRITE);
 
 	DBG("get_block: ino=%ld off=%ld err=%d\n",
 	    (long)tii->ino, (long)io->filepos, err);
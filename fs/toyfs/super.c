@@ -32,13 +32,9 @@
 #define TOYFS_DBLKREFS_PER_PAGE	(PAGE_SIZE / sizeof(struct toyfs_dblkref))
 #define TOYFS_IBLKREFS_PER_PAGE	(PAGE_SIZE / sizeof(struct toyfs_iblkref))
 #define TOYFS_DIRENTS_PER_PAGE	(PAGE_SIZE / sizeof(struct toyfs_dirent))
+#define TOYFS_BITS_PER_WORD	(64)
 
 
-union toyfs_pool_pmemb {
-	struct toyfs_pmemb pmemb;
-	union toyfs_pool_pmemb *next;
-};
-
 union toyfs_inodes_pmemb {
 	struct toyfs_pmemb pmemb;
 	struct toyfs_inode inodes[TOYFS_INODES_PER_PAGE];
@@ -175,36 +171,54 @@ static void _pool_init(struct toyfs_pool *pool)
 {
 	pool->mem = NULL;
 	pool->msz = 0;
-	pool->pages = NULL;
+	pool->blocks = NULL;
+	pool->bitmap = NULL;
+	pool->nblocks = 0;
+	pool->nfree = 0;
+	pool->cursor = 0;
 	toyfs_list_init(&pool->free_dblkrefs);
 	toyfs_list_init(&pool->free_iblkrefs);
 	toyfs_list_init(&pool->free_inodes);
 	toyfs_mutex_init(&pool->mutex);
 }
 
+/*
+ * The pool's free-space is tracked by a bitmap (1 = free) which lives in
+ * the first blocks of the pool's memory. Allocations are runs of
+ * consecutive blocks searched next-fit from a goal block, so sequential
+ * allocations end up physically contiguous.
+ */
 static void _pool_setup(struct toyfs_pool *pool, void *mem, size_t msz)
 {
-	size_t npages, pagei;
-	union toyfs_pool_pmemb *page, *next;
-	union toyfs_pool_pmemb *pages_arr = mem;
+	size_t npages, nbitmap_pages, nwords, i;
+
+	npages = msz / PAGE_SIZE;
+	nwords = (npages + TOYFS_BITS_PER_WORD - 1) / TOYFS_BITS_PER_WORD;
+	nbitmap_pages = (nwords * sizeof(uint64_t) + PAGE_SIZE - 1) / PAGE_SIZE;
 
-	page = next = NULL;
-	npages = msz / sizeof(*page);
-	for (pagei = 0; pagei < npages; ++pagei) {
-		page = &pages_arr[pagei];
-		page->next = next;
-		next = page;
-	}
 	pool->mem = mem;
 	pool->msz = msz;
-	pool->pages = page;
+	pool->bitmap = mem;
+	pool->blocks = (struct toyfs_pmemb *)mem + nbitmap_pages;
+	pool->nblocks = npages - nbitmap_pages;
+	pool->nfree = pool->nblocks;
+	pool->cursor = 0;
+
+	memset(pool->bitmap, 0, nbitmap_pages * PAGE_SIZE);
+	for (i = 0; i < pool->nblocks / TOYFS_BITS_PER_WORD; ++i)
+		pool->bitmap[i] = ~0ULL;
+	for (i = i * TOYFS_BITS_PER_WORD; i < pool->nblocks; ++i)
+		pool->bitmap[i / TOYFS_BITS_PER_WORD] |=
+					1ULL << (i % TOYFS_BITS_PER_WORD);
 }
 
 static void _pool_destroy(struct toyfs_pool *pool)
 {
 	pool->mem = NULL;
 	pool->msz = 0;
-	pool->pages = NULL;
+	pool->blocks = NULL;
+	pool->bitmap = NULL;
+	pool->nblocks = pool->nfree = 0;
 	toyfs_mutex_destroy(&pool->mutex);
 }
 
@@ -218,41 +232,120 @@ static void _pool_unlock(struct toyfs_pool *pool)
 	toyfs_mutex_unlock(&pool->mutex);
 }
 
-static struct toyfs_pmemb *_pool_pop_pmemb_without_lock(struct toyfs_pool *pool)
+static bool _pool_isfree(const struct toyfs_pool *pool, size_t blk)
 {
-	struct toyfs_pmemb *pmemb = NULL;
-	union toyfs_pool_pmemb *pp;
+	return pool->bitmap[blk / TOYFS_BITS_PER_WORD] &
+				(1ULL << (blk % TOYFS_BITS_PER_WORD));
+}
+
+static void _pool_mark(struct toyfs_pool *pool, size_t blk, size_t cnt,
+		       bool free)
+{
+	uint64_t *word;
+	uint64_t mask;
 
-	if (pool->pages) {
-		pp = pool->pages;
-		pool->pages = pp->next;
-		pp->next = NULL;
-		pmemb = &pp->pmemb;
+	for (; cnt; ++blk, --cnt) {
+		word = &pool->bitmap[blk / TOYFS_BITS_PER_WORD];
+		mask = 1ULL << (blk % TOYFS_BITS_PER_WORD);
+		toyfs_assert(!(*word & mask) == free);
+		if (free)
+			*word |= mask;
+		else
+			*word &= ~mask;
 	}
-	return pmemb;
 }
 
-static struct toyfs_pmemb *_pool_pop_pmemb(struct toyfs_pool *pool)
+/* Returns the first free block at-or-after blk, or nblocks if none */
+static size_t _pool_find_free(const struct toyfs_pool *pool, size_t blk)
+{
+	size_t wi;
+	uint64_t word;
+	const size_t nwords =
+		(pool->nblocks + TOYFS_BITS_PER_WORD - 1) / TOYFS_BITS_PER_WORD;
+
+	wi = blk / TOYFS_BITS_PER_WORD;
+	if (wi >= nwords)
+		return pool->nblocks;
+
+	word = pool->bitmap[wi] & (~0ULL << (blk % TOYFS_BITS_PER_WORD));
+	while (!word) {
+		if (++wi >= nwords)
+			return pool->nblocks;
+		word = pool->bitmap[wi];
+	}
+	return wi * TOYFS_BITS_PER_WORD + (size_t)__builtin_ctzll(word);
+}
+
+static struct toyfs_pmemb *
+_pool_pop_pmembs_without_lock(struct toyfs_pool *pool, size_t goal,
+			      size_t want, size_t *out_cnt)
+{
+	size_t blk, cnt;
+
+	if (!pool->nfree || !want)
+		return NULL;
+
+	if (goal >= pool->nblocks)
+		goal = pool->cursor;
+
+	blk = _pool_find_free(pool, goal);
+	if (blk >= pool->nblocks)
+		blk = _pool_find_free(pool, 0);
+	toyfs_assert(blk < pool->nblocks);
+
+	cnt = 1;
+	while ((cnt < want) && (blk + cnt < pool->nblocks) &&
+	       _pool_isfree(pool, blk + cnt))
+		++cnt;
+
+	_pool_mark(pool, blk, cnt, false);
+	pool->nfree -= cnt;
+	pool->cursor = blk + cnt;
+	*out_cnt = cnt;
+	return &pool->blocks[blk];
+}
+
+static struct toyfs_pmemb *_pool_pop_pmemb_without_lock(struct toyfs_pool *pool)
+{
+	size_t cnt;
+
+	return _pool_pop_pmembs_without_lock(pool, pool->nblocks, 1, &cnt);
+}
+
+static struct toyfs_pmemb *
+_pool_pop_pmembs(struct toyfs_pool *pool, size_t goal, size_t want,
+		 size_t *out_cnt)
 {
 	struct toyfs_pmemb *pmemb;
 
 	_pool_lock(pool);
-	pmemb = _pool_pop_pmemb_without_lock(pool);
+	pmemb = _pool_pop_pmembs_without_lock(pool, goal, want, out_cnt);
 	_pool_unlock(pool);
 	return pmemb;
 }
 
-static void _pool_push_pmemb(struct toyfs_pool *pool, struct toyfs_pmemb *pmemb)
+static void _pool_push_pmembs(struct toyfs_pool *pool,
+			      struct toyfs_pmemb *pmemb, size_t cnt)
 {
-	union toyfs_pool_pmemb *pp;
+	const size_t blk = (size_t)(pmemb - pool->blocks);
+
+	toyfs_assert(blk + cnt <= pool->nblocks);
 
 	_pool_lock(pool);
-	pp = container_of(pmemb, union toyfs_pool_pmemb, pmemb);
-	pp->next = pool->pages;
-	pool->pages = pp;
+	_pool_mark(pool, blk, cnt, true);
+	pool->nfree += cnt;
 	_pool_unlock(pool);
 }
 
+static size_t _pool_block_of(const struct toyfs_pool *pool, void *addr)
+{
+	const struct toyfs_pmemb *pmemb = addr;
+
+	if ((pmemb < pool->blocks) || (pmemb >= pool->blocks + pool->nblocks))
+		return pool->nblocks;
+	return (size_t)(pmemb - pool->blocks);
+}
+
 static struct toyfs_list_head *_inode_to_list_head(struct toyfs_inode *ti)
 {
 	return &ti->list_head;
@@ -448,50 +541,117 @@ static void _pool_push_iblkref(struct toyfs_pool *pool,
 	_pool_unlock(pool);
 }
 
+/*
+ * The inode table is split into shards by ino, each with its own lock and
+ * its own chained hash table which doubles once the average chain length
+ * exceeds TOYFS_ITABLE_LOAD. Lookups of different inodes hardly ever
+ * contend, and chains stay short as the number of inodes grows.
+ */
+#define TOYFS_ITABLE_NBUCKETS_MIN	(256)
+#define TOYFS_ITABLE_LOAD		(2)
+
+static size_t _itable_hash(ino_t ino)
+{
+	uint64_t h = (uint64_t)ino;
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (size_t)h;
+}
+
+static struct toyfs_itable_shard *
+_itable_shard_of(struct toyfs_itable *itable, ino_t ino)
+{
+	return &itable->shard[ino % TOYFS_ITABLE_NSHARDS];
+}
+
+static size_t _shard_slot_of(const struct toyfs_itable_shard *shard,
+			     ino_t ino)
+{
+	return _itable_hash(ino / TOYFS_ITABLE_NSHARDS) &
+	       (shard->nbuckets - 1);
+}
+
 static void _itable_init(struct toyfs_itable *itable)
 {
-	itable->icount = 0;
-	memset(itable->imap, 0x00, sizeof(itable->imap));
-	toyfs_mutex_init(&itable->mutex);
+	size_t i;
+	struct toyfs_itable_shard *shard;
+
+	for (i = 0; i < ARRAY_SIZE(itable->shard); ++i) {
+		shard = &itable->shard[i];
+		shard->icount = 0;
+		shard->nbuckets = 0;
+		shard->imap = NULL;
+		toyfs_mutex_init(&shard->mutex);
+	}
 }
 
 static void _itable_destroy(struct toyfs_itable *itable)
 {
-	itable->icount = 0;
-	memset(itable->imap, 0xff, sizeof(itable->imap));
-	toyfs_mutex_destroy(&itable->mutex);
+	size_t i;
+	struct toyfs_itable_shard *shard;
+
+	for (i = 0; i < ARRAY_SIZE(itable->shard); ++i) {
+		shard = &itable->shard[i];
+		zus_free(shard->imap);
+		shard->imap = NULL;
+		shard->nbuckets = 0;
+		shard->icount = 0;
+		toyfs_mutex_destroy(&shard->mutex);
+	}
 }
 
-static void _itable_lock(struct toyfs_itable *itable)
+static void _shard_lock(struct toyfs_itable_shard *shard)
 {
-	toyfs_mutex_lock(&itable->mutex);
+	toyfs_mutex_lock(&shard->mutex);
 }
 
-static void _itable_unlock(struct toyfs_itable *itable)
+static void _shard_unlock(struct toyfs_itable_shard *shard)
 {
-	toyfs_mutex_unlock(&itable->mutex);
+	toyfs_mutex_unlock(&shard->mutex);
 }
 
-static size_t _itable_slot_of(const struct toyfs_itable *itable, ino_t ino)
+/* Re-hashes shard into nbuckets; keeps the old table if out of memory */
+static void _shard_resize(struct toyfs_itable_shard *shard, size_t nbuckets)
 {
-	return ino % ARRAY_SIZE(itable->imap);
+	size_t i, slot;
+	struct toyfs_inode_ref **imap, *tir;
+	struct toyfs_inode_ref **old_imap = shard->imap;
+	const size_t old_nbuckets = shard->nbuckets;
+
+	imap = (struct toyfs_inode_ref **)zus_calloc(nbuckets, sizeof(*imap));
+	if (!imap)
+		return;
+
+	shard->imap = imap;
+	shard->nbuckets = nbuckets;
+	for (i = 0; i < old_nbuckets; ++i) {
+		while ((tir = old_imap[i]) != NULL) {
+			old_imap[i] = tir->next;
+			slot = _shard_slot_of(shard, tir->ino);
+			tir->next = imap[slot];
+			imap[slot] = tir;
+		}
+	}
+	zus_free(old_imap);
 }
 
 static struct toyfs_inode_ref *
 _itable_find(struct toyfs_itable *itable, ino_t ino)
 {
-	size_t slot;
-	struct toyfs_inode_ref *tir;
+	struct toyfs_inode_ref *tir = NULL;
+	struct toyfs_itable_shard *shard = _itable_shard_of(itable, ino);
 
-	_itable_lock(itable);
-	slot = _itable_slot_of(itable, ino);
-	tir = itable->imap[slot];
+	_shard_lock(shard);
+	if (shard->nbuckets)
+		tir = shard->imap[_shard_slot_of(shard, ino)];
 	while (tir != NULL) {
 		if (tir->ino == ino)
 			break;
 		tir = tir->next;
 	}
-	_itable_unlock(itable);
+	_shard_unlock(shard);
 	return tir;
 }
 
@@ -501,21 +661,28 @@ static void _itable_insert(struct toyfs_itable *itable,
 	size_t slot;
 	struct toyfs_inode_ref **ient;
 	struct toyfs_inode_ref *tir;
+	struct toyfs_itable_shard *shard = _itable_shard_of(itable, tii->ino);
 
 	tir = (struct toyfs_inode_ref *)zus_calloc(1, sizeof(*tir));
 	toyfs_assert(tir != NULL);
 
-	_itable_lock(itable);
+	_shard_lock(shard);
+	if (!shard->nbuckets)
+		_shard_resize(shard, TOYFS_ITABLE_NBUCKETS_MIN);
+	else if (shard->icount >= TOYFS_ITABLE_LOAD * shard->nbuckets)
+		_shard_resize(shard, 2 * shard->nbuckets);
+	toyfs_assert(shard->nbuckets > 0);
+
 	tir->tii = tii;
 	tir->ti = tii->ti;
 	tir->ino = tii->ino;
 
-	slot = _itable_slot_of(itable, tii->ino);
-	ient = &itable->imap[slot];
+	slot = _shard_slot_of(shard, tii->ino);
+	ient = &shard->imap[slot];
 	tir->next = *ient;
 	*ient = tir;
-	itable->icount++;
-	_itable_unlock(itable);
+	shard->icount++;
+	_shard_unlock(shard);
 }
 
 static void _itable_remove(struct toyfs_itable *itable,
@@ -523,11 +690,12 @@ static void _itable_remove(struct toyfs_itable *itable,
 {
 	size_t slot;
 	struct toyfs_inode_ref **pp, *tir = NULL;
+	struct toyfs_itable_shard *shard = _itable_shard_of(itable, tii->ino);
 
-	_itable_lock(itable);
-	toyfs_assert(itable->icount > 0);
-	slot = _itable_slot_of(itable, tii->ino);
-	pp = &itable->imap[slot];
+	_shard_lock(shard);
+	toyfs_assert(shard->icount > 0);
+	slot = _shard_slot_of(shard, tii->ino);
+	pp = &shard->imap[slot];
 	toyfs_assert(*pp != NULL);
 	while ((tir = *pp) != NULL) {
 		if (tir->tii == tii)
@@ -536,12 +704,12 @@ static void _itable_remove(struct toyfs_itable *itable,
 	}
 	toyfs_assert(tir != NULL);
 	if (!tir) { /* Make clang-scan happy */
-		_itable_unlock(itable);
+		_shard_unlock(shard);
 		return;
 	}
 	*pp = tir->next;
-	itable->icount--;
-	_itable_unlock(itable);
+	shard->icount--;
+	_shard_unlock(shard);
 
 	memset(tir, 0, sizeof(*tir));
 	zus_free(tir);
@@ -576,6 +744,177 @@ toyfs_find_inode_ref_by_ino(struct toyfs_sb_info *sbi, ino_t ino)
 	return _itable_find(&sbi->s_itable, ino);
 }
 
+/*
+ * Single blocks are served from per-CPU magazines, which are refilled from
+ * and flushed back to the global pool in batches, so the common path takes
+ * neither the sbi nor the pool mutex. Each magazine also keeps the delta of
+ * f_bfree/f_bavail due to its CPU, which is folded into s_statvfs on statfs.
+ * A magazine may be shared by the ZTs of several channels on the same CPU,
+ * hence its (uncontended) lock. It is a mutex, not a spin-lock, as refill
+ * and flush take the pool mutex under it, and a spinning ZT could starve
+ * a preempted holder on its CPU.
+ */
+static int _pcpu_init(struct toyfs_sb_info *sbi)
+{
+	unsigned int cpu;
+	struct toyfs_pcpu_cache *pcpu;
+	const size_t size = zus_nr_cpu_ids * sizeof(*pcpu);
+	void *mem;
+
+	/* zus_malloc aligns to 16, magazines are a cache-line apart */
+	mem = zus_malloc(size + __alignof__(*pcpu) - 1);
+	if (unlikely(!mem)) {
+		ERROR("zus_malloc failed: size=0x%lx\n", size);
+		return -ENOMEM;
+	}
+	pcpu = (void *)ALIGN((ulong)mem, __alignof__(*pcpu));
+	memset(pcpu, 0, size);
+
+	for (cpu = 0; cpu < zus_nr_cpu_ids; ++cpu)
+		toyfs_mutex_init(&pcpu[cpu].mutex);
+
+	sbi->s_pcpu_mem = mem;
+	sbi->s_pcpu = pcpu;
+	sbi->s_npcpu = zus_nr_cpu_ids;
+	return 0;
+}
+
+static void _pcpu_fini(struct toyfs_sb_info *sbi)
+{
+	unsigned int cpu;
+
+	for (cpu = 0; cpu < sbi->s_npcpu; ++cpu)
+		toyfs_mutex_destroy(&sbi->s_pcpu[cpu].mutex);
+	zus_free(sbi->s_pcpu_mem);
+	sbi->s_pcpu_mem = NULL;
+	sbi->s_pcpu = NULL;
+	sbi->s_npcpu = 0;
+}
+
+static void _pcpu_lock(struct toyfs_pcpu_cache *pc)
+{
+	toyfs_mutex_lock(&pc->mutex);
+}
+
+static void _pcpu_unlock(struct toyfs_pcpu_cache *pc)
+{
+	toyfs_mutex_unlock(&pc->mutex);
+}
+
+static struct toyfs_pcpu_cache *_pcpu_this(struct toyfs_sb_info *sbi)
+{
+	int cpu = zus_current_cpu_silent();
+
+	if (unlikely((cpu < 0) || ((unsigned int)cpu >= sbi->s_npcpu)))
+		cpu = 0;
+	return &sbi->s_pcpu[cpu];
+}
+
+/* Fills an empty magazine with up to a batch of blocks, lowest on top */
+static void _pcpu_refill(struct toyfs_pool *pool, struct toyfs_pcpu_cache *pc)
+{
+	int i, j;
+	size_t blk, cnt, want, tmp;
+	struct toyfs_pmemb *pmemb;
+
+	_pool_lock(pool);
+	while (pc->nblks < TOYFS_PCPU_BATCH) {
+		want = (size_t)(TOYFS_PCPU_BATCH - pc->nblks);
+		pmemb = _pool_pop_pmembs_without_lock(pool, pool->nblocks,
+						      want, &cnt);
+		if (!pmemb)
+			break;
+		blk = (size_t)(pmemb - pool->blocks);
+		while (cnt--)
+			pc->blks[pc->nblks++] = blk++;
+	}
+	_pool_unlock(pool);
+
+	for (i = 0, j = pc->nblks - 1; i < j; ++i, --j) {
+		tmp = pc->blks[i];
+		pc->blks[i] = pc->blks[j];
+		pc->blks[j] = tmp;
+	}
+}
+
+/* Returns the bottom (coldest) half of a full magazine to the pool */
+static void _pcpu_flush(struct toyfs_pool *pool, struct toyfs_pcpu_cache *pc)
+{
+	int i;
+	const int nflush = TOYFS_PCPU_NBLKS / 2;
+
+	_pool_lock(pool);
+	for (i = 0; i < nflush; ++i)
+		_pool_mark(pool, pc->blks[i], 1, true);
+	pool->nfree += (size_t)nflush;
+	_pool_unlock(pool);
+
+	pc->nblks -= nflush;
+	memmove(pc->blks, pc->blks + nflush,
+		(size_t)pc->nblks * sizeof(pc->blks[0]));
+}
+
+/* Pops a block off pc; own magazine is refilled and charged for it */
+static size_t _pcpu_pop_blk(struct toyfs_pool *pool,
+			    struct toyfs_pcpu_cache *pc, bool own)
+{
+	size_t blk = pool->nblocks;
+
+	_pcpu_lock(pc);
+	if (!pc->nblks && own)
+		_pcpu_refill(pool, pc);
+	if (pc->nblks) {
+		blk = pc->blks[--pc->nblks];
+		if (own)
+			pc->bfree_delta--;
+	}
+	_pcpu_unlock(pc);
+	return blk;
+}
+
+/* Pool is exhausted; take a block from some other CPU's magazine */
+static size_t _pcpu_steal_blk(struct toyfs_sb_info *sbi,
+			      struct toyfs_pcpu_cache *self)
+{
+	size_t blk;
+	unsigned int cpu;
+	struct toyfs_pool *pool = &sbi->s_pool;
+
+	for (cpu = 0; cpu < sbi->s_npcpu; ++cpu) {
+		if (&sbi->s_pcpu[cpu] == self)
+			continue;
+		blk = _pcpu_pop_blk(pool, &sbi->s_pcpu[cpu], false);
+		if (blk < pool->nblocks)
+			return blk;
+	}
+	return pool->nblocks;
+}
+
+static void _pcpu_account(struct toyfs_pcpu_cache *pc, long delta)
+{
+	_pcpu_lock(pc);
+	pc->bfree_delta += delta;
+	_pcpu_unlock(pc);
+}
+
+static void _pcpu_fold_statvfs(struct toyfs_sb_info *sbi)
+{
+	long delta;
+	unsigned int cpu;
+	struct toyfs_pcpu_cache *pc;
+
+	for (cpu = 0; cpu < sbi->s_npcpu; ++cpu) {
+		pc = &sbi->s_pcpu[cpu];
+		_pcpu_lock(pc);
+		delta = pc->bfree_delta;
+		pc->bfree_delta = 0;
+		_pcpu_unlock(pc);
+
+		sbi->s_statvfs.f_bfree += delta;
+		sbi->s_statvfs.f_bavail += delta;
+	}
+}
+
 struct zus_sb_info *toyfs_sbi_alloc(struct zus_fs_info *zfi)
 {
 	struct toyfs_sb_info *sbi;
@@ -587,6 +926,10 @@ struct zus_sb_info *toyfs_sbi_alloc(struct zus_fs_info *zfi)
 		return NULL;
 
 	memset(sbi, 0, sizeof(*sbi));
+	if (_pcpu_init(sbi)) {
+		zus_free(sbi);
+		return NULL;
+	}
 	toyfs_mutex_init(&sbi->s_mutex);
 	toyfs_mutex_init(&sbi->s_inodes_lock);
 	_pool_init(&sbi->s_pool);
@@ -600,44 +943,106 @@ void toyfs_sbi_free(struct zus_sb_info *zsbi)
 	struct toyfs_sb_info *sbi = Z2SBI(zsbi);
 
 	INFO("sbi_free: sbi=%p\n", (void *)sbi);
+	_pcpu_fini(sbi);
 	zus_free(sbi);
 }
 
-struct toyfs_pmemb *toyfs_acquire_pmemb(struct toyfs_sb_info *sbi)
+static struct toyfs_pmemb *_acquire_pmemb(struct toyfs_sb_info *sbi,
+					  struct toyfs_pcpu_cache *pc)
+{
+	size_t blk;
+	struct toyfs_pool *pool = &sbi->s_pool;
+
+	blk = _pcpu_pop_blk(pool, pc, true);
+	if (blk < pool->nblocks)
+		return &pool->blocks[blk];
+
+	blk = _pcpu_steal_blk(sbi, pc);
+	if (blk < pool->nblocks) {
+		_pcpu_account(pc, -1);
+		return &pool->blocks[blk];
+	}
+	return NULL;
+}
+
+/*
+ * A single block comes from the local magazine, which is refilled from
+ * contiguous runs so that successive single-block allocations on the same
+ * CPU remain mostly sequential. Multi-block runs honour goal_bn and go to
+ * the pool directly.
+ */
+struct toyfs_pmemb *toyfs_acquire_pmembs(struct toyfs_sb_info *sbi,
+					 size_t goal_bn, size_t want,
+					 size_t *out_cnt)
 {
+	size_t goal, cnt = 0;
 	struct toyfs_pmemb *pmemb = NULL;
+	struct toyfs_pool *pool = &sbi->s_pool;
+	struct toyfs_pcpu_cache *pc = _pcpu_this(sbi);
 
 	/* TODO: Distinguish between user types */
-	toyfs_sbi_lock(sbi);
-	if (!sbi->s_statvfs.f_bfree)
+	if (!want)
 		goto out;
-	if (!sbi->s_statvfs.f_bavail)
-		goto out;
-	pmemb = _pool_pop_pmemb(&sbi->s_pool);
+
+	if (want > 1) {
+		goal = goal_bn ?
+		       _pool_block_of(pool, toyfs_bn2addr(sbi, goal_bn)) :
+		       pool->nblocks;
+		pmemb = _pool_pop_pmembs(pool, goal, want, &cnt);
+		if (pmemb)
+			_pcpu_account(pc, -(long)cnt);
+	}
+	if (!pmemb) {
+		pmemb = _acquire_pmemb(sbi, pc);
+		cnt = pmemb ? 1 : 0;
+	}
 	if (!pmemb)
 		goto out;
 
-	memset(pmemb, 0x00, sizeof(*pmemb));
-	sbi->s_statvfs.f_bfree--;
-	sbi->s_statvfs.f_bavail--;
-	DBG_("alloc_page: blocks=%lu bfree=%lu pmem_bn=%lu\n",
-	     sbi->s_statvfs.f_blocks, sbi->s_statvfs.f_bfree,
-	     toyfs_addr2bn(sbi, pmemb));
+	memset(pmemb, 0x00, cnt * sizeof(*pmemb));
+	DBG_("alloc_pages: pmem_bn=%lu cnt=%lu\n",
+	     toyfs_addr2bn(sbi, pmemb), cnt);
 out:
-	toyfs_sbi_unlock(sbi);
+	*out_cnt = cnt;
 	return pmemb;
 }
 
+struct toyfs_pmemb *toyfs_acquire_pmemb(struct toyfs_sb_info *sbi)
+{
+	size_t cnt;
+
+	return toyfs_acquire_pmembs(sbi, 0, 1, &cnt);
+}
+
+void toyfs_release_pmembs(struct toyfs_sb_info *sbi,
+			  struct toyfs_pmemb *pmemb, size_t cnt)
+{
+	struct toyfs_pool *pool = &sbi->s_pool;
+	struct toyfs_pcpu_cache *pc = _pcpu_this(sbi);
+	const size_t blk = (size_t)(pmemb - pool->blocks);
+
+	DBG_("free_pages: pmem_bn=%lu cnt=%lu\n",
+	     toyfs_addr2bn(sbi, pmemb), cnt);
+
+	if (cnt > 1) {
+		_pool_push_pmembs(pool, pmemb, cnt);
+		_pcpu_account(pc, (long)cnt);
+		return;
+	}
+
+	toyfs_assert(blk < pool->nblocks);
+
+	_pcpu_lock(pc);
+	if (pc->nblks == TOYFS_PCPU_NBLKS)
+		_pcpu_flush(pool, pc);
+	pc->blks[pc->nblks++] = blk;
+	pc->bfree_delta += (long)cnt;
+	_pcpu_unlock(pc);
+}
+
 void toyfs_release_pmemb(struct toyfs_sb_info *sbi, struct toyfs_pmemb *pmemb)
 {
-	toyfs_sbi_lock(sbi);
-	_pool_push_pmemb(&sbi->s_pool, pmemb);
-	sbi->s_statvfs.f_bfree++;
-	sbi->s_statvfs.f_bavail++;
-	DBG_("free_page: blocks=%lu bfree=%lu pmem_bn=%lu\n",
-	     sbi->s_statvfs.f_blocks, sbi->s_statvfs.f_bfree,
-	     toyfs_addr2bn(sbi, pmemb));
-	toyfs_sbi_unlock(sbi);
+	toyfs_release_pmembs(sbi, pmemb, 1);
 }
 
 struct toyfs_dblkref *toyfs_acquire_dblkref(struct toyfs_sb_info *sbi)
@@ -681,14 +1086,12 @@ void toyfs_release_iblkref(struct toyfs_sb_info *sbi,
 
 static void _sbi_setup(struct toyfs_sb_info *sbi)
 {
-	/* TODO: FIXME */
-	const size_t fssize = sbi->s_pool.msz;
-	const size_t fssize_blocks = fssize / PAGE_SIZE;
+	const size_t fssize_blocks = sbi->s_pool.nblocks;
 
 	sbi->s_top_ino = TOYFS_ROOT_INO + 1;
 	sbi->s_statvfs.f_bsize = PAGE_SIZE;
 	sbi->s_statvfs.f_frsize = PAGE_SIZE;
-	sbi->s_statvfs.f_blocks = fssize / PAGE_SIZE;
+	sbi->s_statvfs.f_blocks = fssize_blocks;
 	sbi->s_statvfs.f_bfree = fssize_blocks;
 	sbi->s_statvfs.f_bavail = fssize_blocks;
 	sbi->s_statvfs.f_files = fssize_blocks;
@@ -728,7 +1131,7 @@ static int _new_root_inode(struct toyfs_sb_info *sbi,
 	root_ti->i_rdev = 0;
 	root_ti->i_size = 0;
 	root_ti->i_blocks = 0;
-	toyfs_list_init(toyfs_childs_list_of(root_tii));
+	toyfs_init_dir(root_tii);
 
 	_itable_insert(&sbi->s_itable, root_tii);
 	*out_ii = root_tii;
@@ -878,6 +1281,7 @@ int toyfs_statfs(struct zus_sb_info *zsbi, struct zufs_ioc_statfs *ioc_statfs)
 	DBG("statfs sbi=%p\n", (void *)sbi);
 
 	toyfs_sbi_lock(sbi);
+	_pcpu_fold_statvfs(sbi);
 	out->f_bsize = (long)stvfs->f_bsize;
 	out->f_blocks = stvfs->f_blocks;
 	out->f_bfree = stvfs->f_bfree;
@@ -967,7 +1371,6 @@ static void _check_typesizes(void)
 	BUILD_BUG_ON_SIZEOFTYPE(struct toyfs_pmemb, PAGE_SIZE);
 	BUILD_BUG_ON_SIZEOFTYPE(struct toyfs_dirent, 32);
 
-	BUILD_BUG_ON_SIZEOFPAGE(union toyfs_pool_pmemb);
 	BUILD_BUG_ON_SIZEOFPAGE(union toyfs_inodes_pmemb);
 	BUILD_BUG_ON_SIZEOFPAGE(union toyfs_iblkrefs_pmemb);
 	BUILD_BUG_ON_SIZEOFPAGE(union toyfs_dirents_pmemb);
@@ -87,7 +87,11 @@ struct toyfs_pmemb {
 
 struct toyfs_pool {
 	pthread_mutex_t mutex;
-	union toyfs_pool_pmemb *pages;
+	struct toyfs_pmemb *blocks;
+	uint64_t *bitmap;
+	size_t  nblocks;
+	size_t  nfree;
+	size_t  cursor;
 	struct toyfs_list_head free_dblkrefs;
 	struct toyfs_list_head free_iblkrefs;
 	struct toyfs_list_head free_inodes;
@@ -95,6 +99,17 @@ struct toyfs_pool {
 	size_t  msz;
 };
 
+#define TOYFS_PCPU_NBLKS	(64)
+#define TOYFS_PCPU_BATCH	(TOYFS_PCPU_NBLKS / 2)
+
+/* Per-CPU magazine of pool blocks and not-yet-folded statvfs delta */
+struct toyfs_pcpu_cache {
+	pthread_mutex_t mutex;
+	int     nblks;
+	long    bfree_delta;
+	size_t  blks[TOYFS_PCPU_NBLKS];
+} __aligned(64);
+
 struct toyfs_inode_ref {
 	struct toyfs_inode_ref *next;
 	struct toyfs_inode_info *tii;
@@ -102,10 +117,18 @@ struct toyfs_inode_ref {
 	ino_t ino;
 };
 
-struct toyfs_itable {
+#define TOYFS_ITABLE_NSHARDS	(64)
+
+/* One independently locked and resized hash table per shard */
+struct toyfs_itable_shard {
 	pthread_mutex_t mutex;
 	size_t icount;
-	struct toyfs_inode_ref *imap[33377]; /* TODO: Variable size */
+	size_t nbuckets;
+	struct toyfs_inode_ref **imap;
+};
+
+struct toyfs_itable {
+	struct toyfs_itable_shard shard[TOYFS_ITABLE_NSHARDS];
 };
 
 union toyfs_super_block_head {
@@ -124,6 +147,9 @@ struct toyfs_sb_info {
 	pthread_mutex_t s_mutex;
 	pthread_mutex_t s_inodes_lock;
 	struct toyfs_pool s_pool;
+	struct toyfs_pcpu_cache *s_pcpu;
+	void *s_pcpu_mem;
+	unsigned int s_npcpu;
 	struct toyfs_itable s_itable;
 	struct toyfs_inode_info *s_root;
 	ino_t s_top_ino;
@@ -148,9 +174,17 @@ struct toyfs_inode {
 		uint32_t i_rdev;
 		uint8_t	 i_symlink[32];
 		uint64_t i_sym_dpp;
+		struct  _t_reg {
+			void *bmap_root;
+			uint32_t bmap_height;
+			uint32_t reserved;
+		} i_reg;
 		struct  _t_dir {
-			uint64_t reserved;
+			void *d_index;
 			uint64_t parent;
+			uint32_t d_nslots;
+			uint32_t d_count;
+			void *d_free;
 		} i_dir;
 	};
 };
@@ -164,6 +198,7 @@ struct toyfs_inode_info {
 	int ref;
 	bool mapped;
 	bool valid;
+	uint32_t dindex_retry;	/* d_count to retry a failed index grow at */
 };
 
 struct toyfs_dirent {
@@ -176,10 +211,18 @@ struct toyfs_dirent {
 
 struct toyfs_dentries {
 	struct toyfs_list_head head;
-	uint8_t reserved[16];
+	uint32_t d_pgno;
+	uint16_t d_nfree;
+	uint8_t reserved[10];
 	struct toyfs_dirent de[127];
 };
 
+/* Slot of a directory's name-hash index; hash == 0 marks an empty slot */
+struct toyfs_dindex_ent {
+	uint64_t hash;
+	struct toyfs_dirent *de;
+};
+
 struct toyfs_dblkref {
 	struct toyfs_list_head head;
 	size_t refcnt;
@@ -226,12 +269,17 @@ struct toyfs_inode_ref *
 toyfs_find_inode_ref_by_ino(struct toyfs_sb_info *sbi, ino_t ino);
 struct toyfs_dirent *toyfs_acquire_dirent(struct toyfs_sb_info *sbi);
 struct toyfs_pmemb *toyfs_acquire_pmemb(struct toyfs_sb_info *sbi);
+struct toyfs_pmemb *toyfs_acquire_pmembs(struct toyfs_sb_info *sbi,
+					 size_t goal_bn, size_t want,
+					 size_t *out_cnt);
 int toyfs_statfs(struct zus_sb_info *zsbi, struct zufs_ioc_statfs *ioc_statfs);
 int toyfs_sync(struct zus_inode_info *zii, struct zufs_ioc_sync *);
 struct toyfs_inode_info *toyfs_alloc_ii(struct toyfs_sb_info *sbi);
 struct zus_inode_info *toyfs_zii_alloc(struct zus_sb_info *zsbi);
 void toyfs_tii_free(struct toyfs_inode_info *zii);
 void toyfs_release_pmemb(struct toyfs_sb_info *sbi, struct toyfs_pmemb *);
+void toyfs_release_pmembs(struct toyfs_sb_info *sbi,
+			  struct toyfs_pmemb *pmemb, size_t cnt);
 struct toyfs_dblkref *toyfs_acquire_dblkref(struct toyfs_sb_info *sbi);
 void toyfs_release_dblkref(struct toyfs_sb_info *sbi,
 			   struct toyfs_dblkref *dblkref);
@@ -268,6 +316,7 @@ void toyfs_release_dir(struct toyfs_inode_info *dir_tii);
 struct toyfs_dirent *
 toyfs_lookup_dirent(struct toyfs_inode_info *dir_ii, const struct zufs_str *);
 struct toyfs_list_head *toyfs_childs_list_of(struct toyfs_inode_info *dir_tii);
+void toyfs_init_dir(struct toyfs_inode_info *dir_tii);
 
 /* file.c */
 int toyfs_read(void *buf, struct zufs_ioc_IO *ioc_io);
@@ -281,7 +330,21 @@ int toyfs_fiemap(void *app_ptr, struct zufs_ioc_fiemap *zif);
 struct toyfs_list_head *toyfs_iblkrefs_list_of(struct toyfs_inode_info *tii);
 struct toyfs_pmemb *toyfs_resolve_pmemb(struct toyfs_inode_info *tii,
 					loff_t off);
-uint64_t toyfs_require_pmem_bn(struct toyfs_inode_info *tii, loff_t off);
+uint64_t toyfs_require_pmem_bn(struct toyfs_inode_info *tii, loff_t off,
+			       size_t len);
+
+/* bmap.c */
+void toyfs_bmap_init(struct toyfs_inode_info *tii);
+struct toyfs_iblkref *toyfs_bmap_lookup(struct toyfs_inode_info *tii,
+					size_t index);
+struct toyfs_iblkref *toyfs_bmap_lookup_from(struct toyfs_inode_info *tii,
+					     size_t index);
+int toyfs_bmap_insert(struct toyfs_inode_info *tii, size_t index,
+		      struct toyfs_iblkref *iblkref);
+void toyfs_bmap_remove(struct toyfs_inode_info *tii, size_t index);
+int toyfs_bmap_reserve(struct toyfs_inode_info *tii, size_t index);
+void toyfs_bmap_move(struct toyfs_inode_info *tii, size_t from, size_t to);
+void toyfs_bmap_prune(struct toyfs_inode_info *tii, size_t index);
 
 /* symlink.c */
 void toyfs_release_symlink(struct toyfs_inode_info *tii);
@@ -46,6 +46,32 @@ struct zus_iomap_build {
 
 void _zus_iom_ioc_exec_submit(struct zus_iomap_build *iomb, bool sync);
 
+/* Async T2 I/O of zus memory (imp in md_zus.c)
+ * Reads and writes are packed into the calling thread's exec buffers, each
+ * buffer is one crossing. @iomd->done is called once all are done, with the
+ * first error. If @sync that is before zus_t2_batch_submit returns, which
+ * also returns that error, else it is from ZUFS_OP_IOM_DONE and @t2b and
+ * the memory of the I/O must stay until then.
+ * zus_t2_batch_submit must be called also if adding an I/O failed.
+ */
+struct zus_t2_exec;
+struct zus_t2_batch {
+	struct zus_sb_info	*sbi;
+	struct zus_iomap_done	*iomd;		/* Can be NULL if @sync */
+	struct zus_t2_exec	*exec;		/* Being filled */
+	bool			sync;
+	int			pending;
+	int			err;
+};
+
+void zus_t2_batch_start(struct zus_t2_batch *t2b, struct zus_sb_info *sbi,
+			struct zus_iomap_done *iomd, bool sync);
+int zus_t2_batch_read(struct zus_t2_batch *t2b, ulong t2_bn, void *ptr,
+		      ulong len);
+int zus_t2_batch_write(struct zus_t2_batch *t2b, ulong t2_bn, void *ptr,
+		       ulong len);
+int zus_t2_batch_submit(struct zus_t2_batch *t2b);
+
 static inline ulong _zus_iom_len(struct zus_iomap_build *iomb)
 {
 	return (__u64 *)iomb->cur_iom_e - iomb->ziom->iom_e;
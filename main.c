@@ -46,6 +46,21 @@ static void usage(int argc, char *argv[])
 	"		1 - use MCL_CURRENT flag for mlockall.\n"
 	"		2 - use (MCL_CURRENT | MCL_FUTURE) falgs for mlockall.\n"
 	"			other VAL is same as 0.\n"
+	"	--poll_us=[USEC]\n"
+	"		Let ZTs busy-poll for a next operation up to USEC\n"
+	"		micro-seconds before they sleep in the Kernel.\n"
+	"		Only if zuf supports the ZT ring. Default is 0 (off)\n"
+	"	--zt_stop_at_umount\n"
+	"		Stop all ZT threads when the last FS is unmounted.\n"
+	"		They are started again by the next mount\n"
+	"	--stats=[PATH]\n"
+	"		Keep per-operation latency statistics. kill -USR2 dumps\n"
+	"		them into PATH, default /dev/shm/zusd.stats. A SIGUSR2\n"
+	"		sent by sigqueue with value 1 also resets them\n"
+	"	--pa_huge=MODE\n"
+	"		Back the page allocator with huge pages. MODE is one of\n"
+	"		none, thp (shmem THP), 2M or 1G (hugetlb). Default is\n"
+	"		$ZUFS_PA_HUGE or none\n"
 	"\n"
 	"	FILE_PATH is the path to a mounted zuf-root directory\n"
 	"\n"
@@ -70,12 +85,19 @@ int main(int argc, char *argv[])
 		{.name = "mlock", .has_arg = 2, .flag = NULL, .val = 'l'},
 		{.name = "mcheck", .has_arg = 0, .flag = NULL, .val = 'm'},
 		{.name = "pa_size", .has_arg = 2, .flag = NULL, .val = 'p'},
+		{.name = "poll_us", .has_arg = 2, .flag = NULL, .val = 'u'},
+		{.name = "zt_stop_at_umount", .has_arg = 0, .flag = NULL, .val = 'z'},
+		{.name = "stats", .has_arg = 2, .flag = NULL, .val = 's'},
+		{.name = "pa_huge", .has_arg = 1, .flag = NULL, .val = 'H'},
 		{.name = 0, .has_arg = 0, .flag = 0, .val = 0},
 	};
-	const char *shortopt = "r::f::n::d::l::p::m";
+	const char *shortopt = "r::f::n::d::l::p::u::s::H:mz";
 	char op;
 	struct zus_thread_params tp;
 	const char *path = NULL;
+	const char *stats_path = NULL;
+	const char *pa_huge = NULL;
+	bool stats = false;
 	int err, flags = 0;
 	ssize_t pa_size = 0;
 
@@ -114,6 +136,20 @@ int main(int argc, char *argv[])
 			if (optarg)
 				pa_size = atol(optarg);
 			break;
+		case 'u':
+			if (optarg)
+				tp.poll_us = atoi(optarg);
+			break;
+		case 'z':
+			tp.stop_at_umount = true;
+			break;
+		case 's':
+			stats = true;
+			stats_path = optarg;
+			break;
+		case 'H':
+			pa_huge = optarg;
+			break;
 		default:
 			/* Just ignore we are not the police */
 			break;
@@ -162,10 +198,20 @@ int main(int argc, char *argv[])
 	if (unlikely(err))
 		return err;
 
+	err = zus_setup_pa_huge(pa_huge);
+	if (unlikely(err))
+		return err;
+
 	err = zus_slab_init();
 	if (unlikely(err))
 		return err;
 
+	if (stats) {
+		err = zus_stats_init(stats_path);
+		if (unlikely(err))
+			return err;
+	}
+
 	err = zus_mount_thread_start(&tp, path);
 	if (unlikely(err))
 		goto stop;
@@ -175,5 +221,6 @@ int main(int argc, char *argv[])
 
 stop:
 	zus_mount_thread_stop();
+	zus_stats_fini();
 	return err;
 }
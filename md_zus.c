@@ -11,6 +11,9 @@
  */
 
 #include <linux/types.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 
 #include "zus.h"
@@ -19,58 +22,6 @@
 #include "iom_enc.h"
 #include "zuf_call.h"
 
-/*
- * python pycrc.py --model crc-16 --algorithm table-driven --generate c
- */
-static const uint16_t crc_table[256] = {
-	0x0000, 0xc0c1, 0xc181, 0x0140, 0xc301, 0x03c0, 0x0280, 0xc241,
-	0xc601, 0x06c0, 0x0780, 0xc741, 0x0500, 0xc5c1, 0xc481, 0x0440,
-	0xcc01, 0x0cc0, 0x0d80, 0xcd41, 0x0f00, 0xcfc1, 0xce81, 0x0e40,
-	0x0a00, 0xcac1, 0xcb81, 0x0b40, 0xc901, 0x09c0, 0x0880, 0xc841,
-	0xd801, 0x18c0, 0x1980, 0xd941, 0x1b00, 0xdbc1, 0xda81, 0x1a40,
-	0x1e00, 0xdec1, 0xdf81, 0x1f40, 0xdd01, 0x1dc0, 0x1c80, 0xdc41,
-	0x1400, 0xd4c1, 0xd581, 0x1540, 0xd701, 0x17c0, 0x1680, 0xd641,
-	0xd201, 0x12c0, 0x1380, 0xd341, 0x1100, 0xd1c1, 0xd081, 0x1040,
-	0xf001, 0x30c0, 0x3180, 0xf141, 0x3300, 0xf3c1, 0xf281, 0x3240,
-	0x3600, 0xf6c1, 0xf781, 0x3740, 0xf501, 0x35c0, 0x3480, 0xf441,
-	0x3c00, 0xfcc1, 0xfd81, 0x3d40, 0xff01, 0x3fc0, 0x3e80, 0xfe41,
-	0xfa01, 0x3ac0, 0x3b80, 0xfb41, 0x3900, 0xf9c1, 0xf881, 0x3840,
-	0x2800, 0xe8c1, 0xe981, 0x2940, 0xeb01, 0x2bc0, 0x2a80, 0xea41,
-	0xee01, 0x2ec0, 0x2f80, 0xef41, 0x2d00, 0xedc1, 0xec81, 0x2c40,
-	0xe401, 0x24c0, 0x2580, 0xe541, 0x2700, 0xe7c1, 0xe681, 0x2640,
-	0x2200, 0xe2c1, 0xe381, 0x2340, 0xe101, 0x21c0, 0x2080, 0xe041,
-	0xa001, 0x60c0, 0x6180, 0xa141, 0x6300, 0xa3c1, 0xa281, 0x6240,
-	0x6600, 0xa6c1, 0xa781, 0x6740, 0xa501, 0x65c0, 0x6480, 0xa441,
-	0x6c00, 0xacc1, 0xad81, 0x6d40, 0xaf01, 0x6fc0, 0x6e80, 0xae41,
-	0xaa01, 0x6ac0, 0x6b80, 0xab41, 0x6900, 0xa9c1, 0xa881, 0x6840,
-	0x7800, 0xb8c1, 0xb981, 0x7940, 0xbb01, 0x7bc0, 0x7a80, 0xba41,
-	0xbe01, 0x7ec0, 0x7f80, 0xbf41, 0x7d00, 0xbdc1, 0xbc81, 0x7c40,
-	0xb401, 0x74c0, 0x7580, 0xb541, 0x7700, 0xb7c1, 0xb681, 0x7640,
-	0x7200, 0xb2c1, 0xb381, 0x7340, 0xb101, 0x71c0, 0x7080, 0xb041,
-	0x5000, 0x90c1, 0x9181, 0x5140, 0x9301, 0x53c0, 0x5280, 0x9241,
-	0x9601, 0x56c0, 0x5780, 0x9741, 0x5500, 0x95c1, 0x9481, 0x5440,
-	0x9c01, 0x5cc0, 0x5d80, 0x9d41, 0x5f00, 0x9fc1, 0x9e81, 0x5e40,
-	0x5a00, 0x9ac1, 0x9b81, 0x5b40, 0x9901, 0x59c0, 0x5880, 0x9841,
-	0x8801, 0x48c0, 0x4980, 0x8941, 0x4b00, 0x8bc1, 0x8a81, 0x4a40,
-	0x4e00, 0x8ec1, 0x8f81, 0x4f40, 0x8d01, 0x4dc0, 0x4c80, 0x8c41,
-	0x4400, 0x84c1, 0x8581, 0x4540, 0x8701, 0x47c0, 0x4680, 0x8641,
-	0x8201, 0x42c0, 0x4380, 0x8341, 0x4100, 0x81c1, 0x8081, 0x4040
-};
-
-
-static uint16_t crc16(uint16_t crc, const void *data, size_t data_len)
-{
-	const unsigned char *d = (const unsigned char *)data;
-	unsigned int tbl_idx;
-
-	while (data_len--) {
-		tbl_idx = (crc ^ *d) & 0xff;
-		crc = (crc_table[tbl_idx] ^ (crc >> 8)) & 0xffff;
-		d++;
-	}
-	return crc & 0xffff;
-}
-
 static ulong _gcd(ulong _x, ulong _y)
 {
 	ulong tmp;
@@ -100,7 +51,7 @@ short md_calc_csum(struct md_dev_table *mdt)
 	 *   So below should be &mdt->s_version => &mdt->s_magic
 	 *   PXS-240.
 	 */
-	return crc16(~0, (__u8 *)&mdt->s_version, n);
+	return zus_crc16(~0, (__u8 *)&mdt->s_version, n);
 	return 0;
 }
 
@@ -315,75 +266,316 @@ bool md_mdt_check(struct md_dev_table *mdt,
 	return true;
 }
 
-static void _done(struct zus_iomap_done *iomd, int err)
+int md_t2_mdt_read(struct multi_devices *md, int dev_index,
+		   struct md_dev_table *mdt)
+{
+	struct zus_t2_batch t2b;
+	int err;
+
+	zus_t2_batch_start(&t2b, md->sbi, NULL, true);
+	err = zus_t2_batch_read(&t2b, 0, mdt, PAGE_SIZE);
+
+	return zus_t2_batch_submit(&t2b) ?: err;
+}
+
+/* Each T2 device gets its own copy, all are written in one crossing */
+int md_t2_mdt_write(struct multi_devices *md, struct md_dev_table *mdt)
+{
+	struct zus_t2_batch t2b;
+	void *copies;
+	int i, err = 0;
+
+	if (!md->t2_count)
+		return 0;
+
+	copies = malloc(md->t2_count * PAGE_SIZE);
+	if (unlikely(!copies))
+		return -ENOMEM;
+
+	zus_t2_batch_start(&t2b, md->sbi, NULL, true);
+	for (i = 0; i < md->t2_count && !err; ++i) {
+		struct md_dev_table *copy = copies + i * PAGE_SIZE;
+		ulong bn = md_o2p(md_t2_dev(md, i)->offset);
+
+		memcpy(copy, mdt, PAGE_SIZE);
+		copy->s_dev_list.id_index = copy->s_dev_list.t1_count + i;
+		copy->s_sum = cpu_to_le16(md_calc_csum(copy));
+
+		err = zus_t2_batch_write(&t2b, bn, copy, PAGE_SIZE);
+	}
+	err = zus_t2_batch_submit(&t2b) ?: err;
+
+	free(copies);
+	return err;
+}
+
+/* ~~~ async T2 I/O (imp of zus_t2_batch in iom_enc.h) ~~~ */
+
+/* ~2700 zusmem I/Os per crossing */
+#define T2_EXEC_SIZE	(16 * PAGE_SIZE)
+/* Idle exec buffers kept by a thread, more are freed */
+#define T2_CACHE_MAX	4
+
+/* An exec buffer of a thread's cache. It is given back to that cache when
+ * done, from whichever thread that is.
+ * A thread's cache is handed to a next thread when it exits, with what is
+ * still in flight, so buffers are not lost when ZTs come and go.
+ */
+struct zus_t2_exec {
+	struct zus_t2_exec	*next;
+	struct t2_exec_cache	*cache;
+	struct zus_t2_batch	*t2b;
+	struct zus_iomap_done	iomd;
+	struct zus_iomap_build	iomb;
+	struct fba		fba;
+};
+
+struct t2_exec_cache {
+	struct zus_t2_exec *free;	/* Owner only */
+	uint nfree;
+	struct zus_t2_exec *done;	/* Pushed by completions */
+	struct t2_exec_cache *next;	/* On g_t2c.orphans */
+};
+
+static struct {
+	pthread_once_t once;
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	struct t2_exec_cache *orphans;	/* Of threads which exited */
+} g_t2c = {
+	.once = PTHREAD_ONCE_INIT,
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct t2_exec_cache *tl_t2c;
+
+static void _t2_cache_orphan(void *arg)
+{
+	struct t2_exec_cache *t2c = arg;
+
+	pthread_mutex_lock(&g_t2c.lock);
+	t2c->next = g_t2c.orphans;
+	g_t2c.orphans = t2c;
+	pthread_mutex_unlock(&g_t2c.lock);
+}
+
+static void _t2_key_init(void)
+{
+	int err = pthread_key_create(&g_t2c.key, _t2_cache_orphan);
+
+	if (unlikely(err))
+		ERROR("pthread_key_create => %d\n", err);
+}
+
+/* Adopts the cache of an exited thread if any */
+static struct t2_exec_cache *_t2_cache_get(void)
+{
+	struct t2_exec_cache *t2c;
+
+	pthread_once(&g_t2c.once, _t2_key_init);
+
+	pthread_mutex_lock(&g_t2c.lock);
+	t2c = g_t2c.orphans;
+	if (t2c)
+		g_t2c.orphans = t2c->next;
+	pthread_mutex_unlock(&g_t2c.lock);
+
+	if (!t2c) {
+		/* Never freed, completions may still give back to it */
+		t2c = calloc(1, sizeof(*t2c));
+		if (unlikely(!t2c))
+			return NULL;
+	}
+
+	pthread_setspecific(g_t2c.key, t2c);
+	tl_t2c = t2c;
+	return t2c;
+}
+
+static void _t2_exec_free(struct zus_t2_exec *exec)
+{
+	zus_free_exec_buff(&exec->fba);
+	free(exec);
+}
+
+/* Moves what completions gave back to @t2c->free, beyond T2_CACHE_MAX is
+ * freed.
+ */
+static void _t2_cache_reap(struct t2_exec_cache *t2c)
+{
+	struct zus_t2_exec *exec, *next;
+
+	exec = __atomic_exchange_n(&t2c->done, NULL, __ATOMIC_ACQUIRE);
+	for (; exec; exec = next) {
+		next = exec->next;
+		if (t2c->nfree < T2_CACHE_MAX) {
+			exec->next = t2c->free;
+			t2c->free = exec;
+			++t2c->nfree;
+		} else {
+			_t2_exec_free(exec);
+		}
+	}
+}
+
+static void _t2_exec_put(struct zus_t2_exec *exec)
 {
+	struct t2_exec_cache *t2c = exec->cache;
+	struct zus_t2_exec *head = __atomic_load_n(&t2c->done,
+						   __ATOMIC_RELAXED);
+
+	do {
+		exec->next = head;
+	} while (!__atomic_compare_exchange_n(&t2c->done, &head, exec, true,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
+
+static void _t2_batch_put(struct zus_t2_batch *t2b)
+{
+	int err;
+
+	if (__atomic_sub_fetch(&t2b->pending, 1, __ATOMIC_ACQ_REL))
+		return;
+
+	err = t2b->err;
 	if (unlikely(err))
 		ERROR("T2 I/O failed => %d\n", err);
+	if (t2b->iomd)
+		t2b->iomd->done(t2b->iomd, err);
 }
-static struct zus_iomap_done _iomd = {
-	.done = _done,
-};
 
-static struct fba g_io_fba;
+static void _t2_exec_done(struct zus_iomap_done *iomd, int err)
+{
+	struct zus_t2_exec *exec = container_of(iomd, struct zus_t2_exec,
+						iomd);
+	struct zus_t2_batch *t2b = exec->t2b;
+	int zero = 0;
+
+	if (unlikely(err))
+		__atomic_compare_exchange_n(&t2b->err, &zero, err, false,
+					    __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED);
+	_t2_exec_put(exec);
+	_t2_batch_put(t2b);
+}
 
-static int _init_g_fba(void)
+static struct zus_t2_exec *_t2_exec_get(struct zus_sb_info *sbi)
 {
-	if (g_io_fba.fd)
-		return 0;
+	struct t2_exec_cache *t2c = tl_t2c;
+	struct zus_t2_exec *exec;
 
-	return zus_alloc_exec_buff(NULL, PAGE_SIZE, 0, &g_io_fba);
+	if (unlikely(!t2c)) {
+		t2c = _t2_cache_get();
+		if (unlikely(!t2c))
+			return NULL;
+	}
+
+	if (!t2c->free)
+		_t2_cache_reap(t2c);
+	exec = t2c->free;
+	if (exec) {
+		t2c->free = exec->next;
+		--t2c->nfree;
+	} else {
+		exec = calloc(1, sizeof(*exec));
+		if (unlikely(!exec))
+			return NULL;
+		if (unlikely(zus_alloc_exec_buff(NULL, T2_EXEC_SIZE, 0,
+						 &exec->fba))) {
+			free(exec);
+			return NULL;
+		}
+		exec->cache = t2c;
+		exec->iomd.done = _t2_exec_done;
+	}
+
+	memset(&exec->iomb, 0, sizeof(exec->iomb));
+	_zus_iom_init_4_ioc_exec(&exec->iomb, sbi, exec->fba.fd,
+				 exec->fba.ptr, T2_EXEC_SIZE);
+	_zus_iom_start(&exec->iomb, &exec->iomd);
+	return exec;
 }
 
-static int _iomb_start(struct zus_iomap_build *iomb, struct multi_devices *md)
+/* Submits the buffer being filled, if any */
+static void _t2_batch_flush(struct zus_t2_batch *t2b)
 {
-	iomb->err = _init_g_fba();
-	if (iomb->err)
-		return iomb->err;
+	struct zus_t2_exec *exec = t2b->exec;
 
-	_zus_iom_init_4_ioc_exec(iomb, md->sbi, g_io_fba.fd, g_io_fba.ptr,
-				 PAGE_SIZE);
-	_zus_iom_start(iomb, &_iomd);
-	return 0;
+	if (!exec)
+		return;
+	t2b->exec = NULL;
+
+	if (_zus_iom_empty(&exec->iomb)) {
+		_t2_exec_put(exec);
+		return;
+	}
+
+	exec->t2b = t2b;
+	__atomic_add_fetch(&t2b->pending, 1, __ATOMIC_RELAXED);
+	_zus_iom_ioc_exec_submit(&exec->iomb, t2b->sync);
 }
 
-int md_t2_mdt_read(struct multi_devices *md, int dev_index,
-		   struct md_dev_table *mdt)
+static int _t2_batch_add(struct zus_t2_batch *t2b, ulong t2_bn, void *ptr,
+			 ulong len, enum ZUFS_IOM_TYPE type)
 {
-	struct zus_iomap_build iomb = {};
+	int err;
 
-	iomb.err = _iomb_start(&iomb, md);
-	if (unlikely(iomb.err))
-		return iomb.err;
+	for (;;) {
+		if (!t2b->exec) {
+			t2b->exec = _t2_exec_get(t2b->sbi);
+			if (unlikely(!t2b->exec))
+				return -ENOMEM;
+		}
 
-	_zus_iom_enc_t2_zusmem_read(&iomb, 0, mdt, PAGE_SIZE);
-	_zus_iom_ioc_exec_submit(&iomb, true);
+		err = _zus_iom_enc_t2_zusmem_io(&t2b->exec->iomb, t2_bn, ptr,
+						len, type);
+		if (err != -ENOSPC)
+			return err;
 
-	return iomb.err;
+		/* Full, this one goes to a next crossing */
+		_t2_batch_flush(t2b);
+	}
 }
 
-int md_t2_mdt_write(struct multi_devices *md, struct md_dev_table *mdt)
+void zus_t2_batch_start(struct zus_t2_batch *t2b, struct zus_sb_info *sbi,
+			struct zus_iomap_done *iomd, bool sync)
 {
-	struct zus_iomap_build iomb = {};
-	int i;
+	t2b->sbi = sbi;
+	t2b->iomd = iomd;
+	t2b->exec = NULL;
+	t2b->sync = sync;
+	t2b->pending = 1;	/* Dropped by zus_t2_batch_submit */
+	t2b->err = 0;
+}
 
-	/* FIXME: must make copies and execute at end. one by one for now */
-	for (i = 0; i < md->t2_count; ++i) {
-		ulong bn = md_o2p(md_t2_dev(md, i)->offset);
+int zus_t2_batch_read(struct zus_t2_batch *t2b, ulong t2_bn, void *ptr,
+		      ulong len)
+{
+	return _t2_batch_add(t2b, t2_bn, ptr, len, IOM_T2_ZUSMEM_READ);
+}
 
-		iomb.err = _iomb_start(&iomb, md);
-		if (unlikely(iomb.err))
-			return iomb.err;
+int zus_t2_batch_write(struct zus_t2_batch *t2b, ulong t2_bn, void *ptr,
+		       ulong len)
+{
+	return _t2_batch_add(t2b, t2_bn, ptr, len, IOM_T2_ZUSMEM_WRITE);
+}
 
-		mdt->s_dev_list.id_index = mdt->s_dev_list.t1_count + i;
-		mdt->s_sum = cpu_to_le16(md_calc_csum(mdt));
+int zus_t2_batch_submit(struct zus_t2_batch *t2b)
+{
+	int err;
 
-		_zus_iom_enc_t2_zusmem_write(&iomb, bn, mdt, PAGE_SIZE);
-		_zus_iom_ioc_exec_submit(&iomb, true);
-		if (iomb.err)
-			break;
+	_t2_batch_flush(t2b);
+	if (!t2b->sync) {
+		/* @t2b may be gone once this is put */
+		_t2_batch_put(t2b);
+		return 0;
 	}
 
-	return iomb.err;
+	/* All were done inline by now */
+	err = t2b->err;
+	_t2_batch_put(t2b);
+	return err;
 }
 
 /* ~~~  _zus_iom facility (imp of iom_enc.h) ~~~ */
@@ -410,6 +602,7 @@ void _zus_iom_ioc_exec_submit(struct zus_iomap_build *iomb, bool sync)
 	if (unlikely(err && !iomb->err))
 		iomb->err = -errno;
 
-	if (sync && iomb->iomd)
+	/* An async exec which never got to the Kernel is done here */
+	if ((sync || unlikely(err && !ziome->hdr.err)) && iomb->iomd)
 		iomb->iomd->done(iomb->iomd, iomb->err);
 }
@@ -14,15 +14,20 @@
 #include <pthread.h>
 #include <errno.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <time.h>
+#include <semaphore.h>
 #include <sys/mman.h>
+#include <sys/sysinfo.h>
 #include <linux/falloc.h>
 
 #include "zus.h"
 #include "zuf_call.h"
 
-/* PA_SIZE - allowed data held in pages; 4G by default, setup upon zusd init */
-/* TODO: get this param from FS
- * TODO2: grow dynamically
+/* PA_SIZE - most data held in pages; 4G by default, setup upon zusd init.
+ * Only address space is reserved for it, the pool grows on demand.
+ * TODO: get this param from FS
  */
 #define PA_SIZE		(g_pa_size.pa_size)
 #define MEGA		(1UL << 20)
@@ -68,6 +73,41 @@ out:
 	return 0;
 }
 
+/* Backing of the pool's data: 4K tmpfs pages, shmem THP or hugetlb */
+enum _pa_huge {
+	PA_HUGE_NONE,
+	PA_HUGE_THP,
+	PA_HUGE_2M,
+	PA_HUGE_1G,
+};
+static enum _pa_huge g_pa_huge = PA_HUGE_NONE;
+
+int zus_setup_pa_huge(const char *huge)
+{
+	static const char *names[] = {
+		[PA_HUGE_NONE] = "none",
+		[PA_HUGE_THP] = "thp",
+		[PA_HUGE_2M] = "2M",
+		[PA_HUGE_1G] = "1G",
+	};
+	uint i;
+
+	if (!huge)
+		huge = getenv(ZUFS_PA_HUGE);
+	if (!huge)
+		return 0;
+
+	for (i = 0; i < ARRAY_SIZE(names); ++i) {
+		if (!strcasecmp(huge, names[i])) {
+			g_pa_huge = i;
+			return 0;
+		}
+	}
+
+	ERROR("pa_huge=%s is not one of none, thp, 2M or 1G\n", huge);
+	return -EINVAL;
+}
+
 /* ~~~~ fba ~~~~ */
 
 /*
@@ -76,20 +116,13 @@ out:
  */
 #define FBA_ALIGNSIZE	(ZUFS_ALLOC_MASK + 1)
 
-static int _fba_alloc(struct fba *fba, size_t size, int flags)
+/* Sizes and maps the file of @fba->fd at @addr if given, over a reservation.
+ * On error the file is closed.
+ */
+static int _fba_map(struct fba *fba, void *addr, size_t size, int flags)
 {
 	int err;
 
-	/* Our buffers are allocated from a tmpfile so all is aligned and easy
-	 */
-	fba->fd = open("/dev/shm/", O_RDWR | O_TMPFILE | O_EXCL, 0666);
-	if (fba->fd < 0) {
-		if (!(flags & MAP_HUGETLB))
-			ERROR("Error opening <%s>: %s\n","/tmp/",
-			      strerror(errno));
-		return errno ? -errno : -EPERM;
-	}
-
 	err = ftruncate(fba->fd, size);
 	if (unlikely(err)) {
 		err = -errno;
@@ -99,7 +132,9 @@ static int _fba_alloc(struct fba *fba, size_t size, int flags)
 		return err;
 	}
 
-	fba->ptr = mmap(NULL, size, PROT_WRITE | PROT_READ, flags,
+	if (addr)
+		flags |= MAP_FIXED;
+	fba->ptr = mmap(addr, size, PROT_WRITE | PROT_READ, flags,
 			fba->fd, 0);
 	if (fba->ptr == MAP_FAILED) {
 		if (!(flags & MAP_HUGETLB))
@@ -121,6 +156,26 @@ static int _fba_alloc(struct fba *fba, size_t size, int flags)
 	return 0;
 }
 
+static int _fba_alloc_at(struct fba *fba, void *addr, size_t size, int flags)
+{
+	/* Our buffers are allocated from a tmpfile so all is aligned and easy
+	 */
+	fba->fd = open("/dev/shm/", O_RDWR | O_TMPFILE | O_EXCL, 0666);
+	if (fba->fd < 0) {
+		if (!(flags & MAP_HUGETLB))
+			ERROR("Error opening <%s>: %s\n","/tmp/",
+			      strerror(errno));
+		return errno ? -errno : -EPERM;
+	}
+
+	return _fba_map(fba, addr, size, flags);
+}
+
+static int _fba_alloc(struct fba *fba, size_t size, int flags)
+{
+	return _fba_alloc_at(fba, NULL, size, flags);
+}
+
 int fba_alloc(struct fba *fba, size_t size)
 {
 	int err = _fba_alloc(fba, size, MAP_SHARED);
@@ -212,113 +267,929 @@ int fba_punch_hole(struct fba *fba, ulong index, uint nump)
 
 /* ~~~ pa - Page Allocator ~~~ */
 
-/* 2MB worth of pages (= 32k pages) */
-#define PA_PAGES_AT_A_TIME ((1UL << 21) / sizeof(struct pa_page))
+/* The pool's data and its struct pa_page array are each one reservation of
+ * address space for PA_SIZE, so address, page and bn convert by arithmetic.
+ * The pool grows by mapping segments into them: a data segment is a tmpfile
+ * of its own, mapped over the reservation, and the page structs behind it
+ * are made accessible. Segments double from PA_SEG_MIN up to PA_SEG_MAX.
+ * @dir has an entry per PA_SEG_MIN of data, of the segment holding it.
+ */
+#define PA_SEG_MIN	(2 * MEGA)
+#define PA_SEG_MAX	(1UL << 30)
+#define PA_SEG_SHIFT	(21 - PAGE_SHIFT)	/* pages in PA_SEG_MIN */
+
+/* Data pages added to a node's free lists at a time */
+#define PA_PAGES_AT_A_TIME	(PA_SEG_MIN / PAGE_SIZE)
+
+#ifndef MFD_HUGE_SHIFT
+#define MFD_HUGE_SHIFT		26	/* see linux/memfd.h */
+#endif
+#define PA_THP_SHMEM	"/sys/kernel/mm/transparent_hugepage/shmem_enabled"
+
+struct pa_seg {
+	struct fba fba;
+	ulong bn;	/* first page */
+	ulong npages;
+};
+
+static int _pa_reserve(struct fba *fba, size_t size, size_t align)
+{
+	ulong addr;
+	void *ptr;
+
+	ptr = mmap(NULL, size + align, PROT_NONE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (ptr == MAP_FAILED) {
+		ERROR("mmap reserve size=0x%lx => %d\n", size, errno);
+		return -errno;
+	}
+
+	/* Trim to @align so segments can be mapped with large pages */
+	addr = ALIGN((ulong)ptr, align);
+	if (addr != (ulong)ptr)
+		munmap(ptr, addr - (ulong)ptr);
+	munmap((void *)addr + size, align - (addr - (ulong)ptr));
+
+	fba->fd = -1;
+	fba->ptr = (void *)addr;
+	fba->size = size;
+	return 0;
+}
+
+static void _pa_unreserve(struct fba *fba)
+{
+	if (fba->ptr) {
+		munmap(fba->ptr, fba->size);
+		fba->ptr = NULL;
+	}
+}
+
+/* Also the smallest segment. A huge page is all of one node's */
+static ulong _pa_grow_pages(struct pa *pa)
+{
+	ulong hpages = pa->hpage_size / PAGE_SIZE;
+
+	return hpages > PA_PAGES_AT_A_TIME ? hpages : PA_PAGES_AT_A_TIME;
+}
+
+static int _pa_memfd_huge(struct pa *pa)
+{
+	uint flags = MFD_HUGETLB |
+		     (__builtin_ctzl(pa->hpage_size) << MFD_HUGE_SHIFT);
+	int fd = memfd_create("zus_pa", flags);
+
+	return fd < 0 ? -errno : fd;
+}
+
+static bool _pa_thp_shmem(void)
+{
+	char buf[128];
+	bool ret = false;
+	FILE *fp;
+
+	fp = fopen(PA_THP_SHMEM, "r");
+	if (!fp)
+		return false;
+	if (fgets(buf, sizeof(buf), fp))
+		ret = strstr(buf, "[always]") || strstr(buf, "[advise]") ||
+		      strstr(buf, "[within_size]");
+	fclose(fp);
+	return ret;
+}
+
+/* Falls back to 4K pages if the huge pages asked for are not there */
+static void _pa_huge_init(struct pa *pa)
+{
+	int fd;
+
+	pa->hugetlb = false;
+	pa->hpage_size = 0;
+
+	switch (g_pa_huge) {
+	case PA_HUGE_THP:
+		if (!_pa_thp_shmem())
+			INFO("pa: shmem THP is off, see %s\n", PA_THP_SHMEM);
+		pa->hpage_size = 2 * MEGA;
+		break;
+	case PA_HUGE_2M:
+	case PA_HUGE_1G:
+		pa->hpage_size = g_pa_huge == PA_HUGE_1G ? 1UL << 30 :
+							   2 * MEGA;
+		if (PA_SIZE < pa->hpage_size) {
+			INFO("pa: PA_SIZE=0x%lx below a huge page\n", PA_SIZE);
+			pa->hpage_size = 0;
+			break;
+		}
+		/* Try one, it is given back on close */
+		fd = _pa_memfd_huge(pa);
+		if (fd >= 0 && (ftruncate(fd, pa->hpage_size) ||
+				fallocate(fd, 0, 0, pa->hpage_size)))
+			fd = -errno;
+		if (fd < 0) {
+			INFO("pa: no hugetlb pages of 0x%lx => %d\n",
+			     pa->hpage_size, fd);
+			pa->hpage_size = 0;
+			break;
+		}
+		close(fd);
+		pa->hugetlb = true;
+		break;
+	case PA_HUGE_NONE:
+	default:
+		break;
+	}
+}
+
+static struct pa_seg *_pa_seg_of(struct pa *pa, ulong bn)
+{
+	return pa->dir[bn >> PA_SEG_SHIFT];
+}
+
+static int _pa_punch(struct pa *pa, ulong bn, uint nump)
+{
+	struct pa_seg *seg = _pa_seg_of(pa, bn);
+
+	/* Buddy blocks are aligned to their size so never cross segments */
+	return fba_punch_hole(&seg->fba, bn - seg->bn, nump);
+}
 
-static void _init_one_page(struct zus_sb_info *sbi, struct pa *pa,
-			   struct pa_page *page)
+static int _pa_seg_map(struct pa *pa, struct pa_seg *seg, size_t size)
+{
+	void *addr = pa->data.ptr + md_p2o(seg->bn);
+	int err;
+
+	if (pa->hugetlb) {
+		seg->fba.fd = _pa_memfd_huge(pa);
+		if (unlikely(seg->fba.fd < 0))
+			return seg->fba.fd;
+		/* Huge pages are taken by _pa_populate, not all at mmap */
+		return _fba_map(&seg->fba, addr, size,
+				MAP_SHARED | MAP_NORESERVE);
+	}
+
+	err = _fba_alloc_at(&seg->fba, addr, size, MAP_SHARED);
+	if (unlikely(err))
+		return err;
+
+	if (pa->hpage_size && madvise(addr, size, MADV_HUGEPAGE))
+		DBG("madvise(HUGEPAGE) addr=%p => %d\n", addr, errno);
+	return 0;
+}
+
+/* Called with @pa->grow_lock held */
+static int _pa_seg_add(struct pa *pa)
+{
+	ulong max_pages = pa->data.size / PAGE_SIZE;
+	struct pa_seg *seg;
+	size_t size, psize;
+	void *pages;
+	ulong i;
+	int err;
+
+	if (unlikely(pa->mapped >= max_pages)) {
+		DBG("PA_SIZE too small pa->size=0x%lx\n", pa->size);
+		return -ENOMEM;
+	}
+
+	size = pa->nsegs ? pa->segs[pa->nsegs - 1].npages * PAGE_SIZE * 2 :
+			   _pa_grow_pages(pa) * PAGE_SIZE;
+	if (size > PA_SEG_MAX)
+		size = PA_SEG_MAX;
+	if (size > (max_pages - pa->mapped) * PAGE_SIZE)
+		size = (max_pages - pa->mapped) * PAGE_SIZE;
+
+	seg = &pa->segs[pa->nsegs];
+	seg->bn = pa->mapped;
+	seg->npages = size / PAGE_SIZE;
+
+	err = _pa_seg_map(pa, seg, size);
+	if (unlikely(err))
+		return err;
+
+	pages = pa->pages.ptr + seg->bn * sizeof(struct pa_page);
+	psize = seg->npages * sizeof(struct pa_page);
+	if (unlikely(mprotect(pages, psize, PROT_READ | PROT_WRITE))) {
+		err = -errno;
+		ERROR("mprotect pages=%p size=0x%lx => %d\n", pages, psize,
+		      err);
+		goto fail;
+	}
+	if (NEED_MLOCK) {
+		err = mlock(pages, psize);
+		ZUS_WARN_ON(err);
+	}
+
+	for (i = seg->bn >> PA_SEG_SHIFT;
+	     i < (seg->bn + seg->npages) >> PA_SEG_SHIFT; ++i)
+		pa->dir[i] = seg;
+
+	++pa->nsegs;
+	pa->mapped += seg->npages;
+	DBG("pa segment %u bn=0x%lx npages=0x%lx\n", pa->nsegs, seg->bn,
+	    seg->npages);
+	return 0;
+
+fail:
+	/* Put back the reservation under it */
+	mmap(seg->fba.ptr, size, PROT_NONE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+	close(seg->fba.fd);
+	return err;
+}
+
+static void _pa_segs_fini(struct pa *pa)
+{
+	uint i;
+
+	for (i = 0; i < pa->nsegs; ++i)
+		close(pa->segs[i].fba.fd);
+	pa->nsegs = 0;
+	pa->mapped = 0;
+	free(pa->segs);
+	pa->segs = NULL;
+	free(pa->dir);
+	pa->dir = NULL;
+	_pa_unreserve(&pa->pages);
+	_pa_unreserve(&pa->data);
+}
+
+static int _pa_segs_init(struct pa *pa)
+{
+	ulong ndir = PA_SIZE / PA_SEG_MIN;
+	size_t grow = _pa_grow_pages(pa) * PAGE_SIZE;
+	size_t size = PA_SIZE & ~(grow - 1);
+	int err;
+
+	/* Doubling up to PA_SEG_MAX, then PA_SEG_MAX at a time */
+	pa->segs = calloc(__builtin_ctzl(PA_SEG_MAX / PA_SEG_MIN) + 1 +
+			  PA_SIZE / PA_SEG_MAX, sizeof(*pa->segs));
+	pa->dir = calloc(ndir, sizeof(*pa->dir));
+	if (unlikely(!pa->segs || !pa->dir))
+		return -ENOMEM;
+
+	/* Aligned to huge pages, segments are multiples of them */
+	err = _pa_reserve(&pa->data, size, grow);
+	if (unlikely(err))
+		return err;
+
+	return _pa_reserve(&pa->pages, (size / PAGE_SIZE) *
+			   sizeof(struct pa_page), PAGE_SIZE);
+}
+
+/* Pages are added in blocks of PA_PAGES_AT_A_TIME, each block belongs to one
+ * NUMA node: its pages are on that node's free lists and its data is mbind'ed
+ * to that node.
+ * Free pages of a node are kept as buddy blocks of 1 << order pages, aligned
+ * to their size, on per-order lists. An allocation splits the smallest block
+ * big enough, a free merges with its buddy as long as it is free too. Blocks
+ * are at most PA_MAX_ORDER so never cross a node's block.
+ * Freed pages are not punched right away. A block whose pages may still be
+ * resident is dirty; dirty blocks are kept first on their list, so are the
+ * ones reused, and the reclaimer punches them in the background.
+ */
+static uint _pa_nid(uint nid)
+{
+	if (nid == ZUS_NUMA_NO_NID) {
+		/* Before zus_numa_map_init all is node 0 */
+		if (!zus_numa_map)
+			return 0;
+		nid = zus_cpu_to_node(zus_current_cpu_silent());
+	}
+	return nid % ZUS_PA_MAX_NODES;
+}
+
+static bool _pa_is_buddy(struct pa_page *page, int order)
+{
+	ulong o1 = get_bit_range(page->flags, PA_ORDER_PGSHIFT, PA_ORDER_MASK);
+
+	return o1 == (ulong)order + 1;
+}
+
+static bool _pa_is_dirty(struct pa_page *page)
+{
+	return get_bit_range(page->flags, PA_DIRTY_PGSHIFT, PA_DIRTY_MASK);
+}
+
+static void _pa_add_free(struct pa_node *pn, struct pa_page *page, int order,
+			 bool dirty)
+{
+	set_bit_range(&page->flags, PA_ORDER_PGSHIFT, PA_ORDER_MASK, order + 1);
+	set_bit_range(&page->flags, PA_DIRTY_PGSHIFT, PA_DIRTY_MASK, dirty);
+	if (dirty) {
+		a_list_add(&page->list, &pn->free[order]);
+		pn->ndirty += 1UL << order;
+	} else {
+		a_list_add_tail(&page->list, &pn->free[order]);
+	}
+}
+
+/* Returns true if @page was dirty */
+static bool _pa_del_free(struct pa_node *pn, struct pa_page *page, int order)
+{
+	bool dirty = _pa_is_dirty(page);
+
+	a_list_del_init(&page->list);
+	set_bit_range(&page->flags, PA_ORDER_PGSHIFT, PA_ORDER_MASK, 0);
+	set_bit_range(&page->flags, PA_DIRTY_PGSHIFT, PA_DIRTY_MASK, 0);
+	if (dirty)
+		pn->ndirty -= 1UL << order;
+	return dirty;
+}
+
+/* Called with @pn's lock held */
+static void _pa_free_block(struct zus_sb_info *sbi, struct pa_node *pn,
+			   struct pa_page *page, int order, bool dirty)
+{
+	ulong bn = pa_page_to_bn(sbi, page);
+
+	for (; order < PA_MAX_ORDER; ++order) {
+		struct pa_page *buddy = pa_bn_to_page(sbi, bn ^ (1UL << order));
+
+		if (!_pa_is_buddy(buddy, order))
+			break;
+		dirty |= _pa_del_free(pn, buddy, order);
+		bn &= ~(1UL << order);
+	}
+	_pa_add_free(pn, pa_bn_to_page(sbi, bn), order, dirty);
+}
+
+/* Called with @pn's lock held */
+static struct pa_page *_pa_take_block(struct pa_node *pn, int order,
+				      bool *dirty)
+{
+	struct pa_page *page;
+	int o;
+
+	for (o = order; o <= PA_MAX_ORDER; ++o) {
+		if (!a_list_empty(&pn->free[o]))
+			break;
+	}
+	if (o > PA_MAX_ORDER)
+		return NULL;
+
+	page = a_list_first_entry(&pn->free[o], struct pa_page, list);
+	*dirty = _pa_del_free(pn, page, o);
+
+	/* Give back the upper halves */
+	while (o > order) {
+		--o;
+		_pa_add_free(pn, page + (1 << o), o, *dirty);
+	}
+	return page;
+}
+
+static void _init_one_page(struct zus_sb_info *sbi, struct pa_page *page,
+			   uint nid)
 {
 	a_list_init(&page->list);
-	a_list_add_tail(&page->list, &pa->head);
 	pa_set_page_zone(page, POOL_NUM);
+	pa_page_nid_set(page, nid);
 	page->owner = sbi;
 }
 
-static int _init_page_of_pages(struct zus_sb_info *sbi, struct pa *pa)
+static int _init_page_of_pages(struct zus_sb_info *sbi, struct pa *pa,
+			       uint nid)
 {
+	struct pa_node *pn = &pa->node[nid];
+	ulong i, bn, npages = _pa_grow_pages(pa);
 	struct pa_page *page;
-	uint i;
+	int err;
 
-	/* Better check here before we SIG_BUS on access of data */
-	if (unlikely(PA_SIZE < ((pa->size + PA_PAGES_AT_A_TIME) * PAGE_SIZE))) {
-		DBG("PA_SIZE too small pa->size=0x%lx\n", pa->size);
-		return -ENOMEM;
+	BUILD_BUG_ON(PA_PAGES_AT_A_TIME % (1 << PA_MAX_ORDER));
+
+	pthread_mutex_lock(&pa->grow_lock);
+	if (pa->size == pa->mapped) {
+		err = _pa_seg_add(pa);
+		if (unlikely(err)) {
+			pthread_mutex_unlock(&pa->grow_lock);
+			return err;
+		}
 	}
+	bn = pa->size;
+
+	if (zus_numa_map)
+		zus_mbind_preferred(pa->data.ptr + md_p2o(bn),
+				    md_p2o(npages), nid);
+
+	page = pa_bn_to_page(sbi, bn);
+	for (i = 0; i < npages; ++i)
+		_init_one_page(sbi, page + i, nid);
+
+	/* Published only once its page structs are set */
+	__atomic_store_n(&pa->size, bn + npages, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&pa->grow_lock);
 
-	page = pa->pages.ptr + pa->size * sizeof(*page);
-	for (i = 0; i < PA_PAGES_AT_A_TIME; ++i, ++page)
-		_init_one_page(sbi, pa, page);
+	pthread_spin_lock(&pn->lock);
+	for (i = 0; i < npages; i += 1 << PA_MAX_ORDER)
+		_pa_add_free(pn, page + i, PA_MAX_ORDER, false);
+	pthread_spin_unlock(&pn->lock);
 
-	pa->size += PA_PAGES_AT_A_TIME;
 	return 0;
 }
 
 static void _alloc_one_page(struct pa_page *page)
 {
-	a_list_del_init(&page->list);
+	a_list_init(&page->list);
 	page->refcount = 1;
 }
 
-static bool _pa_is_free(struct pa_page *page)
+/* Takes a free block of @order off @nid's lists, growing them if @grow */
+static struct pa_page *_pa_node_alloc(struct zus_sb_info *sbi, struct pa *pa,
+				      uint nid, int order, bool grow,
+				      bool *dirty)
+{
+	struct pa_node *pn = &pa->node[nid];
+	struct pa_page *page;
+
+	pthread_spin_lock(&pn->lock);
+	page = _pa_take_block(pn, order, dirty);
+	pthread_spin_unlock(&pn->lock);
+
+	/* Growing maps memory, so not under the node's lock */
+	while (!page && grow && !_init_page_of_pages(sbi, pa, nid)) {
+		pthread_spin_lock(&pn->lock);
+		page = _pa_take_block(pn, order, dirty);
+		pthread_spin_unlock(&pn->lock);
+	}
+	return page;
+}
+
+static void _pa_free_pages(struct zus_sb_info *sbi, struct pa *pa,
+			   struct pa_page *page, int order, bool dirty)
 {
-	return (page->refcount == 0);
+	struct pa_node *pn = &pa->node[pa_page_to_nid(page)];
+
+	pthread_spin_lock(&pn->lock);
+	_pa_free_block(sbi, pn, page, order, dirty);
+	pthread_spin_unlock(&pn->lock);
 }
 
-/* order - power of 2 of pages to allocate */
-struct pa_page *pa_alloc_order(struct zus_sb_info *sbi, int order)
+/* hugetlb pages are never swapped but must be there before touched, or we
+ * SIG_BUS. fallocate takes the one under @page, or fails if none are left.
+ */
+static int _pa_populate_huge(struct zus_sb_info *sbi, struct pa *pa,
+			     struct pa_page *page, int order)
+{
+	ulong bn = pa_page_to_bn(sbi, page);
+	struct pa_seg *seg = _pa_seg_of(pa, bn);
+	ulong off = md_p2o(bn - seg->bn) & ~(pa->hpage_size - 1);
+	int err;
+
+	if (likely(!fallocate(seg->fba.fd, FALLOC_FL_KEEP_SIZE, off,
+			      pa->hpage_size)))
+		return 0;
+
+	err = -errno;
+	DBG("fallocate huge bn=0x%lx => %d\n", bn, err);
+	_pa_free_pages(sbi, pa, page, order, false);
+	return err;
+}
+
+/* Faults in a block which was punched. Gives it back if it cannot */
+static int _pa_populate(struct zus_sb_info *sbi, struct pa *pa,
+			struct pa_page *page, int order)
 {
-	struct pa *pa = &sbi->pa[POOL_NUM];
-	struct pa_page *page;
 	ushort npages = 1 << order;
-	int err, i = 0;
+	int err;
 
-	if (ZUS_WARN_ON(PA_MAX_ORDER < order))
+	if (pa->hugetlb)
+		return _pa_populate_huge(sbi, pa, page, order);
+	if (!NEED_MLOCK)
+		return 0;
+
+	err = mlock(pa_page_address(sbi, page), npages * PAGE_SIZE);
+	if (likely(!err))
+		return 0;
+
+	err = -errno;
+	DBG("mlock failed pa=%p npages=%d => %d\n",
+	    pa_page_address(sbi, page), (int)npages, err);
+	_pa_punch(pa, pa_page_to_bn(sbi, page), npages);
+	_pa_free_pages(sbi, pa, page, order, false);
+	return err;
+}
+
+/* ~~~ per-CPU hot pages ~~~ */
+
+/* Single pages freed on a CPU are kept on its list, up to PA_CPU_HIGH, for
+ * the next single page allocations on that CPU. Only pages of the CPU's own
+ * node are kept. These are never punched, so come back resident.
+ */
+#define PA_CPU_HIGH	256
+#define PA_CPU_BATCH	64	/* moved to and from the node at a time */
+
+struct pa_cpu {
+	struct a_list_head head;
+	int count;
+	uint nid;	/* of the CPU, known once zus_numa_map is */
+	pthread_spinlock_t lock;
+} __aligned(64);
+
+static struct pa_cpu *_pa_cpu_get(struct pa *pa)
+{
+	struct pa_cpu *pc;
+	int cpu;
+
+	/* Before zus_numa_map_init the CPU's node is not known */
+	if (unlikely(!pa->cpu || !zus_numa_map))
 		return NULL;
 
-	pthread_spin_lock(&pa->lock);
+	cpu = zus_current_cpu_silent();
+	if (unlikely(cpu < 0 || pa->ncpus <= cpu))
+		return NULL;
 
-	if (a_list_empty(&pa->head)) {
-		err = _init_page_of_pages(sbi, pa);
-		if (unlikely(err)) {
-			page = NULL;
-			goto out;
-		}
+	pc = &pa->cpu[cpu];
+	if (unlikely(pc->nid == ZUS_NUMA_NO_NID))
+		pc->nid = zus_cpu_to_node(cpu) % ZUS_PA_MAX_NODES;
+	return pc;
+}
+
+/* Takes up to PA_CPU_BATCH resident single pages of @pc's node into @list */
+static int _pa_cpu_refill(struct zus_sb_info *sbi, struct pa *pa,
+			  struct pa_cpu *pc, struct a_list_head *list)
+{
+	struct pa_page *page;
+	int n = 0;
+	bool dirty;
+
+	while (n < PA_CPU_BATCH) {
+		page = _pa_node_alloc(sbi, pa, pc->nid, 0, !n, &dirty);
+		if (!page)
+			break;
+		/* Given back clean, it would be the next one again */
+		if (!dirty && _pa_populate(sbi, pa, page, 0))
+			break;
+		a_list_add_tail(&page->list, list);
+		++n;
 	}
+	return n;
+}
 
-rescan:
-	a_list_for_each_entry(page, &pa->head, list) {
-		ulong bn = pa_page_to_bn(sbi, page);
+static struct pa_page *_pa_cpu_alloc(struct zus_sb_info *sbi, struct pa *pa,
+				     struct pa_cpu *pc)
+{
+	struct a_list_head list;
+	struct pa_page *page;
+	int n;
 
-		if ((bn % npages) || (bn + npages - 1 > pa->size))
-			continue;
+	pthread_spin_lock(&pc->lock);
+	if (likely(pc->count))
+		goto pop;
+	pthread_spin_unlock(&pc->lock);
+
+	a_list_init(&list);
+	n = _pa_cpu_refill(sbi, pa, pc, &list);
+	if (unlikely(!n))
+		return NULL;
+
+	pthread_spin_lock(&pc->lock);
+	while (!a_list_empty(&list)) {
+		page = a_list_first_entry(&list, struct pa_page, list);
+		a_list_del(&page->list);
+		a_list_add_tail(&page->list, &pc->head);
+	}
+	pc->count += n;
+
+pop:
+	page = a_list_first_entry(&pc->head, struct pa_page, list);
+	a_list_del_init(&page->list);
+	--pc->count;
+	pthread_spin_unlock(&pc->lock);
 
-		for (i = 1; i < npages; ++i) {
-			if (!_pa_is_free(page + i))
-				break;
+	page->refcount = 1;
+	return page;
+}
+
+static void _pa_reclaim_kick(struct pa *pa);
+
+/* Returns false if @page is not of @pc's node */
+static bool _pa_cpu_free(struct zus_sb_info *sbi, struct pa *pa,
+			 struct pa_cpu *pc, struct pa_page *page)
+{
+	struct pa_node *pn = &pa->node[pc->nid];
+	struct pa_page *cold[PA_CPU_BATCH];
+	int i, n = 0;
+
+	if ((uint)pa_page_to_nid(page) != pc->nid)
+		return false;
+
+	pthread_spin_lock(&pc->lock);
+	a_list_add(&page->list, &pc->head);
+	if (unlikely(++pc->count > PA_CPU_HIGH)) {
+		for (n = 0; n < PA_CPU_BATCH; ++n) {
+			cold[n] = container_of(pc->head.prev, struct pa_page,
+					       list);
+			a_list_del_init(&cold[n]->list);
 		}
-		if (i == npages) {
-			for (i = 0; i < npages; ++i)
-				_alloc_one_page(page + i);
-			goto out;
+		pc->count -= n;
+	}
+	pthread_spin_unlock(&pc->lock);
+
+	if (likely(!n))
+		return true;
+
+	pthread_spin_lock(&pn->lock);
+	for (i = 0; i < n; ++i)
+		_pa_free_block(sbi, pn, cold[i], 0, true);
+	pthread_spin_unlock(&pn->lock);
+
+	_pa_reclaim_kick(pa);
+	return true;
+}
+
+static void _pa_cpu_drain(struct zus_sb_info *sbi, struct pa *pa)
+{
+	struct pa_page *page;
+	int cpu;
+
+	for (cpu = 0; cpu < pa->ncpus; ++cpu) {
+		struct pa_cpu *pc = &pa->cpu[cpu];
+
+		while (!a_list_empty(&pc->head)) {
+			page = a_list_first_entry(&pc->head, struct pa_page,
+						  list);
+			a_list_del_init(&page->list);
+			_pa_free_pages(sbi, pa, page, 0, true);
 		}
+		pc->count = 0;
+		pthread_spin_destroy(&pc->lock);
 	}
-	page = NULL;
-	err = _init_page_of_pages(sbi, pa);
+	free(pa->cpu);
+	pa->cpu = NULL;
+}
+
+static int _pa_cpu_init(struct pa *pa)
+{
+	int cpu, err, ncpus = get_nprocs_conf();
+
+	err = posix_memalign((void **)&pa->cpu, 64,
+			     ncpus * sizeof(*pa->cpu));
 	if (unlikely(err))
-		goto out;
-	goto rescan;
+		return -err;
 
-out:
-	pthread_spin_unlock(&pa->lock);
+	for (cpu = 0; cpu < ncpus; ++cpu) {
+		struct pa_cpu *pc = &pa->cpu[cpu];
 
-	if (NEED_MLOCK && page) {
-		err = mlock(pa_page_address(sbi, page), npages * PAGE_SIZE);
+		a_list_init(&pc->head);
+		pc->count = 0;
+		pc->nid = ZUS_NUMA_NO_NID;
+		pthread_spin_init(&pc->lock, PTHREAD_PROCESS_SHARED);
+	}
+	pa->ncpus = ncpus;
+	return 0;
+}
 
-		if (unlikely(err)) {
-			DBG("mlock failed pa=%p npages=%d => %d\n",
-			    pa_page_address(sbi, page), (int)npages, -errno);
-			fba_punch_hole(&pa->data, pa_page_to_bn(sbi, page),
-				       npages);
+/* ~~~ reclaimer ~~~ */
 
-			pthread_spin_lock(&pa->lock);
-			for (i = 0; i < npages; ++i, ++page)
-				a_list_add(&page->list, &pa->head);
-			pthread_spin_unlock(&pa->lock);
+/* Dirty free pages are punched when there are more than PA_DIRTY_HIGH of
+ * them, down to PA_DIRTY_LOW, or all of them if the system runs low on
+ * free memory. Largest blocks first, each with a single fallocate.
+ */
+#define PA_DIRTY_HIGH		((64 * MEGA) / PAGE_SIZE)
+#define PA_DIRTY_LOW		((16 * MEGA) / PAGE_SIZE)
+#define PA_RECLAIM_PERIOD_MS	1000
+#define PA_SYS_LOW_SHIFT	4	/* free RAM below 1/16 of it is low */
+
+struct pa_reclaim {
+	struct zus_sb_info *sbi;
+	pthread_t thread;
+	sem_t kick;
+	bool kicked;
+	bool stop;
+};
+
+static ulong _pa_ndirty(struct pa *pa)
+{
+	ulong ndirty = 0;
+	int n;
 
-			page = NULL;
+	for (n = 0; n < ZUS_PA_MAX_NODES; ++n)
+		ndirty += __atomic_load_n(&pa->node[n].ndirty,
+					  __ATOMIC_RELAXED);
+	return ndirty;
+}
+
+static void _pa_reclaim_kick(struct pa *pa)
+{
+	struct pa_reclaim *rc = pa->reclaim;
+
+	/* Huge pages are only looked for periodically, see _pa_reclaim_huge */
+	if (!rc || pa->hpage_size || _pa_ndirty(pa) <= PA_DIRTY_HIGH)
+		return;
+	if (!__atomic_exchange_n(&rc->kicked, true, __ATOMIC_ACQ_REL))
+		sem_post(&rc->kick);
+}
+
+static bool _pa_sys_low(void)
+{
+	struct sysinfo si;
+
+	if (sysinfo(&si))
+		return false;
+	return si.freeram < (si.totalram >> PA_SYS_LOW_SHIFT);
+}
+
+/* Punches one dirty block of @pn, the largest. Returns false if none */
+static bool _pa_reclaim_one(struct zus_sb_info *sbi, struct pa *pa,
+			    struct pa_node *pn)
+{
+	struct pa_page *page = NULL;
+	int order;
+
+	pthread_spin_lock(&pn->lock);
+	for (order = PA_MAX_ORDER; order >= 0; --order) {
+		struct a_list_head *head = &pn->free[order];
+
+		if (a_list_empty(head))
+			continue;
+		page = a_list_first_entry(head, struct pa_page, list);
+		if (_pa_is_dirty(page))
+			break;
+		page = NULL;
+	}
+	if (page)
+		_pa_del_free(pn, page, order);
+	pthread_spin_unlock(&pn->lock);
+
+	if (!page)
+		return false;
+
+	_pa_punch(pa, pa_page_to_bn(sbi, page), 1 << order);
+	_pa_free_pages(sbi, pa, page, order, false);
+	return true;
+}
+
+/* True if all of the huge page at @page is free, and some of it dirty.
+ * Called with its node's lock held.
+ */
+static bool _pa_huge_free(struct pa_page *page, ulong hpages)
+{
+	bool dirty = false;
+	ulong i;
+
+	for (i = 0; i < hpages; i += 1 << PA_MAX_ORDER) {
+		if (!_pa_is_buddy(page + i, PA_MAX_ORDER))
+			return false;
+		dirty |= _pa_is_dirty(page + i);
+	}
+	return dirty;
+}
+
+/* Punching less than a huge page gives nothing back for hugetlb, and splits
+ * it for THP. So only whole free huge pages are punched.
+ */
+static void _pa_reclaim_huge(struct zus_sb_info *sbi, struct pa *pa,
+			     ulong keep)
+{
+	ulong hpages = pa->hpage_size / PAGE_SIZE;
+	ulong size = __atomic_load_n(&pa->size, __ATOMIC_ACQUIRE);
+	ulong bn, i;
+
+	for (bn = 0; bn < size && _pa_ndirty(pa) > keep; bn += hpages) {
+		struct pa_page *page = pa_bn_to_page(sbi, bn);
+		struct pa_node *pn = &pa->node[pa_page_to_nid(page)];
+
+		pthread_spin_lock(&pn->lock);
+		if (!_pa_huge_free(page, hpages)) {
+			pthread_spin_unlock(&pn->lock);
+			continue;
 		}
+		for (i = 0; i < hpages; i += 1 << PA_MAX_ORDER)
+			_pa_del_free(pn, page + i, PA_MAX_ORDER);
+		pthread_spin_unlock(&pn->lock);
+
+		_pa_punch(pa, bn, hpages);
+
+		pthread_spin_lock(&pn->lock);
+		for (i = 0; i < hpages; i += 1 << PA_MAX_ORDER)
+			_pa_add_free(pn, page + i, PA_MAX_ORDER, false);
+		pthread_spin_unlock(&pn->lock);
+	}
+}
+
+static void _pa_reclaim(struct zus_sb_info *sbi, struct pa *pa, ulong keep)
+{
+	int n;
+
+	if (pa->hpage_size) {
+		_pa_reclaim_huge(sbi, pa, keep);
+		return;
 	}
 
+	for (n = 0; n < ZUS_PA_MAX_NODES; ++n) {
+		struct pa_node *pn = &pa->node[n];
+
+		while (_pa_ndirty(pa) > keep && _pa_reclaim_one(sbi, pa, pn))
+			;
+	}
+}
+
+static void *_pa_reclaim_thread(void *arg)
+{
+	struct pa_reclaim *rc = arg;
+	struct pa *pa = &rc->sbi->pa[POOL_NUM];
+	struct timespec ts;
+
+	while (!rc->stop) {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += PA_RECLAIM_PERIOD_MS / 1000;
+		sem_timedwait(&rc->kick, &ts);
+		__atomic_store_n(&rc->kicked, false, __ATOMIC_RELEASE);
+		if (rc->stop)
+			break;
+
+		if (_pa_sys_low())
+			_pa_reclaim(rc->sbi, pa, 0);
+		else if (_pa_ndirty(pa) > PA_DIRTY_HIGH)
+			_pa_reclaim(rc->sbi, pa, PA_DIRTY_LOW);
+	}
+	return NULL;
+}
+
+static int _pa_reclaim_start(struct zus_sb_info *sbi, struct pa *pa)
+{
+	struct zus_thread_params tp;
+	struct pa_reclaim *rc;
+	int err;
+
+	rc = calloc(1, sizeof(*rc));
+	if (unlikely(!rc))
+		return -ENOMEM;
+
+	rc->sbi = sbi;
+	sem_init(&rc->kick, 0, 0);
+
+	ZTP_INIT(&tp);
+	tp.name = "pa_reclaim";
+	err = zus_thread_create(&rc->thread, &tp, _pa_reclaim_thread, rc);
+	if (unlikely(err)) {
+		ERROR("zus_thread_create => %d\n", err);
+		sem_destroy(&rc->kick);
+		free(rc);
+		return err;
+	}
+
+	pa->reclaim = rc;
+	return 0;
+}
+
+static void _pa_reclaim_stop(struct pa *pa)
+{
+	struct pa_reclaim *rc = pa->reclaim;
+	void *tret;
+
+	if (!rc)
+		return;
+
+	rc->stop = true;
+	sem_post(&rc->kick);
+	pthread_join(rc->thread, &tret);
+	sem_destroy(&rc->kick);
+	free(rc);
+	pa->reclaim = NULL;
+}
+
+/* ~~~ alloc/free ~~~ */
+
+/* order - power of 2 of pages to allocate */
+struct pa_page *pa_alloc_order_nid(struct zus_sb_info *sbi, int order,
+				   uint nid)
+{
+	struct pa *pa = &sbi->pa[POOL_NUM];
+	struct pa_page *page;
+	struct pa_cpu *pc;
+	bool dirty = false;
+	uint n;
+	int i;
+
+	if (ZUS_WARN_ON(PA_MAX_ORDER < order))
+		return NULL;
+
+	if (order == 0) {
+		pc = _pa_cpu_get(pa);
+		if (pc && (nid == ZUS_NUMA_NO_NID || nid == pc->nid)) {
+			page = _pa_cpu_alloc(sbi, pa, pc);
+			if (likely(page))
+				return page;
+		}
+	}
+
+	nid = _pa_nid(nid);
+	page = _pa_node_alloc(sbi, pa, nid, order, true, &dirty);
+	for (n = 0; !page && n < ZUS_PA_MAX_NODES; ++n) {
+		if (n != nid)
+			page = _pa_node_alloc(sbi, pa, n, order, false,
+					      &dirty);
+	}
+	if (unlikely(!page))
+		return NULL;
+
+	/* A dirty block was never punched, so is still resident */
+	if (!dirty && _pa_populate(sbi, pa, page, order))
+		return NULL;
+
+	for (i = 0; i < (1 << order); ++i)
+		_alloc_one_page(page + i);
 	return page;
 }
 
@@ -327,14 +1198,13 @@ void __pa_free(struct pa_page *page)
 {
 	struct zus_sb_info *sbi = (void *)((ulong)page->owner & ~ZUS_SBI_MASK);
 	struct pa *pa = &sbi->pa[POOL_NUM];
+	struct pa_cpu *pc = _pa_cpu_get(pa);
 
-	fba_punch_hole(&pa->data, pa_page_to_bn(sbi, page), 1);
-
-	pthread_spin_lock(&pa->lock);
-
-	a_list_add(&page->list, &pa->head);
+	if (likely(pc) && _pa_cpu_free(sbi, pa, pc, page))
+		return;
 
-	pthread_spin_unlock(&pa->lock);
+	_pa_free_pages(sbi, pa, page, 0, true);
+	_pa_reclaim_kick(pa);
 }
 
 #define BUILD_BUG_ON_PA_KP(pa_page, pa_mem, zus_page, kmem)	\
@@ -363,23 +1233,36 @@ static void _require_equal(void)
 int pa_init(struct zus_sb_info *sbi)
 {
 	struct pa *pa = &sbi->pa[POOL_NUM];
-	int err;
+	int err, n, o;
 
 	_require_equal();
+	BUILD_BUG_ON(ZUS_PA_MAX_NODES > (1 << NODES_BITLEN));
 
 	pa->size = 0;
-	a_list_init(&pa->head);
+	for (n = 0; n < ZUS_PA_MAX_NODES; ++n) {
+		for (o = 0; o <= PA_MAX_ORDER; ++o)
+			a_list_init(&pa->node[n].free[o]);
+		pa->node[n].ndirty = 0;
+		err = pthread_spin_init(&pa->node[n].lock,
+					PTHREAD_PROCESS_SHARED);
+		if (unlikely(err))
+			goto fail;
+	}
 
-	err = pthread_spin_init(&pa->lock, PTHREAD_PROCESS_SHARED);
+	err = pthread_mutex_init(&pa->grow_lock, NULL);
 	if (unlikely(err))
 		goto fail;
 
-	err = fba_alloc(&pa->data, PA_SIZE);
+	_pa_huge_init(pa);
+	err = _pa_segs_init(pa);
 	if (unlikely(err))
 		goto fail;
 
-	err = fba_alloc(&pa->pages, (PA_SIZE / PAGE_SIZE) *
-						sizeof(struct pa_page));
+	err = _pa_cpu_init(pa);
+	if (unlikely(err))
+		goto fail;
+
+	err = _pa_reclaim_start(sbi, pa);
 	if (unlikely(err))
 		goto fail;
 
@@ -395,14 +1278,23 @@ void pa_fini(struct zus_sb_info *sbi)
 	struct pa *pa = &sbi->pa[POOL_NUM];
 	struct pa_page *page;
 	ulong free_p = 0;
+	int n, o;
 
-	a_list_for_each_entry(page, &pa->head, list) {
-		++free_p;
+	_pa_reclaim_stop(pa);
+	if (pa->cpu)
+		_pa_cpu_drain(sbi, pa);
+
+	for (n = 0; n < ZUS_PA_MAX_NODES; ++n) {
+		for (o = 0; o <= PA_MAX_ORDER; ++o) {
+			a_list_for_each_entry(page, &pa->node[n].free[o], list)
+				free_p += 1UL << o;
+		}
 	}
 	if (unlikely(free_p != pa->size))
 		ERROR("pa leaks %lu pages\n", pa->size - free_p);
 
-	fba_free(&pa->pages);
-	fba_free(&pa->data);
-	pthread_spin_destroy(&pa->lock);
+	_pa_segs_fini(pa);
+	for (n = 0; n < ZUS_PA_MAX_NODES; ++n)
+		pthread_spin_destroy(&pa->node[n].lock);
+	pthread_mutex_destroy(&pa->grow_lock);
 }
@@ -32,6 +32,14 @@ static void _sigaction_info_handler(int signum, siginfo_t *si, void *p)
 	DBG("SIGNAL: signum=%d si_errno=%d\n", signum, si->si_errno);
 }
 
+/* SIGUSR2 dumps stats, sigqueue(.sival_int = 1) also resets them */
+static void _sigaction_stats_handler(int signum, siginfo_t *si, void *p)
+{
+	_sigaction_info_handler(signum, si, p);
+	zus_stats_kick((si->si_code == SI_QUEUE) &&
+		       (si->si_value.sival_int == 1));
+}
+
 static void _sigaction_exit_handler(int signum, siginfo_t *si, void *p)
 {
 	_sigaction_info_handler(signum, si, p);
@@ -66,6 +74,16 @@ static void _sigaction_exit(int signum)
 	sigaction(signum, &sa_exit, NULL);
 }
 
+static void _sigaction_stats(int signum)
+{
+	static struct sigaction sa_stats = {
+		.sa_sigaction   = _sigaction_stats_handler,
+		.sa_flags       = SA_SIGINFO | SA_RESTART
+	};
+
+	sigaction(signum, &sa_stats, NULL);
+}
+
 static void _sigaction_abort(int signum)
 {
 	static struct sigaction sa_abort = {
@@ -102,7 +120,7 @@ void zus_register_sigactions(void)
 	_sigaction_abort(SIGKILL);
 	_sigaction_exit(SIGUSR1);
 	_sigaction_abort(SIGSEGV);
-	_sigaction_info(SIGUSR2);
+	_sigaction_stats(SIGUSR2);
 	_sigaction_info(SIGPIPE);
 	_sigaction_info(SIGALRM);
 	_sigaction_exit(SIGTERM);
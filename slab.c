@@ -31,9 +31,20 @@
 #define ZUS_BLOCK_SIZE          PAGE_SIZE
 #define ZUS_MIN_SLAB_SHIFT      5
 #define ZUS_MIN_SLAB_SIZE       (1 << ZUS_MIN_SLAB_SHIFT) /* 32 Bytes */
-#define ZUS_MAX_SLABS_PER_BLOCK (ZUS_BLOCK_SIZE / ZUS_MIN_SLAB_SIZE)
-#define ZUS_SLAB_LISTS          (PAGE_SHIFT - ZUS_MIN_SLAB_SHIFT + 1)
+#define ZUS_SLAB_QUANTUM	16   /* alignment of all elements */
+#define ZUS_SLAB_SMALL_SHIFT	7    /* classes up to 128 are QUANTUM apart */
+#define ZUS_SLAB_CLASS_BITS	3    /* then 8 classes per power of two */
+#define ZUS_SLAB_SMALL_LISTS	\
+	((1 << ZUS_SLAB_SMALL_SHIFT) / ZUS_SLAB_QUANTUM - 1)
+#define ZUS_SLAB_LISTS		(ZUS_SLAB_SMALL_LISTS + \
+	((PAGE_SHIFT - ZUS_SLAB_SMALL_SHIFT) << ZUS_SLAB_CLASS_BITS))
+#define ZUS_SLAB_MAX_SPAN_ORDER	3    /* spans of up to 8 pages */
 #define ZUS_SLAB_NFREE_WANT	1024 /* default number of wanted elements */
+#define ZUS_SLAB_MAG_SIZE	32   /* per-thread cached elements per list */
+#define ZUS_SLAB_MAG_BATCH	(ZUS_SLAB_MAG_SIZE / 2)
+#define ZUS_SLAB_REMOTE_BATCH	32   /* remote frees handed over at once */
+#define ZUS_LARGE_MAX_SIZE	(PAGE_SIZE << PA_MAX_ORDER)
+#define ZUS_HUGE_ALIGN		(ZUFS_ALLOC_MASK + 1) /* 2M */
 
 /* ~~~~~ SLAB allocator ~~~~~ */
 
@@ -44,15 +55,46 @@ struct zus_slab {
 		int nused; /* number elements currently owned by user */
 		int nfree; /* number of elements currently in free-list */
 		int nfree_want; /* threshold of min wanted elements in list */
-		int _pad;
+		int nspans; /* number of spans (pa runs) carved into the list */
 	} list[ZUS_SLAB_LISTS];
 	int cpu;
+	uint nid; /* of @cpu, known once zus_numa_map is */
 	pthread_spinlock_t lock;
+	/* Elements freed by threads of other CPUs, see _slab_remote_push */
+	struct zus_slab_elem *remote __aligned(64);
 } __aligned(64);
 
+/* Elements of a class are carved out of a span of 1 << g_slab_order[] pages
+ * at multiples of the class size, so may cross page boundaries. Every page
+ * of a span carries the list index and CPU, the use count is on its first.
+ */
 struct zus_slab_elem {
 	struct a_list_head list;
-} __attribute__((aligned(ZUS_MIN_SLAB_SIZE)));
+};
+
+/* Per-thread magazine of elements of one slab, the one of the CPU the thread
+ * runs on. Only its thread touches it, so alloc and free of elements of that
+ * slab take no locks and no atomics. Elements in a magazine are accounted
+ * as used by their page; only moving them to and from the slab's lists, in
+ * batches, takes the slab lock.
+ * Frees of elements of other slabs are chained in @rbuf, one chain per owner
+ * CPU, and each chain is handed over whole to its owner's remote list. A
+ * thread holds at most ZUS_SLAB_REMOTE_BATCH - 1 elements of each CPU.
+ */
+struct zus_slab_mag {
+	struct zus_slab *slab;
+	struct a_list_head link; /* On g_gsa->mags, for zus_slab_get_stats */
+	struct zus_slab_stats stats;
+	struct zus_slab_mag_list {
+		int n;
+		void *elems[ZUS_SLAB_MAG_SIZE];
+	} list[ZUS_SLAB_LISTS];
+	struct zus_slab_rbuf {
+		struct zus_slab_elem *head;
+		struct zus_slab_elem *tail;
+		int n;
+	} rbuf[];	/* One per CPU */
+};
 
 
 static void _slab_lock(struct zus_slab *slab)
@@ -62,13 +104,6 @@ static void _slab_lock(struct zus_slab *slab)
 	ZUS_WARN_ON(err);
 }
 
-static bool _slab_trylock(struct zus_slab *slab)
-{
-	int err = pthread_spin_trylock(&slab->lock);
-
-	return (err == 0);
-}
-
 static void _slab_unlock(struct zus_slab *slab)
 {
 	int err = pthread_spin_unlock(&slab->lock);
@@ -110,21 +145,66 @@ static int _page_slab_uc_dec(struct pa_page *page)
 	return --page->sinfo.slab_uc;
 }
 
+/* ~~~~~ size classes ~~~~~ */
+
+static int g_slab_order[ZUS_SLAB_LISTS];
+
+static size_t _slab_class_size(int slab_index)
+{
+	int lg, sub;
+
+	if (slab_index < ZUS_SLAB_SMALL_LISTS)
+		return (slab_index + 2) * ZUS_SLAB_QUANTUM;
+
+	slab_index -= ZUS_SLAB_SMALL_LISTS;
+	lg = ZUS_SLAB_SMALL_SHIFT + (slab_index >> ZUS_SLAB_CLASS_BITS);
+	sub = slab_index & ((1 << ZUS_SLAB_CLASS_BITS) - 1);
+	return (1UL << lg) + ((sub + 1UL) << (lg - ZUS_SLAB_CLASS_BITS));
+}
+
+/* Smallest span which wastes at most 1/8 of it past the last element */
+static void _slab_classes_init(void)
+{
+	int slab_index, order;
+
+	for (slab_index = 0; slab_index < ZUS_SLAB_LISTS; ++slab_index) {
+		size_t size = _slab_class_size(slab_index);
+
+		for (order = 0; order < ZUS_SLAB_MAX_SPAN_ORDER; ++order) {
+			size_t span = PAGE_SIZE << order;
+
+			if ((span % size) * 8 <= span)
+				break;
+		}
+		g_slab_order[slab_index] = order;
+	}
+}
+
+static struct pa_page *_span_head(struct zus_sb_info *sbi,
+				  struct pa_page *page)
+{
+	ulong npages = 1UL << g_slab_order[_page_slab_index(page)];
+
+	return pa_bn_to_page(sbi, pa_page_to_bn(sbi, page) & ~(npages - 1));
+}
+
 /* ~~~~~ SLAB init ~~~~~ */
 
 static void _slab_init(struct zus_slab *slab, struct zus_sb_info *sbi, int cpu)
 {
 	size_t i;
 
-	ZUS_BUILD_BUG_ON(sizeof(struct zus_slab_elem) != ZUS_MIN_SLAB_SIZE);
+	ZUS_BUILD_BUG_ON(sizeof(struct zus_slab_elem) > ZUS_MIN_SLAB_SIZE);
 
 	slab->sbi = sbi;
 	slab->cpu = cpu;
+	slab->nid = ZUS_NUMA_NO_NID;
 	for (i = 0; i < ZUS_ARRAY_SIZE(slab->list); i++) {
 		a_list_init(&slab->list[i].head);
 		slab->list[i].nused = 0;
 		slab->list[i].nfree = 0;
 		slab->list[i].nfree_want = ZUS_SLAB_NFREE_WANT;
+		slab->list[i].nspans = 0;
 	}
 }
 
@@ -145,39 +225,55 @@ _slab_alloc_elem(struct zus_slab *slab, int slab_index)
 	return se;
 }
 
-static void _slab_page_init(struct zus_slab *slab,
+static void _slab_span_init(struct zus_slab *slab,
 			    struct pa_page *page, int slab_index)
 {
 	struct zus_slab_list *slab_list = &slab->list[slab_index];
-	int slabs_count = ZUS_MAX_SLABS_PER_BLOCK >> slab_index;
-	int i, step = 1 << slab_index;
-	struct zus_slab_elem *se;
+	int i, npages = 1 << g_slab_order[slab_index];
+	size_t step = _slab_class_size(slab_index);
+	int slabs_count = (npages * PAGE_SIZE) / step;
+	char *addr;
 
-	_page_set_slab(page, slab_index, slab->cpu);
+	for (i = 0; i < npages; i++)
+		_page_set_slab(page + i, slab_index, slab->cpu);
 
-	se = pa_page_address(slab->sbi, page);
+	addr = pa_page_address(slab->sbi, page);
 	for (i = 0; i < slabs_count; i++) {
+		struct zus_slab_elem *se = (void *)addr;
+
 		a_list_add_tail(&se->list, &slab_list->head);
 		++slab_list->nfree;
-		se += step;
+		addr += step;
 	}
+	++slab_list->nspans;
 }
 
-static void _slab_page_fini(struct zus_slab *slab,
+static void _slab_span_fini(struct zus_slab *slab,
 			    struct pa_page *page, int slab_index)
 {
 	struct zus_slab_list *slab_list = &slab->list[slab_index];
-	int slabs_count = ZUS_MAX_SLABS_PER_BLOCK >> slab_index;
-	int i, step = 1 << slab_index;
-	struct zus_slab_elem *se;
+	int i, npages = 1 << g_slab_order[slab_index];
+	size_t step = _slab_class_size(slab_index);
+	int slabs_count = (npages * PAGE_SIZE) / step;
+	char *addr;
 
-	se = pa_page_address(slab->sbi, page);
+	addr = pa_page_address(slab->sbi, page);
 	for (i = 0; i < slabs_count; i++) {
+		struct zus_slab_elem *se = (void *)addr;
+
 		a_list_del_init(&se->list);
 		--slab_list->nfree;
-		se += step;
+		addr += step;
+	}
+	--slab_list->nspans;
+
+	for (i = 0; i < npages; i++) {
+		int last;
+
+		_page_clear_slab(page + i);
+		last = pa_put_page(page + i);
+		ZUS_WARN_ON(!last);
 	}
-	_page_clear_slab(page);
 }
 
 /* ~~~~~ SLAB alloc ~~~~~ */
@@ -189,12 +285,19 @@ static bool _slab_size_valid(size_t size)
 
 static int _slab_list_index(size_t size)
 {
-	int slab_index;
+	int slab_index, lg;
 
 	if (unlikely(size <= ZUS_MIN_SLAB_SIZE))
 		return 0;
 
-	slab_index = (32 - (__builtin_clz((size - 1) >> ZUS_MIN_SLAB_SHIFT)));
+	if (size <= (1 << ZUS_SLAB_SMALL_SHIFT))
+		return (size - 1) / ZUS_SLAB_QUANTUM - 1;
+
+	lg = 63 - __builtin_clzl(size - 1);
+	slab_index = ZUS_SLAB_SMALL_LISTS +
+		     ((lg - ZUS_SLAB_SMALL_SHIFT) << ZUS_SLAB_CLASS_BITS) +
+		     (((size - 1) >> (lg - ZUS_SLAB_CLASS_BITS)) &
+		      ((1 << ZUS_SLAB_CLASS_BITS) - 1));
 	ZUS_WARN_ON(ZUS_SLAB_LISTS <= slab_index);
 
 	return slab_index;
@@ -206,30 +309,27 @@ static int _slab_check_list_index(int slab_index)
 		      (slab_index < ZUS_SLAB_LISTS)) ? 0 : -EINVAL;
 }
 
+/* zus_slab_init is before zus_numa_map_init, so resolved on first use */
+static uint _slab_nid(struct zus_slab *slab)
+{
+	if (unlikely(slab->nid == ZUS_NUMA_NO_NID) && zus_numa_map)
+		slab->nid = zus_cpu_to_node(slab->cpu);
+	return slab->nid;
+}
+
 static int _slab_increase(struct zus_slab *slab, int slab_index)
 {
 	struct pa_page *page;
 
-	page = pa_alloc(slab->sbi);
+	page = pa_alloc_order_nid(slab->sbi, g_slab_order[slab_index],
+				  _slab_nid(slab));
 	if (unlikely(!page))
 		return -ENOMEM;
 
-	_slab_page_init(slab, page, slab_index);
+	_slab_span_init(slab, page, slab_index);
 	return 0;
 }
 
-static bool _slab_iscold(const struct zus_slab *slab, size_t size)
-{
-	int slab_index = _slab_list_index(size);
-	const struct zus_slab_list *slab_list;
-
-	if (unlikely(_slab_check_list_index(slab_index)))
-		return false;
-
-	slab_list = &slab->list[slab_index];
-	return !slab_list->nfree && !slab_list->nused;
-}
-
 static bool _slab_list_empty(struct zus_slab *slab, size_t size)
 {
 	int slab_index = _slab_list_index(size);
@@ -265,7 +365,7 @@ static void *_slab_alloc(struct zus_slab *slab, size_t size)
 	if (unlikely(!se))
 		return NULL;
 
-	page = pa_virt_to_page(slab->sbi, se);
+	page = _span_head(slab->sbi, pa_virt_to_page(slab->sbi, se));
 	_page_slab_uc_inc(page);
 
 	ZUS_WARN_ON(pa_page_count(page) != 1);
@@ -286,7 +386,6 @@ static void __slab_free(struct zus_slab *slab, int slab_index,
 			struct pa_page *page, void *addr)
 {
 	struct zus_slab_list *slab_list = &slab->list[slab_index];
-	int last;
 
 	_slab_free_elem(slab_list, addr);
 
@@ -296,32 +395,19 @@ static void __slab_free(struct zus_slab *slab, int slab_index,
 	if (slab_list->nfree < slab_list->nfree_want)
 		return;
 
-	_slab_page_fini(slab, page, slab_index);
-	last = pa_put_page(page);
-	ZUS_WARN_ON(!last);
+	_slab_span_fini(slab, page, slab_index);
 }
 
-static int _slab_free(struct zus_slab *slab, void *addr)
+/* Called with slab locked */
+static void _slab_put_elem(struct zus_slab *slab, void *addr)
 {
-	struct pa_page *page;
-	int slab_index;
-	int err = 0;
-
-	_slab_lock(slab);
-
-	page = pa_virt_to_page(slab->sbi, addr);
-	slab_index = _page_slab_index(page);
-
-	if (unlikely(_slab_check_list_index(slab_index))) {
-		err = -EINVAL;
-		goto out;
-	}
+	struct pa_page *page = pa_virt_to_page(slab->sbi, addr);
+	int slab_index = _page_slab_index(page);
 
-	__slab_free(slab, slab_index, page, addr);
+	if (ZUS_WARN_ON(_slab_check_list_index(slab_index)))
+		return;
 
-out:
-	_slab_unlock(slab);
-	return err;
+	__slab_free(slab, slab_index, _span_head(slab->sbi, page), addr);
 }
 
 
@@ -332,7 +418,6 @@ static void _slab_fini(struct zus_slab *slab)
 	int slab_index;
 
 	for (slab_index = 0; slab_index < ZUS_SLAB_LISTS; ++slab_index) {
-		int last;
 		struct zus_slab_elem *se;
 		struct pa_page *page;
 		struct zus_slab_list *slab_list = &slab->list[slab_index];
@@ -340,15 +425,14 @@ static void _slab_fini(struct zus_slab *slab)
 		while (!a_list_empty(&slab_list->head)) {
 			se = a_list_first_entry(&slab_list->head,
 						struct zus_slab_elem, list);
-			page = pa_virt_to_page(slab->sbi, se);
+			page = _span_head(slab->sbi,
+					  pa_virt_to_page(slab->sbi, se));
 			if (ZUS_WARN_ON(page->sinfo.slab_uc)) {
 				ERROR("Slab-Leak! uc=%d\n", page->sinfo.slab_uc);
 				break;
 			}
 
-			_slab_page_fini(slab, page, slab_index);
-			last = pa_put_page(page);
-			ZUS_WARN_ON(!last);
+			_slab_span_fini(slab, page, slab_index);
 		}
 		slab->list[slab_index].nused = 0;
 		slab->list[slab_index].nfree_want = 0;
@@ -363,10 +447,17 @@ static void _slab_fini(struct zus_slab *slab)
 struct zus_global_slab_allocator {
 	struct zus_sb_info sbi;
 	int nslabs;
+	pthread_mutex_t mags_lock;
+	struct a_list_head mags;
+	struct zus_slab_stats gone;	/* Of magazines already freed */
+	pthread_mutex_t huge_lock;
+	struct a_list_head huge;
 	struct zus_slab slab[1];	/* at least one CPU */
 };
 
 static struct zus_global_slab_allocator *g_gsa = NULL;
+static pthread_key_t g_mag_key;
+static __thread struct zus_slab_mag *tl_mag;
 
 
 /* TODO: move to pa? */
@@ -386,7 +477,7 @@ static int _zus_gsa_cpu_of(void *ptr)
 	if (unlikely(!addr))
 		return -1;
 
-	if (unlikely(addr & ((1 << ZUS_MIN_SLAB_SHIFT) - 1)))
+	if (unlikely(addr & (ZUS_SLAB_QUANTUM - 1)))
 		return -1;
 
 	if (!__pa_addr_inrange(&g_gsa->sbi, ptr))
@@ -396,11 +487,6 @@ static int _zus_gsa_cpu_of(void *ptr)
 	return _page_slab_cpu(page);
 }
 
-static struct zus_slab *_zus_gsa_sslab_at(int cpu, int index)
-{
-	return &g_gsa->slab[(cpu + index) % g_gsa->nslabs];
-}
-
 static struct zus_slab *_slab_of_cpu(int cpu)
 {
 	if (unlikely((cpu < 0) || (g_gsa->nslabs <= cpu)))
@@ -409,47 +495,276 @@ static struct zus_slab *_slab_of_cpu(int cpu)
 	return &g_gsa->slab[cpu];
 }
 
-static void *_zus_gsa_malloc(size_t size)
+/* ~~~~~ remote frees ~~~~~ */
+
+/* Any thread may push a chain @first..@last, only threads holding a
+ * magazine of @slab take them all at once. So there is no ABA.
+ */
+static void _slab_remote_push(struct zus_slab *slab,
+			      struct zus_slab_elem *first,
+			      struct zus_slab_elem *last)
 {
-	int i, cpu = zus_current_cpu_silent();
-	struct zus_slab *slab;
-	void *ptr;
+	struct zus_slab_elem *head;
+
+	head = __atomic_load_n(&slab->remote, __ATOMIC_RELAXED);
+	do {
+		last->list.next = (struct a_list_head *)head;
+	} while (!__atomic_compare_exchange_n(&slab->remote, &head, first,
+					      true, __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+}
 
-	slab = _slab_of_cpu(cpu);
-	if (unlikely(_slab_iscold(slab, size)))
-		goto out;
+static struct zus_slab_elem *_slab_remote_take(struct zus_slab *slab)
+{
+	if (!__atomic_load_n(&slab->remote, __ATOMIC_RELAXED))
+		return NULL;
+	return __atomic_exchange_n(&slab->remote, NULL, __ATOMIC_ACQUIRE);
+}
 
-	for (i = 0; i < g_gsa->nslabs; ++i) {
-		if (_slab_trylock(slab)) {
-			if (!_slab_list_empty(slab, size)) {
-				ptr = _slab_alloc(slab, size);
+static int _elem_slab_index(struct zus_slab *slab, void *addr)
+{
+	return _page_slab_index(pa_virt_to_page(slab->sbi, addr));
+}
 
-				_slab_unlock(slab);
+/* ~~~~~ per-thread magazines ~~~~~ */
 
-				return ptr;
-			}
-			_slab_unlock(slab);
-		}
-		slab = _zus_gsa_sslab_at(cpu, i + 1);
+/* Returns the @n top elements of a magazine list to its slab */
+static void _mag_flush(struct zus_slab_mag *mag, int slab_index, int n)
+{
+	struct zus_slab_mag_list *ml = &mag->list[slab_index];
+
+	_slab_lock(mag->slab);
+	while (n-- && ml->n)
+		_slab_put_elem(mag->slab, ml->elems[--ml->n]);
+	_slab_unlock(mag->slab);
+}
+
+static void _mag_flush_all(struct zus_slab_mag *mag)
+{
+	int slab_index;
+
+	for (slab_index = 0; slab_index < ZUS_SLAB_LISTS; ++slab_index)
+		if (mag->list[slab_index].n)
+			_mag_flush(mag, slab_index, ZUS_SLAB_MAG_SIZE);
+}
+
+static void _mag_push(struct zus_slab_mag *mag, int slab_index, void *addr)
+{
+	struct zus_slab_mag_list *ml = &mag->list[slab_index];
+
+	if (unlikely(ml->n == ZUS_SLAB_MAG_SIZE))
+		_mag_flush(mag, slab_index, ZUS_SLAB_MAG_BATCH);
+	ml->elems[ml->n++] = addr;
+}
+
+/* Moves whatever other CPUs freed into our slab into the magazine */
+static void _mag_drain_remote(struct zus_slab_mag *mag)
+{
+	struct zus_slab_elem *se = _slab_remote_take(mag->slab);
+
+	while (se) {
+		struct zus_slab_elem *next = (void *)se->list.next;
+
+		_mag_push(mag, _elem_slab_index(mag->slab, se), se);
+		se = next;
 	}
-out:
-	_slab_lock(slab);
+}
 
-	ptr = _slab_alloc(slab, size);
+static void _mag_remote_flush(struct zus_slab_mag *mag, int cpu)
+{
+	struct zus_slab_rbuf *rb = &mag->rbuf[cpu];
 
-	_slab_unlock(slab);
+	if (!rb->n)
+		return;
 
-	return ptr;
+	_slab_remote_push(&g_gsa->slab[cpu], rb->head, rb->tail);
+	rb->head = rb->tail = NULL;
+	rb->n = 0;
+	mag->stats.remote_batches++;
+}
+
+static void _mag_remote_flush_all(struct zus_slab_mag *mag)
+{
+	int cpu;
+
+	for (cpu = 0; cpu < g_gsa->nslabs; ++cpu)
+		_mag_remote_flush(mag, cpu);
+}
+
+static void _mag_remote_free(struct zus_slab_mag *mag, int cpu,
+			     struct zus_slab_elem *se)
+{
+	struct zus_slab_rbuf *rb = &mag->rbuf[cpu];
+
+	se->list.next = (struct a_list_head *)rb->head;
+	if (!rb->head)
+		rb->tail = se;
+	rb->head = se;
+	mag->stats.remote_frees++;
+
+	if (unlikely(++rb->n == ZUS_SLAB_REMOTE_BATCH))
+		_mag_remote_flush(mag, cpu);
+}
+
+static void _mag_stats_add(struct zus_slab_stats *to,
+			   const struct zus_slab_stats *from)
+{
+	to->local_frees += from->local_frees;
+	to->remote_frees += from->remote_frees;
+	to->remote_batches += from->remote_batches;
+}
+
+/* Called with mags_lock held */
+static void _mag_unlink(struct zus_slab_mag *mag)
+{
+	a_list_del(&mag->link);
+	_mag_stats_add(&g_gsa->gone, &mag->stats);
+}
+
+static bool _mag_refill(struct zus_slab_mag *mag, int slab_index)
+{
+	struct zus_slab_mag_list *ml = &mag->list[slab_index];
+	size_t size = _slab_class_size(slab_index);
+	void *addr;
+
+	_mag_drain_remote(mag);
+	if (ml->n)
+		return true;
+
+	_slab_lock(mag->slab);
+	while (ml->n < ZUS_SLAB_MAG_BATCH) {
+		addr = _slab_alloc(mag->slab, size);
+		if (unlikely(!addr))
+			break;
+		ml->elems[ml->n++] = addr;
+	}
+	_slab_unlock(mag->slab);
+
+	return ml->n != 0;
+}
+
+static void _mag_destructor(void *p)
+{
+	struct zus_slab_mag *mag = p;
+
+	if (likely(g_gsa)) {
+		_mag_flush_all(mag);
+		_mag_remote_flush_all(mag);
+		pthread_mutex_lock(&g_gsa->mags_lock);
+		_mag_unlink(mag);
+		pthread_mutex_unlock(&g_gsa->mags_lock);
+	}
+	tl_mag = NULL;
+	free(mag);
+}
+
+/* The magazine of this thread, bound to the slab of the CPU it runs on */
+static struct zus_slab_mag *_mag_get(void)
+{
+	struct zus_slab *slab = _slab_of_cpu(zus_current_cpu_silent());
+	struct zus_slab_mag *mag = tl_mag;
+
+	if (likely(mag && (mag->slab == slab)))
+		return mag;
+	if (unlikely(!slab))
+		return NULL;
+
+	if (!mag) {
+		mag = calloc(1, sizeof(*mag) +
+				g_gsa->nslabs * sizeof(mag->rbuf[0]));
+		if (unlikely(!mag))
+			return NULL;
+		pthread_setspecific(g_mag_key, mag);
+		tl_mag = mag;
+
+		pthread_mutex_lock(&g_gsa->mags_lock);
+		a_list_add(&mag->link, &g_gsa->mags);
+		pthread_mutex_unlock(&g_gsa->mags_lock);
+	} else {
+		/* Thread moved to another CPU */
+		_mag_flush_all(mag);
+	}
+	mag->slab = slab;
+	return mag;
+}
+
+static void *_zus_gsa_malloc(size_t size)
+{
+	int slab_index = _slab_list_index(size);
+	struct zus_slab_mag *mag = _mag_get();
+	struct zus_slab_mag_list *ml;
+
+	if (unlikely(!mag))
+		return NULL;
+
+	ml = &mag->list[slab_index];
+	if (unlikely(!ml->n) && !_mag_refill(mag, slab_index))
+		return NULL;
+
+	return ml->elems[--ml->n];
 }
 
 static void _zus_gsa_free(void *ptr)
 {
 	int cpu = _zus_gsa_cpu_of(ptr);
+	struct zus_slab_mag *mag;
+	struct zus_slab *slab;
 
 	if (ZUS_WARN_ON(cpu < 0))
 		return;
 
-	_slab_free(_slab_of_cpu(cpu), ptr);
+	slab = _slab_of_cpu(cpu);
+	mag = _mag_get();
+	if (unlikely(!mag)) {
+		_slab_remote_push(slab, ptr, ptr);
+		return;
+	}
+
+	if (likely(mag->slab == slab)) {
+		_mag_push(mag, _elem_slab_index(slab, ptr), ptr);
+		mag->stats.local_frees++;
+	} else {
+		_mag_remote_free(mag, cpu, ptr);
+	}
+}
+
+void zus_slab_get_stats(struct zus_slab_stats *zss)
+{
+	struct zus_slab_mag *mag;
+
+	memset(zss, 0, sizeof(*zss));
+	if (unlikely(!g_gsa))
+		return;
+
+	/* Racy against the owners, good enough for counters */
+	pthread_mutex_lock(&g_gsa->mags_lock);
+	*zss = g_gsa->gone;
+	a_list_for_each_entry(mag, &g_gsa->mags, link)
+		_mag_stats_add(zss, &mag->stats);
+	pthread_mutex_unlock(&g_gsa->mags_lock);
+}
+
+int zus_slab_get_class_stats(int slab_index, struct zus_slab_class_stats *zcs)
+{
+	int cpu;
+
+	if (unlikely(!g_gsa || _slab_check_list_index(slab_index)))
+		return -EINVAL;
+
+	memset(zcs, 0, sizeof(*zcs));
+	zcs->size = _slab_class_size(slab_index);
+	zcs->span_size = PAGE_SIZE << g_slab_order[slab_index];
+	for (cpu = 0; cpu < g_gsa->nslabs; ++cpu) {
+		struct zus_slab *slab = &g_gsa->slab[cpu];
+		struct zus_slab_list *slab_list = &slab->list[slab_index];
+
+		_slab_lock(slab);
+		zcs->nspans += slab_list->nspans;
+		zcs->nused += slab_list->nused;
+		zcs->nfree += slab_list->nfree;
+		_slab_unlock(slab);
+	}
+	return 0;
 }
 
 static size_t __elem_size(void *addr)
@@ -459,9 +774,126 @@ static size_t __elem_size(void *addr)
 	int slab_index = _page_slab_index(page);
 
 	if (unlikely(_slab_check_list_index(slab_index)))
-		return -EINVAL;
+		return 0;
+
+	return _slab_class_size(slab_index);
+}
+
+/* ~~~~~ large and huge objects ~~~~~ */
+
+/* Objects above ZUS_BLOCK_SIZE are whole pa pages up to ZUS_LARGE_MAX_SIZE,
+ * beyond that each gets a dedicated fba chunk. Either way they come from
+ * mlocked DONTDUMP memory, like the slabs, and never from glibc.
+ */
+
+/* Page meta of a large object's first page, or'ed with its order. Never a
+ * valid slab meta, see _page_set_slab
+ */
+#define ZUS_LARGE_META		0x100
+
+struct zus_huge {
+	struct a_list_head list;
+	struct fba fba;
+};
+
+static bool _page_is_large(struct pa_page *page)
+{
+	return (_pa_page_meta(page) & ZUS_LARGE_META) != 0;
+}
+
+static int _page_large_order(struct pa_page *page)
+{
+	return _pa_page_meta(page) & ~ZUS_LARGE_META;
+}
+
+static void *_large_alloc(size_t size)
+{
+	int order = 64 - __builtin_clzl((size - 1) >> PAGE_SHIFT);
+	struct pa_page *page;
+
+	page = pa_alloc_order(&g_gsa->sbi, order);
+	if (unlikely(!page))
+		return NULL;
+
+	_pa_page_meta_set(page, ZUS_LARGE_META | order);
+	return pa_page_address(&g_gsa->sbi, page);
+}
+
+static void _large_free(struct pa_page *page)
+{
+	int i, npages = 1 << _page_large_order(page);
+
+	_pa_page_meta_set(page, 0);
+	for (i = 0; i < npages; ++i)
+		pa_put_page(page + i);
+}
+
+static void *_huge_alloc(size_t size)
+{
+	bool huge = (size >= ZUS_HUGE_ALIGN);
+	struct zus_huge *zh;
+	int err;
+
+	zh = zus_malloc(sizeof(*zh));
+	if (unlikely(!zh))
+		return NULL;
+
+	/* Only a chunk of at least 2M is worth huge pages */
+	size = ALIGN(size, huge ? ZUS_HUGE_ALIGN : PAGE_SIZE);
+	err = fba_alloc_align(&zh->fba, size, huge);
+	if (unlikely(err)) {
+		DBG("fba_alloc_align size=0x%lx => %d\n", size, err);
+		zus_free(zh);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&g_gsa->huge_lock);
+	a_list_add(&zh->list, &g_gsa->huge);
+	pthread_mutex_unlock(&g_gsa->huge_lock);
+
+	return zh->fba.ptr;
+}
+
+/* Returns the chunk of @ptr, unlinked if @take */
+static struct zus_huge *_huge_find(void *ptr, bool take)
+{
+	struct zus_huge *zh, *found = NULL;
 
-	return 1 << (slab_index + ZUS_MIN_SLAB_SHIFT);
+	pthread_mutex_lock(&g_gsa->huge_lock);
+	a_list_for_each_entry(zh, &g_gsa->huge, list) {
+		if (zh->fba.ptr == ptr) {
+			found = zh;
+			break;
+		}
+	}
+	if (found && take)
+		a_list_del(&found->list);
+	pthread_mutex_unlock(&g_gsa->huge_lock);
+
+	return found;
+}
+
+static void _huge_free(struct zus_huge *zh)
+{
+	fba_free(&zh->fba);
+	zus_free(zh);
+}
+
+/* Returns 0 if @ptr is not ours */
+static size_t _zus_usable_size(void *ptr)
+{
+	struct pa_page *page;
+	struct zus_huge *zh;
+
+	if (!__pa_addr_inrange(&g_gsa->sbi, ptr)) {
+		zh = _huge_find(ptr, false);
+		return zh ? zh->fba.size : 0;
+	}
+
+	page = pa_virt_to_page(&g_gsa->sbi, ptr);
+	if (_page_is_large(page))
+		return PAGE_SIZE << _page_large_order(page);
+	return __elem_size(ptr);
 }
 
 /* ~~~~~ malloc/free wrappers ~~~~~ */
@@ -476,60 +908,70 @@ void *zus_malloc(size_t size)
 	if (unlikely(!size))
 		return NULL;
 
-	if (!_slab_size_valid(size))
-		return malloc(size);
-
-	ptr = _zus_gsa_malloc(size);
-	if (unlikely(!ptr)) {
-		/* TODO(sagi): remove this code once we move to 128MB chunks */
-		int err;
-
-		/* exhausted slab: fallback to malloc + force cache-line align */
-		err = posix_memalign(&ptr, CACHELINE_SIZE, size);
-		if (unlikely(err))
-			return NULL;
+	if (_slab_size_valid(size)) {
+		ptr = _zus_gsa_malloc(size);
+		if (unlikely(!ptr))
+			DBG("slab exhausted size=0x%lx\n", size);
+		return ptr;
 	}
 
-	return ptr;
+	if (size <= ZUS_LARGE_MAX_SIZE) {
+		ptr = _large_alloc(size);
+		if (likely(ptr))
+			return ptr;
+	}
+	return _huge_alloc(size);
 }
 
 void zus_free(void *ptr)
 {
+	struct pa_page *page;
+	struct zus_huge *zh;
+
 	if (unlikely(!g_gsa))
 		return;
 
 	if (unlikely(!ptr))
 		return;
 
-	if (_zus_gsa_cpu_of(ptr) < 0) {
-		free(ptr);
+	if (!__pa_addr_inrange(&g_gsa->sbi, ptr)) {
+		zh = _huge_find(ptr, true);
+		if (ZUS_WARN_ON(!zh))
+			return;
+		_huge_free(zh);
 		return;
 	}
-	_zus_gsa_free(ptr);
+
+	page = pa_virt_to_page(&g_gsa->sbi, ptr);
+	if (_page_is_large(page))
+		_large_free(page);
+	else
+		_zus_gsa_free(ptr);
 }
 
 void *zus_calloc(size_t nmemb, size_t elemsz)
 {
-	size_t size = nmemb * elemsz;
+	size_t size;
 	void *ptr;
 
-	if (unlikely(!g_gsa))
+	/* As glibc's calloc, which used to get the large sizes */
+	if (unlikely(__builtin_mul_overflow(nmemb, elemsz, &size)))
 		return NULL;
 
-	if (!_slab_size_valid(size))
-		return calloc(nmemb, elemsz);
-
 	ptr = zus_malloc(size);
 	if (unlikely(!ptr))
 		return NULL;
 
-	memset(ptr, 0, size);
+	/* pa pages are recycled unpunched, only fresh fba chunks read 0 */
+	if (size <= ZUS_LARGE_MAX_SIZE)
+		memset(ptr, 0, size);
 
 	return ptr;
 }
 
 void *zus_realloc(void *ptr, size_t size)
 {
+	size_t oldsize;
 	void *newptr;
 
 	if (unlikely(!g_gsa))
@@ -543,19 +985,17 @@ void *zus_realloc(void *ptr, size_t size)
 		return NULL;
 	}
 
-	if (_zus_gsa_cpu_of(ptr) < 0) {
-		if (!_slab_size_valid(size))
-			return realloc(ptr, size);
-	} else {
-		if (size <= __elem_size(ptr))
-			return ptr;
-	}
+	oldsize = _zus_usable_size(ptr);
+	if (ZUS_WARN_ON(!oldsize))
+		return NULL;
+	if (size <= oldsize)
+		return ptr;
 
 	newptr = zus_malloc(size);
 	if (unlikely(!newptr))
 		return NULL;
 
-	memcpy(newptr, ptr, __elem_size(ptr));
+	memcpy(newptr, ptr, oldsize);
 	zus_free(ptr);
 
 	return newptr;
@@ -574,14 +1014,7 @@ struct pa_page *zus_alloc_page(int mask)
 
 void zus_free_page(struct pa_page *page)
 {
-	int cpu = _page_slab_cpu(page);
-	struct zus_slab *slab;
-
-	if (ZUS_WARN_ON(cpu < 0))
-		return;
-
-	slab = _slab_of_cpu(cpu);
-	_slab_free(slab, pa_page_address(slab->sbi, page));
+	_zus_gsa_free(pa_page_address(&g_gsa->sbi, page));
 }
 
 void *zus_page_address(struct pa_page *page)
@@ -620,7 +1053,12 @@ int zus_slab_init(void)
 	}
 	memset(gsa, 0, size);
 
+	_slab_classes_init();
 	gsa->nslabs = nprocs;
+	pthread_mutex_init(&gsa->mags_lock, NULL);
+	a_list_init(&gsa->mags);
+	pthread_mutex_init(&gsa->huge_lock, NULL);
+	a_list_init(&gsa->huge);
 	for (cpu = 0; cpu < nprocs; ++cpu) {
 		err = pthread_spin_init(&gsa->slab[cpu].lock, pshared);
 		if (unlikely(err)) {
@@ -634,6 +1072,12 @@ int zus_slab_init(void)
 		ERROR("pa_init => %d\n", err);
 		goto fail;
 	}
+	err = pthread_key_create(&g_mag_key, _mag_destructor);
+	if (unlikely(err)) {
+		ERROR("pthread_key_create => %d\n", err);
+		pa_fini(&gsa->sbi);
+		goto fail;
+	}
 	g_gsa = gsa;
 	return 0;
 
@@ -650,13 +1094,44 @@ void zus_slab_fini(void)
 	if (unlikely(!gsa))
 		return;
 
+	while (!a_list_empty(&gsa->huge)) {
+		struct zus_huge *zh = a_list_first_entry(&gsa->huge,
+							 struct zus_huge, list);
+
+		ERROR("huge leak ptr=%p size=0x%lx\n", zh->fba.ptr,
+		      zh->fba.size);
+		a_list_del(&zh->list);
+		_huge_free(zh);
+	}
+
+	/* Other threads flushed theirs on exit */
+	if (tl_mag) {
+		_mag_flush_all(tl_mag);
+		_mag_remote_flush_all(tl_mag);
+		_mag_unlink(tl_mag);
+		free(tl_mag);
+		tl_mag = NULL;
+	}
+	pthread_key_delete(g_mag_key);
+
 	g_gsa = NULL;
 	for (cpu = 0; cpu < gsa->nslabs; ++cpu) {
+		struct zus_slab *slab = &gsa->slab[cpu];
+		struct zus_slab_elem *se = _slab_remote_take(slab);
+
+		while (se) {
+			struct zus_slab_elem *next = (void *)se->list.next;
+
+			_slab_put_elem(slab, se);
+			se = next;
+		}
 		_slab_fini(&gsa->slab[cpu]);
 		err = pthread_spin_destroy(&gsa->slab[cpu].lock);
 		if (unlikely(err))
 			ERROR("pthread_spin_destroy => %d\n", err);
 	}
 	pa_fini(&gsa->sbi);
+	pthread_mutex_destroy(&gsa->mags_lock);
+	pthread_mutex_destroy(&gsa->huge_lock);
 	free(gsa);
 }
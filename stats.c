@@ -0,0 +1,414 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * stats.c - Per-operation latency statistics of zus_do_command
+ *
+ * Every thread which dispatches operations (ZTs) records into a private
+ * block of per-operation counters and log-linear latency histograms, so
+ * recording takes no locks and shares no cache lines. Blocks are linked
+ * on a global list only once, at a thread's first operation, and are
+ * never unlinked so their counts outlive the thread. When a thread exits
+ * its block is handed to the next new thread, which keeps adding to it.
+ * So ZTs stopped and started again by every mount take no new memory.
+ * A dump (or reset) request, e.g. from a signal handler, is handed over to
+ * a stats thread which merges all blocks and writes them to the stats file.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "zus.h"
+
+/* Histogram buckets: values below 4 are exact, above that each power of
+ * two is split into 4 sub-buckets, so any value is within 25% of its
+ * bucket's lower bound. 256 buckets cover the whole 64-bit range.
+ */
+#define ZS_SUB_BITS	2
+#define ZS_SUBS		(1 << ZS_SUB_BITS)
+#define ZS_NBUCKETS	256
+
+#define ZS_DEF_PATH	"/dev/shm/zusd.stats"
+
+struct zs_op {
+	ulong count;
+	ulong sum;	/* In ticks */
+	ulong max;	/* In ticks */
+	ulong hist[ZS_NBUCKETS];
+};
+
+struct zs_block {
+	struct zs_block *next;
+	struct zs_block *next_orphan;
+	ulong gen;		/* Matches g_zs.gen unless a reset is due */
+	ulong tid;
+	struct zs_op ops[ZUFS_OP_MAX_OPT];
+};
+
+static struct _zus_stats {
+	bool enabled;
+	bool stop;
+	bool want_reset;
+	ulong gen;
+	double ns_per_tick;
+	const char *path;
+	struct zs_block *blocks;
+	struct zs_block *orphans;	/* Of exited threads */
+	pthread_key_t key;
+	pthread_mutex_t lock;
+	sem_t kick;
+	pthread_t thread;
+} g_zs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static __thread struct zs_block *tl_zs;
+
+bool zus_stats_enabled(void)
+{
+	return g_zs.enabled;
+}
+
+ulong zus_stats_now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+#endif
+}
+
+static ulong _mono_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+/* Measures ticks of zus_stats_now() against CLOCK_MONOTONIC for ~10ms */
+static void _calibrate(void)
+{
+	struct timespec nap = { .tv_sec = 0, .tv_nsec = 10 * 1000 * 1000 };
+	ulong t0, n0, t1, n1;
+
+	t0 = zus_stats_now();
+	n0 = _mono_ns();
+	nanosleep(&nap, NULL);
+	t1 = zus_stats_now();
+	n1 = _mono_ns();
+
+	g_zs.ns_per_tick = (t1 > t0) ? (double)(n1 - n0) / (t1 - t0) : 1.0;
+}
+
+static uint _bucket_of(ulong v)
+{
+	uint msb;
+
+	if (v < ZS_SUBS)
+		return v;
+
+	msb = 63 - __builtin_clzl(v);
+	return (msb - ZS_SUB_BITS + 1) * ZS_SUBS +
+	       ((v >> (msb - ZS_SUB_BITS)) & (ZS_SUBS - 1));
+}
+
+static ulong _bucket_low(uint b)
+{
+	uint msb;
+
+	if (b < ZS_SUBS)
+		return b;
+
+	msb = b / ZS_SUBS + ZS_SUB_BITS - 1;
+	return (ulong)(ZS_SUBS + b % ZS_SUBS) << (msb - ZS_SUB_BITS);
+}
+
+/* pthread_key destructor, at exit of a thread that recorded */
+static void _block_orphan(void *arg)
+{
+	struct zs_block *zsb = arg;
+
+	pthread_mutex_lock(&g_zs.lock);
+	zsb->next_orphan = g_zs.orphans;
+	g_zs.orphans = zsb;
+	pthread_mutex_unlock(&g_zs.lock);
+}
+
+/* Adopts the block of an exited thread if any, else links a new one */
+static struct zs_block *_block_new(void)
+{
+	struct zs_block *zsb;
+
+	pthread_mutex_lock(&g_zs.lock);
+	zsb = g_zs.orphans;
+	if (zsb)
+		g_zs.orphans = zsb->next_orphan;
+	pthread_mutex_unlock(&g_zs.lock);
+
+	if (!zsb) {
+		zsb = calloc(1, sizeof(*zsb));
+		if (unlikely(!zsb))
+			return NULL;
+
+		pthread_mutex_lock(&g_zs.lock);
+		zsb->gen = g_zs.gen;
+		zsb->next = g_zs.blocks;
+		g_zs.blocks = zsb;
+		pthread_mutex_unlock(&g_zs.lock);
+	}
+
+	zsb->tid = zus_thread_self();
+	pthread_setspecific(g_zs.key, zsb);
+	tl_zs = zsb;
+	return zsb;
+}
+
+static struct zs_block *_block_get(void)
+{
+	struct zs_block *zsb = tl_zs;
+
+	if (unlikely(!zsb)) {
+		zsb = _block_new();
+		if (unlikely(!zsb))
+			return NULL;
+	}
+
+	if (unlikely(zsb->gen != __atomic_load_n(&g_zs.gen,
+						 __ATOMIC_RELAXED))) {
+		memset(zsb->ops, 0, sizeof(zsb->ops));
+		zsb->gen = g_zs.gen;
+	}
+	return zsb;
+}
+
+void zus_stats_record(uint op, ulong start)
+{
+	ulong ticks = zus_stats_now() - start;
+	struct zs_block *zsb;
+	struct zs_op *zso;
+
+	if (unlikely(op >= ZUFS_OP_MAX_OPT))
+		return;
+
+	zsb = _block_get();
+	if (unlikely(!zsb))
+		return;
+
+	zso = &zsb->ops[op];
+	zso->count++;
+	zso->sum += ticks;
+	if (ticks > zso->max)
+		zso->max = ticks;
+	zso->hist[_bucket_of(ticks)]++;
+}
+
+/* ~~~ dump ~~~ */
+
+static ulong _percentile(const struct zs_op *zso, uint permil)
+{
+	ulong want = (zso->count * permil + 9999) / 10000;
+	ulong seen = 0;
+	uint b;
+
+	for (b = 0; b < ZS_NBUCKETS; ++b) {
+		seen += zso->hist[b];
+		if (seen >= want)
+			return _bucket_low(b);
+	}
+	return zso->max;
+}
+
+static void _merge(struct zs_op *ops)
+{
+	struct zs_block *zsb;
+	uint op, b;
+
+	memset(ops, 0, sizeof(*ops) * ZUFS_OP_MAX_OPT);
+
+	pthread_mutex_lock(&g_zs.lock);
+	for (zsb = g_zs.blocks; zsb; zsb = zsb->next) {
+		if (zsb->gen != g_zs.gen)
+			continue; /* Owner did not clear it yet */
+		for (op = 0; op < ZUFS_OP_MAX_OPT; ++op) {
+			const struct zs_op *src = &zsb->ops[op];
+
+			if (!src->count)
+				continue;
+			ops[op].count += src->count;
+			ops[op].sum += src->sum;
+			if (src->max > ops[op].max)
+				ops[op].max = src->max;
+			for (b = 0; b < ZS_NBUCKETS; ++b)
+				ops[op].hist[b] += src->hist[b];
+		}
+	}
+	pthread_mutex_unlock(&g_zs.lock);
+}
+
+static void _dump_slab(FILE *fp)
+{
+	struct zus_slab_class_stats zcs;
+	struct zus_slab_stats zss;
+	ulong frees;
+	int i;
+
+	zus_slab_get_stats(&zss);
+	frees = zss.local_frees + zss.remote_frees;
+	if (frees)
+		fprintf(fp, "# slab: local_frees=%lu remote_frees=%lu (%.1f%%) "
+			"remote_batches=%lu\n", zss.local_frees,
+			zss.remote_frees, 100.0 * zss.remote_frees / frees,
+			zss.remote_batches);
+
+	/* Occupancy: bytes handed out of the bytes held in spans */
+	for (i = 0; !zus_slab_get_class_stats(i, &zcs); ++i) {
+		if (!zcs.nspans)
+			continue;
+		fprintf(fp, "# slab class %6zu: span=%zu spans=%lu used=%lu "
+			"free=%lu occupancy=%.1f%%\n", zcs.size, zcs.span_size,
+			zcs.nspans, zcs.nused, zcs.nfree,
+			100.0 * zcs.nused * zcs.size /
+			(zcs.nspans * zcs.span_size));
+	}
+}
+
+static void _dump(void)
+{
+	const double npt = g_zs.ns_per_tick;
+	struct zs_op *ops;
+	FILE *fp;
+	uint op;
+
+	/* Too big for the stack or a static, see -Wlarger-than */
+	ops = calloc(ZUFS_OP_MAX_OPT, sizeof(*ops));
+	if (unlikely(!ops)) {
+		ERROR("stats: no memory to merge into\n");
+		return;
+	}
+	_merge(ops);
+
+	fp = fopen(g_zs.path, "w");
+	if (!fp) {
+		ERROR("stats: fopen(%s) => %d\n", g_zs.path, errno);
+		free(ops);
+		return;
+	}
+
+	fprintf(fp, "%-24s %12s %10s %10s %10s %10s %10s %12s\n",
+		"# op", "count", "avg_ns", "p50_ns", "p90_ns", "p99_ns",
+		"p99.9_ns", "max_ns");
+	for (op = 0; op < ZUFS_OP_MAX_OPT; ++op) {
+		const struct zs_op *zso = &ops[op];
+
+		if (!zso->count)
+			continue;
+		fprintf(fp, "%-24s %12lu %10.0f %10.0f %10.0f %10.0f %10.0f "
+			"%12.0f\n", ZUFS_OP_name(op), zso->count,
+			npt * zso->sum / zso->count,
+			npt * _percentile(zso, 5000),
+			npt * _percentile(zso, 9000),
+			npt * _percentile(zso, 9900),
+			npt * _percentile(zso, 9990),
+			npt * zso->max);
+	}
+	_dump_slab(fp);
+	fclose(fp);
+	free(ops);
+}
+
+static void *_stats_thread(void *arg)
+{
+	while (!g_zs.stop) {
+		if (sem_wait(&g_zs.kick))
+			continue; /* EINTR */
+		if (g_zs.stop)
+			break;
+
+		_dump();
+		if (__atomic_exchange_n(&g_zs.want_reset, false,
+					__ATOMIC_ACQ_REL)) {
+			/* Each owner clears its own block on next record */
+			__atomic_add_fetch(&g_zs.gen, 1, __ATOMIC_RELEASE);
+		}
+	}
+	return NULL;
+}
+
+/* Async-signal safe */
+void zus_stats_kick(bool reset)
+{
+	if (!g_zs.enabled)
+		return;
+	if (reset)
+		__atomic_store_n(&g_zs.want_reset, true, __ATOMIC_RELEASE);
+	sem_post(&g_zs.kick);
+}
+
+int zus_stats_init(const char *path)
+{
+	struct zus_thread_params tp;
+	int err;
+
+	g_zs.path = path ?: ZS_DEF_PATH;
+	_calibrate();
+
+	err = pthread_key_create(&g_zs.key, _block_orphan);
+	if (unlikely(err)) {
+		ERROR("pthread_key_create => %d\n", err);
+		return -err;
+	}
+	sem_init(&g_zs.kick, 0, 0);
+
+	ZTP_INIT(&tp);
+	tp.name = "zus_stats";
+	err = zus_thread_create(&g_zs.thread, &tp, _stats_thread, NULL);
+	if (unlikely(err)) {
+		ERROR("zus_thread_create => %d\n", err);
+		sem_destroy(&g_zs.kick);
+		pthread_key_delete(g_zs.key);
+		return err;
+	}
+
+	g_zs.enabled = true;
+	INFO("stats: kill -USR2 to dump into %s (sigqueue 1 to also reset)\n",
+	     g_zs.path);
+	return 0;
+}
+
+void zus_stats_fini(void)
+{
+	struct zs_block *zsb;
+	void *tret;
+
+	if (!g_zs.enabled)
+		return;
+
+	g_zs.enabled = false;
+	g_zs.stop = true;
+	sem_post(&g_zs.kick);
+	pthread_join(g_zs.thread, &tret);
+	sem_destroy(&g_zs.kick);
+
+	/* Only at exit, ZTs are all gone by now */
+	pthread_key_delete(g_zs.key);
+	g_zs.orphans = NULL;
+	while ((zsb = g_zs.blocks)) {
+		g_zs.blocks = zsb->next;
+		free(zsb);
+	}
+}
@@ -0,0 +1,436 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * t2cache.c - A cache of T2 blocks in pa pages, per sbi
+ *
+ * An FS which keeps metadata on T2 opts in by calling zus_t2cache_init from
+ * its sbi_init, it is torn down (and written back) by zus at umount.
+ * zus_t2cache_get returns the block's page pinned, read from T2 on a miss.
+ * A miss where the previous one's read-ahead ended is taken as a sequential
+ * stream and also reads ahead a window, doubling from T2C_RA_MIN to
+ * T2C_RA_MAX blocks, all in the same crossing.
+ * Blocks changed in place are marked with zus_t2cache_dirty, and written
+ * back together by zus_t2cache_sync. Eviction is CLOCK, over unpinned clean
+ * blocks, when more than @max_pages are cached.
+ *
+ * Copyright (c) 2019 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "zus.h"
+#include "iom_enc.h"
+
+#define T2C_HASH_MIN	64
+#define T2C_RA_MIN	4
+#define T2C_RA_MAX	64
+
+enum {
+	T2C_UPTODATE	= 1 << 0,
+	T2C_DIRTY	= 1 << 1,
+	T2C_WRITEBACK	= 1 << 2,
+	T2C_REF		= 1 << 3,	/* Used since the hand passed it */
+	T2C_GONE	= 1 << 4,	/* Off the cache, freed at last unpin */
+};
+
+struct t2c_entry {
+	struct a_list_head hash;
+	struct a_list_head clock;
+	ulong bn;
+	struct pa_page *page;
+	int pins;
+	int err;
+	uint flags;
+};
+
+struct zus_t2cache {
+	struct zus_sb_info *sbi;
+	pthread_mutex_t lock;
+	pthread_cond_t io_done;		/* Of a read, see T2C_UPTODATE */
+	pthread_mutex_t sync_lock;	/* One write-back at a time */
+	struct a_list_head *hash;
+	ulong hash_mask;
+	struct a_list_head clock;	/* The hand is at its head */
+	ulong nr;
+	ulong max;
+	ulong ndirty;
+	ulong ra_next;			/* Past the last read-ahead */
+	uint ra_pages;
+};
+
+static struct a_list_head *_t2c_bucket(struct zus_t2cache *t2c, ulong bn)
+{
+	return &t2c->hash[(bn * 0x9E3779B97F4A7C15UL >> 32) & t2c->hash_mask];
+}
+
+static struct t2c_entry *_t2c_find(struct zus_t2cache *t2c, ulong bn)
+{
+	struct t2c_entry *e;
+
+	a_list_for_each_entry(e, _t2c_bucket(t2c, bn), hash) {
+		if (e->bn == bn)
+			return e;
+	}
+	return NULL;
+}
+
+static void _t2c_free(struct t2c_entry *e)
+{
+	zus_free_page(e->page);
+	free(e);
+}
+
+/* Takes @e off the cache, it is freed now or at its last unpin */
+static void _t2c_remove(struct zus_t2cache *t2c, struct t2c_entry *e)
+{
+	a_list_del_init(&e->hash);
+	a_list_del_init(&e->clock);
+	--t2c->nr;
+	if (e->flags & T2C_DIRTY)
+		--t2c->ndirty;
+	e->flags = (e->flags & ~T2C_DIRTY) | T2C_GONE;
+	if (!e->pins)
+		_t2c_free(e);
+}
+
+static void _t2c_unpin(struct t2c_entry *e)
+{
+	if (!--e->pins && (e->flags & T2C_GONE))
+		_t2c_free(e);
+}
+
+static bool _t2c_evict_one(struct zus_t2cache *t2c)
+{
+	struct t2c_entry *e;
+	ulong n;
+
+	/* Two turns at most, the first may only clear T2C_REF bits */
+	for (n = 0; n < 2 * t2c->nr; ++n) {
+		e = a_list_first_entry(&t2c->clock, struct t2c_entry, clock);
+		if (!e->pins && !(e->flags & (T2C_DIRTY | T2C_WRITEBACK)) &&
+		    !(e->flags & T2C_REF)) {
+			_t2c_remove(t2c, e);
+			return true;
+		}
+		e->flags &= ~T2C_REF;
+		a_list_del(&e->clock);
+		a_list_add_tail(&e->clock, &t2c->clock);
+	}
+	return false;
+}
+
+/* A pinned entry, not uptodate yet. Called with @t2c->lock held */
+static struct t2c_entry *_t2c_new(struct zus_t2cache *t2c, ulong bn)
+{
+	struct t2c_entry *e;
+
+	/* All pinned or dirty, go above @max until they are not */
+	if (t2c->nr >= t2c->max)
+		_t2c_evict_one(t2c);
+
+	e = calloc(1, sizeof(*e));
+	if (unlikely(!e))
+		return NULL;
+	e->page = zus_alloc_page(0);
+	if (unlikely(!e->page)) {
+		free(e);
+		return NULL;
+	}
+
+	e->bn = bn;
+	e->pins = 1;
+	a_list_add(&e->hash, _t2c_bucket(t2c, bn));
+	/* Just behind the hand */
+	a_list_add_tail(&e->clock, &t2c->clock);
+	++t2c->nr;
+	return e;
+}
+
+/* Adds read-ahead entries after @bn to @io, returns how many */
+static uint _t2c_readahead(struct zus_t2cache *t2c, ulong bn,
+			   struct t2c_entry **io)
+{
+	ulong end = md_t2_blocks(&t2c->sbi->md);
+	uint i, n = 0;
+
+	if (bn != t2c->ra_next) {
+		/* Not sequential, start over */
+		t2c->ra_pages = 0;
+		t2c->ra_next = bn + 1;
+		return 0;
+	}
+
+	t2c->ra_pages = t2c->ra_pages ? t2c->ra_pages * 2 : T2C_RA_MIN;
+	if (t2c->ra_pages > T2C_RA_MAX)
+		t2c->ra_pages = T2C_RA_MAX;
+
+	for (i = 1; i <= t2c->ra_pages && bn + i < end; ++i) {
+		if (_t2c_find(t2c, bn + i))
+			continue;
+		io[n] = _t2c_new(t2c, bn + i);
+		if (unlikely(!io[n]))
+			break;
+		++n;
+	}
+	t2c->ra_next = bn + i;
+	return n;
+}
+
+/* Reads @io from T2 in one crossing. Called with @t2c->lock held, which is
+ * dropped meanwhile. @io are all pinned once, which is dropped for all but
+ * the first, the one asked for.
+ */
+static int _t2c_read(struct zus_t2cache *t2c, struct t2c_entry **io, uint n)
+{
+	struct zus_t2_batch t2b;
+	int err = 0;
+	uint i;
+
+	pthread_mutex_unlock(&t2c->lock);
+
+	zus_t2_batch_start(&t2b, t2c->sbi, NULL, true);
+	for (i = 0; i < n && !err; ++i)
+		err = zus_t2_batch_read(&t2b, io[i]->bn,
+					zus_page_address(io[i]->page),
+					PAGE_SIZE);
+	err = zus_t2_batch_submit(&t2b) ?: err;
+
+	pthread_mutex_lock(&t2c->lock);
+	for (i = 0; i < n; ++i) {
+		struct t2c_entry *e = io[i];
+
+		if (unlikely(err)) {
+			e->err = err;
+			_t2c_remove(t2c, e);
+		} else {
+			e->flags |= T2C_UPTODATE;
+		}
+		if (i)
+			_t2c_unpin(e);
+	}
+	pthread_cond_broadcast(&t2c->io_done);
+	return err;
+}
+
+int zus_t2cache_get(struct zus_sb_info *sbi, ulong bn, void **addr)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry *io[T2C_RA_MAX + 1];
+	struct t2c_entry *e;
+	int err = 0;
+	uint n;
+
+	if (ZUS_WARN_ON(!t2c))
+		return -EINVAL;
+
+	pthread_mutex_lock(&t2c->lock);
+	e = _t2c_find(t2c, bn);
+	if (e) {
+		++e->pins;
+		e->flags |= T2C_REF;
+		while (!(e->flags & (T2C_UPTODATE | T2C_GONE)))
+			pthread_cond_wait(&t2c->io_done, &t2c->lock);
+		if (unlikely(e->flags & T2C_GONE)) {
+			err = e->err ?: -EIO;
+			_t2c_unpin(e);
+		}
+		goto out;
+	}
+
+	e = _t2c_new(t2c, bn);
+	if (unlikely(!e)) {
+		err = -ENOMEM;
+		goto out;
+	}
+	io[0] = e;
+	n = 1 + _t2c_readahead(t2c, bn, io + 1);
+
+	err = _t2c_read(t2c, io, n);
+	if (unlikely(err))
+		_t2c_unpin(e);
+
+out:
+	pthread_mutex_unlock(&t2c->lock);
+	if (likely(!err))
+		*addr = zus_page_address(e->page);
+	return err;
+}
+
+static struct t2c_entry *_t2c_pinned(struct zus_t2cache *t2c, ulong bn)
+{
+	struct t2c_entry *e = _t2c_find(t2c, bn);
+
+	if (ZUS_WARN_ON(!e || !e->pins)) {
+		ERROR("bn=0x%lx is not pinned\n", bn);
+		return NULL;
+	}
+	return e;
+}
+
+void zus_t2cache_put(struct zus_sb_info *sbi, ulong bn)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry *e;
+
+	pthread_mutex_lock(&t2c->lock);
+	e = _t2c_pinned(t2c, bn);
+	if (e)
+		_t2c_unpin(e);
+	pthread_mutex_unlock(&t2c->lock);
+}
+
+/* @bn must be pinned while it is changed and marked */
+void zus_t2cache_dirty(struct zus_sb_info *sbi, ulong bn)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry *e;
+
+	pthread_mutex_lock(&t2c->lock);
+	e = _t2c_pinned(t2c, bn);
+	if (e && !(e->flags & T2C_DIRTY)) {
+		e->flags |= T2C_DIRTY;
+		++t2c->ndirty;
+	}
+	pthread_mutex_unlock(&t2c->lock);
+}
+
+/* Drops @bn, dirty or not, e.g. when the FS frees it */
+void zus_t2cache_forget(struct zus_sb_info *sbi, ulong bn)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry *e;
+
+	pthread_mutex_lock(&t2c->lock);
+	e = _t2c_find(t2c, bn);
+	if (e && (e->flags & T2C_UPTODATE))
+		_t2c_remove(t2c, e);
+	pthread_mutex_unlock(&t2c->lock);
+}
+
+/* Writes back all dirty blocks, as few crossings as the exec buffers allow.
+ * A block dirtied again meanwhile stays dirty for the next sync.
+ */
+int zus_t2cache_sync(struct zus_sb_info *sbi)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry **wb, *e;
+	struct zus_t2_batch t2b;
+	ulong i, n = 0;
+	int err = 0;
+
+	if (!t2c)
+		return 0;
+
+	pthread_mutex_lock(&t2c->sync_lock);
+	pthread_mutex_lock(&t2c->lock);
+	if (!t2c->ndirty)
+		goto out_unlock;
+
+	wb = malloc(t2c->ndirty * sizeof(*wb));
+	if (unlikely(!wb)) {
+		err = -ENOMEM;
+		goto out_unlock;
+	}
+	a_list_for_each_entry(e, &t2c->clock, clock) {
+		if (!(e->flags & T2C_DIRTY))
+			continue;
+		e->flags = (e->flags & ~T2C_DIRTY) | T2C_WRITEBACK;
+		++e->pins;
+		wb[n++] = e;
+	}
+	t2c->ndirty = 0;
+	pthread_mutex_unlock(&t2c->lock);
+
+	zus_t2_batch_start(&t2b, sbi, NULL, true);
+	for (i = 0; i < n && !err; ++i)
+		err = zus_t2_batch_write(&t2b, wb[i]->bn,
+					 zus_page_address(wb[i]->page),
+					 PAGE_SIZE);
+	err = zus_t2_batch_submit(&t2b) ?: err;
+
+	pthread_mutex_lock(&t2c->lock);
+	for (i = 0; i < n; ++i) {
+		e = wb[i];
+		e->flags &= ~T2C_WRITEBACK;
+		if (unlikely(err) && !(e->flags & (T2C_DIRTY | T2C_GONE))) {
+			e->flags |= T2C_DIRTY;
+			++t2c->ndirty;
+		}
+		_t2c_unpin(e);
+	}
+	free(wb);
+
+out_unlock:
+	pthread_mutex_unlock(&t2c->lock);
+	pthread_mutex_unlock(&t2c->sync_lock);
+	return err;
+}
+
+int zus_t2cache_init(struct zus_sb_info *sbi, ulong max_pages)
+{
+	struct zus_t2cache *t2c;
+	ulong i, nhash = T2C_HASH_MIN;
+
+	if (ZUS_WARN_ON(sbi->t2c || !max_pages))
+		return -EINVAL;
+
+	t2c = calloc(1, sizeof(*t2c));
+	if (unlikely(!t2c))
+		return -ENOMEM;
+
+	while (nhash < max_pages / 2)
+		nhash *= 2;
+	t2c->hash = calloc(nhash, sizeof(*t2c->hash));
+	if (unlikely(!t2c->hash)) {
+		free(t2c);
+		return -ENOMEM;
+	}
+	for (i = 0; i < nhash; ++i)
+		a_list_init(&t2c->hash[i]);
+	t2c->hash_mask = nhash - 1;
+
+	a_list_init(&t2c->clock);
+	pthread_mutex_init(&t2c->lock, NULL);
+	pthread_mutex_init(&t2c->sync_lock, NULL);
+	pthread_cond_init(&t2c->io_done, NULL);
+	t2c->sbi = sbi;
+	t2c->max = max_pages;
+	t2c->ra_next = ~0UL;
+
+	sbi->t2c = t2c;
+	return 0;
+}
+
+void zus_t2cache_fini(struct zus_sb_info *sbi)
+{
+	struct zus_t2cache *t2c = sbi->t2c;
+	struct t2c_entry *e;
+	int err;
+
+	if (!t2c)
+		return;
+
+	err = zus_t2cache_sync(sbi);
+	if (unlikely(err))
+		ERROR("t2cache: write-back at umount => %d\n", err);
+
+	while (!a_list_empty(&t2c->clock)) {
+		e = a_list_first_entry(&t2c->clock, struct t2c_entry, clock);
+		if (unlikely(e->pins))
+			ERROR("t2cache: bn=0x%lx still pinned\n", e->bn);
+		e->pins = 0;
+		_t2c_remove(t2c, e);
+	}
+
+	pthread_cond_destroy(&t2c->io_done);
+	pthread_mutex_destroy(&t2c->sync_lock);
+	pthread_mutex_destroy(&t2c->lock);
+	free(t2c->hash);
+	free(t2c);
+	sbi->t2c = NULL;
+}
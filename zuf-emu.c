@@ -0,0 +1,981 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+/*
+ * zuf-emu.c - In-process stand-in for the zuf Kernel module
+ *
+ * Once zuf_emu_start() is called, zuf-root files are plain tmpfs files and
+ * the zuf_call.h ioctls are served here, so the mount thread, ZTs and FSs
+ * run unmodified without the Kernel:
+ *  - ZU_IOC_NUMA_MAP is built from sysfs.
+ *  - ZU_IOC_MOUNT hands the mount thread requests of zuf_emu_mount/umount.
+ *  - ZU_IOC_GRAB_PMEM turns the file into the image given at mount, so the
+ *    regular mmap of pmem maps it.
+ *  - ZU_IOC_INIT_THREAD sizes the file for the ZT's app window and op
+ *    buffer, which we also map, and ZU_IOC_WAIT_OPT hands the ZT operations
+ *    of zuf_emu_dispatch, one at a time.
+ *  - A ZT that offers the polling ring (--poll_us) is answered. It is then
+ *    handed operations on the ring while it polls, and the dispatcher
+ *    spins on cq_seq for the results.
+ *  - ZU_IOC_IOMAP_EXEC is executed synchronously against the t2 image.
+ * Private mounts are not supported.
+ *
+ * Copyright (c) 2018 NetApp, Inc. All rights reserved.
+ *
+ * See module.c for LICENSE details.
+ */
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/sysinfo.h>
+
+#include "zus.h"
+#include "zuf_call.h"
+#include "iom_enc.h"
+
+#define ZUF_EMU_MAX_FDS		8192
+#define ZUF_EMU_MAX_FS		16
+#define ZUF_EMU_SYS_NODE	"/sys/devices/system/node"
+#define ZUF_EMU_SYS_CPU		"/sys/devices/system/cpu"
+
+enum {
+	EMU_F_NONE = 0,
+	EMU_F_ZT,
+	EMU_F_PMEM,
+	EMU_F_BUFF,
+};
+
+struct _emu_file {
+	uint type;
+	uint chan;
+	uint cpu;
+};
+
+/* ZT hand-over states */
+enum {
+	EMU_ZT_IDLE = 0,
+	EMU_ZT_POSTED,	/* op is in the buffer, ZT not yet woken */
+	EMU_ZT_RUNNING,	/* ZT is executing, result on its next WAIT_OPT */
+	EMU_ZT_DONE,	/* result is in the buffer for the dispatcher */
+};
+
+/* Not freed before zuf_emu_fini, a dispatcher may be waiting on it */
+struct _emu_zt {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint state;
+	bool brk;
+	bool live;
+	bool ring_busy;		/* A dispatcher spins on the ring */
+	uint max_command;
+	void *api_mem;		/* Our view of the ZT's app window */
+	void *op_buff;		/* and of its op buffer */
+	struct zus_zt_ring *ring;	/* Once answered */
+};
+
+struct _emu_sb {
+	struct _emu_sb *next;
+	__u64 sb_id;
+	struct zus_fs_info *zfi;
+	int pmem_fd;
+	int t2_fd;
+};
+
+bool g_zuf_emu;
+
+static struct _zuf_emu {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	bool stopping;
+
+	struct _emu_file *files;
+	struct _emu_zt **zts[ZUFS_MAX_ZT_CHANNELS];	/* per channel, cpu */
+	struct zus_fs_info *zfis[ZUF_EMU_MAX_FS];
+	uint num_zfis;
+	struct _emu_sb *sbs;
+	__u64 next_sb_id;
+
+	/* One mount request at a time */
+	pthread_mutex_t mnt_serial;
+	bool mnt_ready;		/* FSs are registered */
+	struct zufs_ioc_mount *mnt_req;
+	bool mnt_taken;
+	bool mnt_done;
+} g_emu = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+	.mnt_serial = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static struct _emu_file *_file_of(int fd)
+{
+	if (unlikely(fd < 0 || ZUF_EMU_MAX_FDS <= fd))
+		return NULL;
+	return &g_emu.files[fd];
+}
+
+/* ~~~ sysfs NUMA map ~~~ */
+
+/* Parses a sysfs cpulist/nodelist e.g. "0-3,8-11". Sets @set if given.
+ * Returns the highest number found or -errno.
+ */
+static int _read_list(const char *path, cpu_set_t *set)
+{
+	char *line = NULL, *p;
+	size_t n = 0;
+	int max = -ENOENT;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if (!fp)
+		return -errno;
+
+	if (getline(&line, &n, fp) < 0)
+		goto out;
+
+	for (p = line; *p && *p != '\n';) {
+		long first, last, i;
+		char *end;
+
+		first = last = strtol(p, &end, 10);
+		if (end == p)
+			break;
+		if (*end == '-') {
+			p = end + 1;
+			last = strtol(p, &end, 10);
+		}
+		for (i = first; set && i <= last && i < CPU_SETSIZE; ++i)
+			CPU_SET(i, set);
+		if (last > max)
+			max = last;
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+out:
+	free(line);
+	fclose(fp);
+	return max;
+}
+
+static int _emu_numa_map(struct zufs_ioc_numa_map *zinm)
+{
+	uint max_nodes = (PAGE_SIZE - sizeof(*zinm)) /
+			 sizeof(zinm->cpu_set_per_node[0]);
+	char path[128];
+	int max_cpu, max_node, node, cpus;
+
+	max_cpu = _read_list(ZUF_EMU_SYS_CPU "/possible", NULL);
+	if (max_cpu < 0)
+		max_cpu = get_nprocs_conf() - 1;
+
+	max_node = _read_list(ZUF_EMU_SYS_NODE "/possible", NULL);
+	if (max_node < 0 || max_nodes <= (uint)max_node) {
+		/* No NUMA, all online CPUs are on node 0 */
+		memset(&zinm->cpu_set_per_node[0], 0,
+		       sizeof(zinm->cpu_set_per_node[0]));
+		if (_read_list(ZUF_EMU_SYS_CPU "/online",
+			   (cpu_set_t *)&zinm->cpu_set_per_node[0]) < 0)
+			return -ENODEV;
+		max_node = 0;
+	} else {
+		for (node = 0; node <= max_node; ++node) {
+			cpu_set_t *set =
+				(cpu_set_t *)&zinm->cpu_set_per_node[node];
+
+			CPU_ZERO(set);
+			snprintf(path, sizeof(path),
+				 ZUF_EMU_SYS_NODE "/node%d/cpulist", node);
+			_read_list(path, set); /* A hole is a CPU-less node */
+		}
+	}
+
+	zinm->possible_cpus = max_cpu + 1;
+	zinm->possible_nodes = max_node + 1;
+	zinm->online_cpus = 0;
+	zinm->online_nodes = 0;
+	zinm->max_cpu_per_node = 0;
+	for (node = 0; node <= max_node; ++node) {
+		cpus = CPU_COUNT((cpu_set_t *)&zinm->cpu_set_per_node[node]);
+		zinm->online_cpus += cpus;
+		if (cpus)
+			++zinm->online_nodes;
+		if ((uint)cpus > zinm->max_cpu_per_node)
+			zinm->max_cpu_per_node = cpus;
+	}
+
+	return 0;
+}
+
+/* ~~~ mount ~~~ */
+
+static struct _emu_sb *_sb_find(__u64 sb_id)
+{
+	struct _emu_sb *sb;
+
+	for (sb = g_emu.sbs; sb; sb = sb->next)
+		if (sb->sb_id == sb_id)
+			return sb;
+	return NULL;
+}
+
+static void _sb_free(__u64 sb_id)
+{
+	struct _emu_sb **psb, *sb;
+
+	pthread_mutex_lock(&g_emu.lock);
+	for (psb = &g_emu.sbs; (sb = *psb); psb = &sb->next) {
+		if (sb->sb_id == sb_id) {
+			*psb = sb->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_emu.lock);
+
+	if (!sb)
+		return;
+	close(sb->pmem_fd);
+	if (sb->t2_fd >= 0)
+		close(sb->t2_fd);
+	free(sb);
+}
+
+static struct zus_fs_info *_zfi_find(const char *fs_name)
+{
+	uint i;
+
+	for (i = 0; i < g_emu.num_zfis; ++i)
+		if (!strcmp(g_emu.zfis[i]->rfi.fsname, fs_name))
+			return g_emu.zfis[i];
+	return NULL;
+}
+
+/* The mount thread returns the result of the previous request and waits for
+ * the next one. It registers the FSs before it first gets here.
+ */
+static int _emu_recieve_mount(struct zufs_ioc_mount *zim)
+{
+	int err = 0;
+
+	pthread_mutex_lock(&g_emu.lock);
+	if (!g_emu.mnt_ready) {
+		g_emu.mnt_ready = true;
+		pthread_cond_broadcast(&g_emu.cond);
+	}
+	if (g_emu.mnt_req && g_emu.mnt_taken) {
+		memcpy(g_emu.mnt_req, zim, sizeof(*zim));
+		g_emu.mnt_taken = false;
+		g_emu.mnt_done = true;
+		pthread_cond_broadcast(&g_emu.cond);
+	}
+
+	while (!g_emu.stopping &&
+	       !(g_emu.mnt_req && !g_emu.mnt_taken && !g_emu.mnt_done))
+		pthread_cond_wait(&g_emu.cond, &g_emu.lock);
+
+	if (g_emu.stopping) {
+		err = -ESHUTDOWN;
+	} else {
+		memcpy(zim, g_emu.mnt_req, g_emu.mnt_req->hdr.in_len);
+		g_emu.mnt_taken = true;
+	}
+	pthread_mutex_unlock(&g_emu.lock);
+
+	return err;
+}
+
+static int _emu_mount_request(struct zufs_ioc_mount *zim)
+{
+	int err;
+
+	pthread_mutex_lock(&g_emu.mnt_serial);
+	pthread_mutex_lock(&g_emu.lock);
+	g_emu.mnt_req = zim;
+	g_emu.mnt_taken = g_emu.mnt_done = false;
+	pthread_cond_broadcast(&g_emu.cond);
+
+	while (!g_emu.mnt_done && !g_emu.stopping)
+		pthread_cond_wait(&g_emu.cond, &g_emu.lock);
+
+	err = g_emu.mnt_done ? zim->hdr.err : -ESHUTDOWN;
+	g_emu.mnt_req = NULL;
+	g_emu.mnt_done = false;
+	pthread_mutex_unlock(&g_emu.lock);
+	pthread_mutex_unlock(&g_emu.mnt_serial);
+
+	return err;
+}
+
+static struct zufs_ioc_mount *_zim_alloc(uint operation, const char *options,
+					 ulong flags)
+{
+	size_t opt_len = options ? strlen(options) : 0;
+	size_t len = sizeof(struct zufs_ioc_mount) + opt_len + 1;
+	struct zufs_ioc_mount *zim;
+
+	if (unlikely(ZUS_MAX_OP_SIZE < len))
+		return NULL;
+
+	zim = calloc(1, len);
+	if (unlikely(!zim))
+		return NULL;
+
+	zim->hdr.operation = operation;
+	zim->hdr.in_len = len;
+	zim->zmi.po.mount_flags = flags;
+	zim->zmi.po.mount_options_len = opt_len;
+	if (opt_len)
+		memcpy(&zim->zmi.po.mount_options, options, opt_len);
+	return zim;
+}
+
+int zuf_emu_mount(struct zuf_emu_mount *zem)
+{
+	struct zufs_ioc_mount *zim;
+	struct zus_fs_info *zfi;
+	struct _emu_sb *sb;
+	int err;
+
+	/* zus_mount_thread_start does not wait for the FSs to register */
+	pthread_mutex_lock(&g_emu.lock);
+	while (!g_emu.mnt_ready && !g_emu.stopping)
+		pthread_cond_wait(&g_emu.cond, &g_emu.lock);
+	pthread_mutex_unlock(&g_emu.lock);
+
+	zfi = _zfi_find(zem->fs_name);
+	if (unlikely(!zfi)) {
+		ERROR("emu: no such fs <%s>\n", zem->fs_name);
+		return -ENODEV;
+	}
+
+	sb = calloc(1, sizeof(*sb));
+	if (unlikely(!sb))
+		return -ENOMEM;
+
+	sb->t2_fd = -1;
+	sb->pmem_fd = open(zem->pmem_path, O_RDWR);
+	if (sb->pmem_fd < 0) {
+		err = -errno;
+		ERROR("emu: open <%s> => %d\n", zem->pmem_path, err);
+		free(sb);
+		return err;
+	}
+	if (zem->t2_path) {
+		sb->t2_fd = open(zem->t2_path, O_RDWR);
+		if (sb->t2_fd < 0) {
+			err = -errno;
+			ERROR("emu: open <%s> => %d\n", zem->t2_path, err);
+			close(sb->pmem_fd);
+			free(sb);
+			return err;
+		}
+	}
+
+	pthread_mutex_lock(&g_emu.lock);
+	sb->zfi = zfi;
+	sb->sb_id = ++g_emu.next_sb_id;
+	sb->next = g_emu.sbs;
+	g_emu.sbs = sb;
+	pthread_mutex_unlock(&g_emu.lock);
+	zem->sb_id = sb->sb_id;
+
+	zim = _zim_alloc(ZUFS_M_MOUNT, zem->options, zem->flags);
+	if (unlikely(!zim)) {
+		err = -ENOMEM;
+		goto fail;
+	}
+	zim->zmi.zus_zfi = zfi;
+	zim->zmi.sb_id = zem->sb_id;
+	zim->zmi.num_channels = zem->num_channels ?: 1;
+
+	err = _emu_mount_request(zim);
+	if (unlikely(err)) {
+		ERROR("emu: mount <%s> => %d\n", zem->pmem_path, err);
+		free(zim);
+		goto fail;
+	}
+
+	zem->sbi = zim->zmi.zus_sbi;
+	zem->root_ii = zim->zmi.zus_ii;
+	free(zim);
+	return 0;
+
+fail:
+	_sb_free(zem->sb_id);
+	return err;
+}
+
+int zuf_emu_umount(struct zuf_emu_mount *zem)
+{
+	struct zufs_ioc_mount *zim;
+	int err;
+
+	zim = _zim_alloc(ZUFS_M_UMOUNT, NULL, 0);
+	if (unlikely(!zim))
+		return -ENOMEM;
+	zim->zmi.zus_sbi = zem->sbi;
+	zim->zmi.sb_id = zem->sb_id;
+
+	err = _emu_mount_request(zim);
+	free(zim);
+	if (unlikely(err))
+		return err;
+
+	_sb_free(zem->sb_id);
+	zem->sbi = NULL;
+	zem->root_ii = NULL;
+	return 0;
+}
+
+/* The file now is the image, so it is what zus mmaps as pmem */
+static int _emu_grab_pmem(int fd, struct _emu_file *ef,
+			  struct zufs_ioc_pmem *zip)
+{
+	struct _emu_sb *sb;
+	ulong dt_offset = 0;
+	ssize_t ret;
+	int pmem_fd;
+
+	pthread_mutex_lock(&g_emu.lock);
+	sb = _sb_find(zip->sb_id);
+	pmem_fd = sb ? sb->pmem_fd : -1;
+	if (sb)
+		dt_offset = sb->zfi->rfi.dt_offset;
+	pthread_mutex_unlock(&g_emu.lock);
+	if (unlikely(pmem_fd < 0))
+		return -ENODEV;
+
+	/* Device table is where the FS registered it to be */
+	ret = pread(pmem_fd, &zip->mdt, sizeof(zip->mdt), dt_offset);
+	if (ret != sizeof(zip->mdt))
+		return ret < 0 ? -errno : -EINVAL;
+	zip->dev_index = 0;
+
+	if (dup2(pmem_fd, fd) < 0)
+		return -errno;
+	ef->type = EMU_F_PMEM;
+	return 0;
+}
+
+/* ~~~ ZTs ~~~ */
+
+static struct _emu_zt *_emu_zt_get(uint chan, uint cpu, bool create)
+{
+	struct _emu_zt *zt;
+
+	if (unlikely(ZUFS_MAX_ZT_CHANNELS <= chan || CPU_SETSIZE <= cpu))
+		return NULL;
+
+	pthread_mutex_lock(&g_emu.lock);
+	if (!g_emu.zts[chan] && create)
+		g_emu.zts[chan] = calloc(CPU_SETSIZE, sizeof(*g_emu.zts[0]));
+	zt = g_emu.zts[chan] ? g_emu.zts[chan][cpu] : NULL;
+	if (!zt && g_emu.zts[chan] && create) {
+		zt = calloc(1, sizeof(*zt));
+		if (zt) {
+			pthread_mutex_init(&zt->lock, NULL);
+			pthread_cond_init(&zt->cond, NULL);
+			g_emu.zts[chan][cpu] = zt;
+		}
+	}
+	pthread_mutex_unlock(&g_emu.lock);
+
+	return zt;
+}
+
+static void _emu_zt_unmap(struct _emu_zt *zt)
+{
+	if (zt->api_mem)
+		munmap(zt->api_mem, ZUS_API_MAP_MAX_SIZE);
+	if (zt->op_buff)
+		munmap(zt->op_buff, ZUS_MAX_OP_SIZE);
+	zt->api_mem = zt->op_buff = NULL;
+	zt->ring = NULL;
+}
+
+static int _emu_zt_init(int fd, struct _emu_file *ef,
+			struct zufs_ioc_init *zii)
+{
+	int prot = PROT_WRITE | PROT_READ;
+	int cpu = zus_current_cpu_silent();
+	struct _emu_zt *zt;
+	int err;
+
+	zt = _emu_zt_get(zii->channel_no, cpu, true);
+	if (unlikely(!zt))
+		return -ENOMEM;
+
+	err = ftruncate(fd, ZUS_API_MAP_MAX_SIZE + ZUS_MAX_OP_SIZE);
+	if (unlikely(err))
+		return -errno;
+
+	pthread_mutex_lock(&zt->lock);
+	if (ZUS_WARN_ON(zt->live)) {
+		pthread_mutex_unlock(&zt->lock);
+		return -EBUSY;
+	}
+	zt->api_mem = mmap(NULL, ZUS_API_MAP_MAX_SIZE, prot, MAP_SHARED, fd, 0);
+	zt->op_buff = mmap(NULL, ZUS_MAX_OP_SIZE, prot, MAP_SHARED, fd,
+			   ZUS_API_MAP_MAX_SIZE);
+	if (zt->api_mem == MAP_FAILED || zt->op_buff == MAP_FAILED) {
+		err = -(errno ?: ENOMEM);
+		if (zt->api_mem == MAP_FAILED)
+			zt->api_mem = NULL;
+		if (zt->op_buff == MAP_FAILED)
+			zt->op_buff = NULL;
+		_emu_zt_unmap(zt);
+		pthread_mutex_unlock(&zt->lock);
+		return err;
+	}
+	zt->max_command = zii->max_command ?: ZUS_MAX_OP_SIZE;
+	zt->state = EMU_ZT_IDLE;
+	zt->brk = false;
+	zt->ring = NULL;
+	zt->live = true;
+	pthread_mutex_unlock(&zt->lock);
+
+	ef->type = EMU_F_ZT;
+	ef->chan = zii->channel_no;
+	ef->cpu = cpu;
+	return 0;
+}
+
+static void _emu_zt_fini(struct _emu_file *ef)
+{
+	struct _emu_zt *zt = _emu_zt_get(ef->chan, ef->cpu, false);
+
+	if (ZUS_WARN_ON(!zt))
+		return;
+
+	pthread_mutex_lock(&zt->lock);
+	__atomic_store_n(&zt->live, false, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&zt->cond);
+	/* It sees !live, and is off the ring before it is unmapped */
+	while (zt->ring_busy)
+		pthread_cond_wait(&zt->cond, &zt->lock);
+	_emu_zt_unmap(zt);
+	pthread_mutex_unlock(&zt->lock);
+}
+
+static int _emu_wait_opt(struct _emu_file *ef,
+			 struct zufs_ioc_wait_operation *opt)
+{
+	struct _emu_zt *zt = _emu_zt_get(ef->chan, ef->cpu, false);
+
+	if (ZUS_WARN_ON(!zt || ef->type != EMU_F_ZT))
+		return -EINVAL;
+
+	pthread_mutex_lock(&zt->lock);
+	/* With the ring, results are reported by cq_seq */
+	if (zt->state == EMU_ZT_RUNNING && !zt->ring) {
+		zt->state = EMU_ZT_DONE;
+		pthread_cond_broadcast(&zt->cond);
+	}
+
+	while (zt->state != EMU_ZT_POSTED && !zt->brk)
+		pthread_cond_wait(&zt->cond, &zt->lock);
+
+	/* A posted op is in the buffer, a break would overwrite it */
+	if (zt->state == EMU_ZT_POSTED) {
+		zt->state = EMU_ZT_RUNNING;
+	} else {
+		zt->brk = false;
+		opt->hdr.operation = ZUFS_OP_BREAK;
+		opt->hdr.in_len = sizeof(opt->hdr);
+		opt->hdr.offset = 0;
+	}
+	pthread_mutex_unlock(&zt->lock);
+
+	return 0;
+}
+
+static int _emu_break_all(struct _emu_file *ef)
+{
+	uint cpu;
+
+	if (ZUS_WARN_ON(ef->type != EMU_F_ZT))
+		return -EINVAL;
+
+	pthread_mutex_lock(&g_emu.lock);
+	for (cpu = 0; g_emu.zts[ef->chan] && cpu < CPU_SETSIZE; ++cpu) {
+		struct _emu_zt *zt = g_emu.zts[ef->chan][cpu];
+
+		if (!zt)
+			continue;
+		pthread_mutex_lock(&zt->lock);
+		zt->brk = true;
+		pthread_cond_broadcast(&zt->cond);
+		pthread_mutex_unlock(&zt->lock);
+	}
+	pthread_mutex_unlock(&g_emu.lock);
+	return 0;
+}
+
+/* The ring is answered at the first op after the ZT offered it. Under
+ * zt->lock
+ */
+static struct zus_zt_ring *_emu_zt_ring(struct _emu_zt *zt)
+{
+	struct zus_zt_ring *ring;
+
+	if (zt->ring ||
+	    ZUS_MAX_OP_SIZE - ZUS_ZT_RING_SIZE < zt->max_command)
+		return zt->ring;
+
+	ring = zt->op_buff + ZUS_MAX_OP_SIZE - ZUS_ZT_RING_SIZE;
+	if (__atomic_load_n(&ring->zt_magic, __ATOMIC_ACQUIRE) !=
+	    ZUS_ZT_RING_MAGIC)
+		return NULL;
+
+	__atomic_store_n(&ring->peer_magic, ZUS_ZT_RING_MAGIC,
+			 __ATOMIC_RELEASE);
+	zt->ring = ring;
+	return ring;
+}
+
+/* Hands the op in the buffer to a polling ZT, else to its WAIT_OPT. Then
+ * spins, without zt->lock, until the ZT publishes the op's cq_seq or goes
+ * away. Under zt->lock
+ */
+static int _emu_ring_post(struct _emu_zt *zt, struct zus_zt_ring *ring)
+{
+	__u64 seq = ring->sq_seq + 1;
+	__u32 poll = ZUS_ZT_RING_POLL;
+	ulong i;
+
+	__atomic_store_n(&ring->sq_seq, seq, __ATOMIC_RELEASE);
+	if (__atomic_compare_exchange_n(&ring->poll, &poll,
+					ZUS_ZT_RING_POSTED, false,
+					__ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		zt->state = EMU_ZT_RUNNING;
+	} else {
+		zt->state = EMU_ZT_POSTED;
+		pthread_cond_broadcast(&zt->cond);
+	}
+
+	zt->ring_busy = true;
+	pthread_mutex_unlock(&zt->lock);
+
+	for (i = 1; __atomic_load_n(&ring->cq_seq, __ATOMIC_ACQUIRE) != seq;
+	     ++i) {
+		if (!__atomic_load_n(&zt->live, __ATOMIC_ACQUIRE))
+			break;
+		if (!(i % 64))
+			sched_yield();
+	}
+
+	pthread_mutex_lock(&zt->lock);
+	zt->ring_busy = false;
+	pthread_cond_broadcast(&zt->cond);
+	return zt->live ? 0 : -ESHUTDOWN;
+}
+
+/* Runs @hdr (in_len bytes) on the ZT of @chan and @cpu, the way an app's
+ * syscall would. @app is copied to the ZT's app window at hdr->offset, and
+ * back once done, as is the op (in_len bytes) to @hdr. Returns hdr->err.
+ */
+int zuf_emu_dispatch(uint chan, uint cpu, struct zufs_ioc_hdr *hdr,
+		     void *app, size_t app_len)
+{
+	struct _emu_zt *zt = _emu_zt_get(chan, cpu, false);
+	struct zus_zt_ring *ring;
+	int err;
+
+	if (unlikely(!zt))
+		return -ENODEV;
+
+	pthread_mutex_lock(&zt->lock);
+	while (zt->live && zt->state != EMU_ZT_IDLE)
+		pthread_cond_wait(&zt->cond, &zt->lock);
+	if (unlikely(!zt->live)) {
+		err = -ENODEV;
+		goto out;
+	}
+	if (unlikely(zt->max_command < hdr->in_len ||
+		     ZUS_API_MAP_MAX_SIZE < hdr->offset + app_len)) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	memcpy(zt->op_buff, hdr, hdr->in_len);
+	if (app_len)
+		memcpy(zt->api_mem + hdr->offset, app, app_len);
+
+	ring = _emu_zt_ring(zt);
+	if (ring) {
+		err = _emu_ring_post(zt, ring);
+		if (unlikely(err))
+			goto out;
+	} else {
+		zt->state = EMU_ZT_POSTED;
+		pthread_cond_broadcast(&zt->cond);
+
+		while (zt->live && zt->state != EMU_ZT_DONE)
+			pthread_cond_wait(&zt->cond, &zt->lock);
+		if (unlikely(!zt->live)) {
+			err = -ESHUTDOWN;
+			goto out;
+		}
+	}
+
+	memcpy(hdr, zt->op_buff, hdr->in_len);
+	if (app_len)
+		memcpy(app, zt->api_mem + hdr->offset, app_len);
+	err = hdr->err;
+
+	zt->state = EMU_ZT_IDLE;
+	pthread_cond_broadcast(&zt->cond);
+out:
+	pthread_mutex_unlock(&zt->lock);
+	return err;
+}
+
+/* ~~~ iomap executor ~~~ */
+
+static int _emu_pio(int fd, void *buf, size_t len, off_t off, bool wr)
+{
+	while (len) {
+		ssize_t ret = wr ? pwrite(fd, buf, len, off) :
+				   pread(fd, buf, len, off);
+
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+		if (!ret)
+			return -EIO; /* Beyond the t2 image */
+		buf += ret;
+		off += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+static int _emu_iomap_exec(struct zufs_ioc_iomap_exec *ziome)
+{
+	__u64 *iom_e = ziome->ziom.iom_e;
+	__u64 *end = iom_e + ziome->ziom.iom_n;
+	struct zus_iomap_done *iomd = ziome->ziom.iomd;
+	struct _emu_sb *sb;
+	int t2_fd;
+	int err = 0;
+
+	pthread_mutex_lock(&g_emu.lock);
+	sb = _sb_find(ziome->sb_id);
+	t2_fd = sb ? sb->t2_fd : -1;
+	pthread_mutex_unlock(&g_emu.lock);
+
+	while (!err && iom_e < end) {
+		uint type = _zufs_iom_opt_type(iom_e);
+		ulong t2_off = md_p2o(_zufs_iom_first_val(iom_e));
+
+		switch (type) {
+		case IOM_T2_WRITE:
+		case IOM_T2_READ: {
+			struct zufs_iom_t2_io *io = (void *)iom_e;
+
+			if (t2_fd < 0 || !ziome->zus_sbi) {
+				err = -ENODEV;
+				break;
+			}
+			err = _emu_pio(t2_fd,
+				       md_baddr(&ziome->zus_sbi->md,
+						md_o2p(io->t1_val)),
+				       PAGE_SIZE, t2_off, type == IOM_T2_WRITE);
+			iom_e = (void *)(io + 1);
+			break;
+		}
+		case IOM_T2_ZUSMEM_WRITE:
+		case IOM_T2_ZUSMEM_READ: {
+			struct zufs_iom_t2_zusmem_io *io = (void *)iom_e;
+
+			if (t2_fd < 0) {
+				err = -ENODEV;
+				break;
+			}
+			err = _emu_pio(t2_fd, (void *)io->zus_mem_ptr, io->len,
+				       t2_off, type == IOM_T2_ZUSMEM_WRITE);
+			iom_e = (void *)(io + 1);
+			break;
+		}
+		case IOM_DISCARD: {
+			struct zufs_iom_t2_io_len *io = (void *)iom_e;
+
+			if (t2_fd >= 0 &&
+			    fallocate(t2_fd, FALLOC_FL_PUNCH_HOLE |
+				      FALLOC_FL_KEEP_SIZE, t2_off,
+				      md_p2o(io->num_pages)))
+				err = -errno;
+			iom_e = (void *)(io + 1);
+			break;
+		}
+		case IOM_UNMAP:
+			/* No page-cache, no mapped pages to unmap */
+			iom_e = (void *)((struct zufs_iom_unmap *)iom_e + 1);
+			break;
+		case IOM_WBINV:
+			/* Nothing to write back, all is coherent */
+			++iom_e;
+			break;
+		default:
+			ERROR("emu: iomap type=%u not supported\n", type);
+			err = -EOPNOTSUPP;
+		}
+	}
+
+	ziome->hdr.err = err;
+	/* Executed inline, so an async submit is also done by now */
+	if (!ziome->wait_for_done && iomd)
+		iomd->done(iomd, err);
+	return err;
+}
+
+/* ~~~ zuf-root files and ioctls ~~~ */
+
+int zuf_emu_open(int *fd)
+{
+	struct _emu_file *ef;
+
+	*fd = open("/dev/shm/", O_RDWR | O_TMPFILE | O_EXCL, 0666);
+	if (*fd < 0) {
+		ERROR("emu: Error opening tmpfile: %s\n", strerror(errno));
+		return -errno;
+	}
+
+	ef = _file_of(*fd);
+	if (unlikely(!ef)) {
+		close(*fd);
+		*fd = -1;
+		return -EMFILE;
+	}
+	memset(ef, 0, sizeof(*ef));
+	return 0;
+}
+
+void zuf_emu_close(int fd)
+{
+	struct _emu_file *ef = _file_of(fd);
+
+	if (!ef)
+		return;
+	if (ef->type == EMU_F_ZT)
+		_emu_zt_fini(ef);
+	ef->type = EMU_F_NONE;
+}
+
+int zuf_emu_ioctl(int fd, ulong zu_vect, struct zufs_ioc_hdr *hdr)
+{
+	struct _emu_file *ef = _file_of(fd);
+	int err;
+
+	if (unlikely(!ef))
+		return -EBADF;
+
+	switch (zu_vect) {
+	case ZU_IOC_REGISTER_FS: {
+		struct zufs_ioc_register_fs *zirf = (void *)hdr;
+
+		if (g_emu.num_zfis == ZUF_EMU_MAX_FS)
+			return -ENOSPC;
+		g_emu.zfis[g_emu.num_zfis++] = zirf->zus_zfi;
+		err = 0;
+		break;
+	}
+	case ZU_IOC_NUMA_MAP:
+		err = _emu_numa_map((void *)hdr);
+		break;
+	case ZU_IOC_MOUNT:
+		err = _emu_recieve_mount((void *)hdr);
+		break;
+	case ZU_IOC_GRAB_PMEM:
+		err = _emu_grab_pmem(fd, ef, (void *)hdr);
+		break;
+	case ZU_IOC_INIT_THREAD:
+		err = _emu_zt_init(fd, ef, (void *)hdr);
+		break;
+	case ZU_IOC_WAIT_OPT:
+		/* Result of the previous op is already in the buffer */
+		return _emu_wait_opt(ef, (void *)hdr);
+	case ZU_IOC_BREAK_ALL:
+		err = _emu_break_all(ef);
+		break;
+	case ZU_IOC_ALLOC_BUFFER: {
+		struct zufs_ioc_alloc_buffer *ab = (void *)hdr;
+
+		err = ftruncate(fd, ab->max_size) ? -errno : 0;
+		if (!err)
+			ef->type = EMU_F_BUFF;
+		break;
+	}
+	case ZU_IOC_IOMAP_EXEC:
+		return _emu_iomap_exec((void *)hdr);
+	default:
+		ERROR("emu: ioctl zu_n=%lx not supported\n", zu_vect);
+		err = -ENOTTY;
+	}
+
+	hdr->err = err;
+	return err;
+}
+
+/* ~~~ start/stop ~~~ */
+
+/* Call before zus_mount_thread_start() */
+int zuf_emu_start(void)
+{
+	g_emu.files = calloc(ZUF_EMU_MAX_FDS, sizeof(*g_emu.files));
+	if (unlikely(!g_emu.files))
+		return -ENOMEM;
+
+	g_emu.stopping = false;
+	g_zuf_emu = true;
+	INFO("zuf emulation started\n");
+	return 0;
+}
+
+/* Let go of the mount thread, so zus_mount_thread_stop() can join it */
+void zuf_emu_stop(void)
+{
+	pthread_mutex_lock(&g_emu.lock);
+	g_emu.stopping = true;
+	pthread_cond_broadcast(&g_emu.cond);
+	pthread_mutex_unlock(&g_emu.lock);
+}
+
+/* Call after zus_mount_thread_stop(), all zuf-root files are closed */
+void zuf_emu_fini(void)
+{
+	uint chan, cpu;
+
+	for (chan = 0; chan < ZUFS_MAX_ZT_CHANNELS; ++chan) {
+		if (!g_emu.zts[chan])
+			continue;
+		for (cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+			struct _emu_zt *zt = g_emu.zts[chan][cpu];
+
+			if (!zt)
+				continue;
+			_emu_zt_unmap(zt);
+			pthread_cond_destroy(&zt->cond);
+			pthread_mutex_destroy(&zt->lock);
+			free(zt);
+		}
+		free(g_emu.zts[chan]);
+		g_emu.zts[chan] = NULL;
+	}
+
+	while (g_emu.sbs)
+		_sb_free(g_emu.sbs->sb_id);
+
+	g_emu.num_zfis = 0;
+	g_emu.mnt_ready = false;
+	g_zuf_emu = false;
+	free(g_emu.files);
+	g_emu.files = NULL;
+}
@@ -25,6 +25,9 @@ int __ioctl(int fd, ulong zu_vect, struct zufs_ioc_hdr *hdr, const char *msg)
 {
 	int ret;
 
+	if (unlikely(g_zuf_emu))
+		return zuf_emu_ioctl(fd, zu_vect, hdr);
+
 	ret = ioctl(fd, zu_vect, hdr);
 	if (ret) {
 		ERROR("Unexpected ioctl => %d errno=%d zu_n=%lx zu_s=%s hdr=%d\n",
@@ -13,9 +13,12 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
 #include <asm-generic/mman.h>
+#include <linux/mempolicy.h>
 #include <linux/limits.h>
 #include <systemd/sd-daemon.h>
 
@@ -43,20 +46,14 @@ const char *g_zus_root_path = g_zus_root_path_stor;
 ulong g_DBGMASK;
 int g_mlock = MLOCK_CURRENT; /* default to MCL_CURRENT */
 
-/*
- * Converts user-space error code to kernel conventions: change positive errno
- * codes to negative.
- */
-static __s32 _errno_UtoK(__s32 err)
-{
-	return (err < 0) ? err : -err;
-}
-
 int zuf_root_open_tmp(int *fd)
 {
 	/* RDWR also for the mmap */
 	int o_flags = O_RDWR | O_TMPFILE | O_EXCL;
 
+	if (unlikely(g_zuf_emu))
+		return zuf_emu_open(fd);
+
 	*fd = open(g_zus_root_path, o_flags, 0666);
 	if (*fd < 0) {
 		ERROR("Error opening <%s>: flags=0x%x, %s\n",
@@ -70,6 +67,8 @@ int zuf_root_open_tmp(int *fd)
 void zuf_root_close(int *fd)
 {
 	if (*fd >= 0) {
+		if (unlikely(g_zuf_emu))
+			zuf_emu_close(*fd);
 		close(*fd);
 		*fd = -1;
 	}
@@ -88,6 +87,8 @@ struct zus_base_thread {
 	pthread_t thread;
 	ulong flags;
 	int err;
+	void *stack;	/* If set by caller, thread runs on it */
+	size_t stack_size;
 };
 
 static pthread_key_t g_zts_id_key;
@@ -276,6 +277,52 @@ static int zus_set_numa_affinity(cpu_set_t *affinity, int nid)
 	return 0;
 }
 
+#define ZUS_NODEMASK_LONGS	(1024 / (sizeof(long) * 8))
+
+/* Pages of [@ptr, @ptr + @size) not yet faulted in, whoever first touches
+ * them, are taken from @nid when possible
+ */
+void zus_mbind_preferred(void *ptr, size_t size, uint nid)
+{
+	unsigned long nodemask[ZUS_NODEMASK_LONGS] = {};
+	const ulong bits_per_long = sizeof(nodemask[0]) * 8;
+	long err;
+
+	if (nid >= ZUS_NODEMASK_LONGS * bits_per_long)
+		return;
+
+	nodemask[nid / bits_per_long] = 1UL << (nid % bits_per_long);
+	err = syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, nodemask,
+		      ZUS_NODEMASK_LONGS * bits_per_long, 0);
+	if (err)  /* Not fatal, just not NUMA local */
+		DBG("mbind(nid=%u) => %d\n", nid, errno);
+}
+
+/* Anonymous memory taken from @nid when possible, see zus_mbind_preferred.
+ * Memory is zeroed and page aligned.
+ */
+static void *zus_node_alloc(size_t size, uint nid)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ptr == MAP_FAILED) {
+		ERROR("mmap(0x%lx) failed=> %d: %s\n", size, errno,
+		      strerror(errno));
+		return NULL;
+	}
+
+	zus_mbind_preferred(ptr, size, nid);
+	return ptr;
+}
+
+static void zus_node_free(void *ptr, size_t size)
+{
+	if (ptr)
+		munmap(ptr, size);
+}
+
 static void zus_set_onecpu_affinity(cpu_set_t *affinity, uint cpu)
 {
 	CPU_ZERO(affinity);
@@ -318,6 +365,16 @@ int __zus_thread_create(struct zus_base_thread *zbt,
 		return zbt->err = err;
 	}
 
+	if (zbt->stack) {
+		err = pthread_attr_setstack(&attr, zbt->stack,
+					    zbt->stack_size);
+		if (unlikely(err)) {
+			ERROR("pthread_attr_setstack => %d: %s\n",
+			      err, strerror(err));
+			goto error;
+		}
+	}
+
 	err = pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
 	if (unlikely(err)) {
 		ERROR("pthread_attr_setinheritsched => %d: %s\n",
@@ -454,13 +511,25 @@ struct _zu_thread {
 	void *api_mem;
 	volatile bool stop;
 	struct zufs_ioc_hdr *op_hdr;
+	uint poll_us;
+	struct zus_zt_ring *ring;
+	__u64 sq_seen;
+	struct zus_zt_poll_stats pstats;
 };
 
+/* Each ZT control block, and its stack, is allocated separately on the
+ * node of the CPU it serves. So no two ZTs share a cache line and their
+ * hot fields stay local to where they run.
+ */
+#define ZT_STACK_SIZE	(8UL << 20)
+#define ZT_CB_SIZE	ALIGN(sizeof(struct _zu_thread), PAGE_SIZE)
+
 struct zt_pool {
 	struct wait_til_zero wtz;
-	struct _zu_thread *zts[ZUFS_MAX_ZT_CHANNELS];
+	struct _zu_thread **zts[ZUFS_MAX_ZT_CHANNELS];
 	int num_zts;
 	uint max_channels;
+	uint nr_mounts;
 };
 
 static struct zt_pool g_ztp = {};
@@ -520,6 +589,120 @@ int _do_op(struct _zu_thread *zt, struct zufs_ioc_wait_operation *op)
 	return zus_do_command(app_ptr, &op->hdr);
 }
 
+/* ~~~ ZT polling ring (See struct zus_zt_ring in zus.h) ~~~ */
+
+static inline void _cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__sync_synchronize();
+#endif
+}
+
+static ulong _now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static uint _zt_max_command(struct _zu_thread *zt)
+{
+	return zt->poll_us ? ZUS_MAX_OP_SIZE - ZUS_ZT_RING_SIZE :
+			     ZUS_MAX_OP_SIZE;
+}
+
+static void _zt_ring_offer(struct _zu_thread *zt, void *op_buff)
+{
+	if (!zt->poll_us)
+		return;
+
+	zt->ring = op_buff + ZUS_MAX_OP_SIZE - ZUS_ZT_RING_SIZE;
+	memset(zt->ring, 0, sizeof(*zt->ring));
+	__atomic_store_n(&zt->ring->zt_magic, ZUS_ZT_RING_MAGIC,
+			 __ATOMIC_RELEASE);
+}
+
+static bool _zt_ring_active(struct _zu_thread *zt)
+{
+	return zt->ring &&
+	       (__atomic_load_n(&zt->ring->peer_magic, __ATOMIC_ACQUIRE) ==
+		ZUS_ZT_RING_MAGIC);
+}
+
+/* An operation was delivered by ZU_IOC_WAIT_OPT, learn its sequence */
+static void _zt_ring_woken(struct _zu_thread *zt)
+{
+	if (_zt_ring_active(zt))
+		zt->sq_seen = __atomic_load_n(&zt->ring->sq_seq,
+					      __ATOMIC_ACQUIRE);
+}
+
+/* Publishes the result of the current op then spins, for up to poll_us,
+ * for the peer to post the next one. Returns true if it did.
+ */
+static bool _zt_poll(struct _zu_thread *zt)
+{
+	struct zus_zt_ring *ring = zt->ring;
+	__u32 poll = ZUS_ZT_RING_POLL;
+	ulong deadline, i;
+
+	if (!_zt_ring_active(zt))
+		return false;
+
+	/* Polling before the peer can see the result and post again */
+	__atomic_store_n(&ring->poll, ZUS_ZT_RING_POLL, __ATOMIC_RELAXED);
+	__atomic_store_n(&ring->cq_seq, zt->sq_seen, __ATOMIC_RELEASE);
+
+	deadline = _now_ns() + zt->poll_us * 1000UL;
+	for (i = 0; ; ++i) {
+		if (__atomic_load_n(&ring->poll, __ATOMIC_ACQUIRE) ==
+		    ZUS_ZT_RING_POSTED)
+			goto hit;
+		if (zt->stop || (!(i % 64) && (_now_ns() >= deadline)))
+			break;
+		_cpu_relax();
+	}
+
+	/* Fails if the peer posted since the last look */
+	if (!__atomic_compare_exchange_n(&ring->poll, &poll,
+					 ZUS_ZT_RING_SLEEP, false,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		goto hit;
+
+	++zt->pstats.sleeps;
+	return false;
+
+hit:
+	/* The peer posts no more until it sees this one's cq_seq */
+	__atomic_store_n(&ring->poll, ZUS_ZT_RING_SLEEP, __ATOMIC_RELAXED);
+	zt->sq_seen = __atomic_load_n(&ring->sq_seq, __ATOMIC_ACQUIRE);
+	++zt->pstats.spin_hits;
+	return true;
+}
+
+void zus_zt_poll_stats(struct zus_zt_poll_stats *stats)
+{
+	uint c;
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+	for (c = 0; c < g_ztp.max_channels; ++c) {
+		if (!g_ztp.zts[c])
+			continue;
+		for (i = 0; i < g_ztp.num_zts; ++i) {
+			struct _zu_thread *zt = g_ztp.zts[c][i];
+
+			if (!zt)
+				continue;
+			stats->spin_hits += zt->pstats.spin_hits;
+			stats->sleeps += zt->pstats.sleeps;
+		}
+	}
+}
+
 static void *_zu_thread(void *callback_info)
 {
 	struct _zu_thread *zt = callback_info;
@@ -529,7 +712,8 @@ static void *_zu_thread(void *callback_info)
 	if (zt->zbt.err)
 		goto fail;
 
-	zt->zbt.err = zuf_zt_init(zt->fd, zt->no, zt->chan, ZUS_MAX_OP_SIZE);
+	zt->zbt.err = zuf_zt_init(zt->fd, zt->no, zt->chan,
+				  _zt_max_command(zt));
 	if (zt->zbt.err)
 		goto fail;
 
@@ -545,6 +729,7 @@ static void *_zu_thread(void *callback_info)
 	     zt->no, zt->fd, zt->api_mem);
 
 	zt->op_hdr = &op->hdr;
+	_zt_ring_offer(zt, op);
 
 	wtz_release(&g_ztp.wtz);
 
@@ -558,9 +743,15 @@ static void *_zu_thread(void *callback_info)
 			 * and channel is stuck.
 			 */
 		}
-		op->hdr.err = _errno_UtoK(_do_op(zt, op));
+		_zt_ring_woken(zt);
+		do {
+			op->hdr.err = _errno_UtoK(_do_op(zt, op));
+		} while (_zt_poll(zt));
 	}
 
+	if (zt->ring)
+		INFO("ZT(%d.%d) poll: spin_hits=%lu sleeps=%lu\n", zt->no,
+		     zt->chan, zt->pstats.spin_hits, zt->pstats.sleeps);
 	_zu_ioc_buff_unmap(op);
 	_zu_unmap(zt);
 	zuf_root_close(&zt->fd);
@@ -576,60 +767,103 @@ fail:
 	return NULL;
 }
 
+/* Each ZT is armed on g_ztp.wtz only once it is about to be created, so a
+ * failure half way leaves no count for a thread that does not exist.
+ */
 static int _zus_start_chan_threads(struct zus_thread_params *tp, uint chan)
 {
-	uint i, err;
+	uint i;
+	int err;
 
 	g_ztp.zts[chan] = calloc(zus_num_possible_cpus(), sizeof(*g_ztp.zts[0]));
 	if (!g_ztp.zts[chan])
 		return -ENOMEM;
 
-	wtz_arm(&g_ztp.wtz, zus_num_online_cpus());
-
 	zus_for_each_cpu(i, zus_cpu_online_mask) {
 		char zt_name[32];
-		struct _zu_thread *zt = &g_ztp.zts[chan][i];
+		uint nid = zus_cpu_to_node(i);
+		struct _zu_thread *zt = zus_node_alloc(ZT_CB_SIZE, nid);
+
+		if (unlikely(!zt))
+			return -ENOMEM;
+		g_ztp.zts[chan][i] = zt;
+
+		/* Without a stack of our own, use the default one */
+		zt->zbt.stack = zus_node_alloc(ZT_STACK_SIZE, nid);
+		if (zt->zbt.stack &&
+		    unlikely(mprotect(zt->zbt.stack, PAGE_SIZE, PROT_NONE))) {
+			/* Not without its guard page */
+			ERROR("ZT(%d.%d) stack guard => %d\n", i, chan, -errno);
+			zus_node_free(zt->zbt.stack, ZT_STACK_SIZE);
+			zt->zbt.stack = NULL;
+		}
+		if (zt->zbt.stack)
+			zt->zbt.stack_size = ZT_STACK_SIZE;
 
 		snprintf(zt_name, sizeof(zt_name), "ZT(%d.%d)", i, chan);
 		tp->name = zt_name;
 		zt->no = tp->one_cpu = i;
 		zt->chan = chan;
+		zt->poll_us = tp->poll_us;
+		wtz_arm(&g_ztp.wtz, 1);
 		err = __zus_thread_create(&zt->zbt, tp, _zu_thread, zt);
 		tp->name = NULL;
-		if (err)
+		if (err) {
+			wtz_arm(&g_ztp.wtz, -1);
 			return err;
+		}
 	}
 
 	return 0;
 }
 
 /* forward declaration */
+static void _zus_stop_chan_threads(uint chan);
 static void zus_stop_all_threads(void);
 
+/* ZTs are started lazily: none until the first mount, and then only as
+ * many channels as the mounts so far asked for. So a mount that wants
+ * more channels than any before it grows the pool by the missing ones.
+ */
 static int zus_start_all_threads(struct zus_thread_params *tp, uint num_chans)
 {
-	uint c, num_cpus = zus_num_possible_cpus();
+	uint c, first, num_cpus = zus_num_possible_cpus();
 	int err;
 
-	wtz_init(&g_ztp.wtz);
-	g_ztp.num_zts = num_cpus;
+	if (ZUS_WARN_ON(num_chans > ZUFS_MAX_ZT_CHANNELS))
+		num_chans = ZUFS_MAX_ZT_CHANNELS;
+
+	if (!g_ztp.num_zts) {
+		wtz_init(&g_ztp.wtz);
+		g_ztp.num_zts = num_cpus;
+	}
+
+	first = g_ztp.max_channels;
+	if (num_chans <= first)
+		return 0;
 	g_ztp.max_channels = num_chans;
 
-	for (c = 0; c < g_ztp.max_channels; ++c) {
+	/* Held while the ZTs are created, so the count cannot reach zero
+	 * before the last of them is armed
+	 */
+	wtz_arm(&g_ztp.wtz, 1);
+	for (c = first; c < num_chans; ++c) {
 		err = _zus_start_chan_threads(tp, c);
 		if (unlikely(err))
 			goto fail;
 	}
+	wtz_release(&g_ztp.wtz);
 
 	wtz_wait(&g_ztp.wtz);
 
 	/* verify that all ZTs started successfully */
-	for (c = 0; c < g_ztp.max_channels; ++c) {
+	for (c = first; c < num_chans; ++c) {
 		uint i;
 
 		for (i = 0; i < num_cpus; ++i) {
-			struct _zu_thread *zt = &g_ztp.zts[c][i];
-			if (unlikely(zt->zbt.err)) {
+			struct _zu_thread *zt = g_ztp.zts[c][i];
+
+			if (zt && unlikely(zt->zbt.err)) {
 				err = zt->zbt.err;
 				goto fail;
 			}
@@ -640,12 +874,20 @@ static int zus_start_all_threads(struct zus_thread_params *tp, uint num_chans)
 	return 0;
 
 fail:
-	zus_stop_all_threads();
+	/* Leave the channels of already mounted FSs alone */
+	for (c = first; c < num_chans; ++c)
+		_zus_stop_chan_threads(c);
+	/* All of them joined, so none is left to release its count */
+	wtz_init(&g_ztp.wtz);
+	g_ztp.max_channels = first;
+	if (!first)
+		zus_stop_all_threads();
 	return err;
 }
 
 static void _zus_stop_chan_threads(uint chan)
 {
+	struct _zu_thread *zt;
 	void *tret;
 	int i;
 
@@ -653,17 +895,30 @@ static void _zus_stop_chan_threads(uint chan)
 		return;
 
 	for (i = 0; i < g_ztp.num_zts; ++i)
-		g_ztp.zts[chan][i].stop = true;
+		if (g_ztp.zts[chan][i])
+			g_ztp.zts[chan][i]->stop = true;
 
-	zuf_break_all(g_ztp.zts[chan][0].fd);
+	/* Any of the channel's ZTs that got as far as opening its fd */
+	for (i = 0; i < g_ztp.num_zts; ++i) {
+		zt = g_ztp.zts[chan][i];
+		if (zt && (zt->fd > 0)) {
+			zuf_break_all(zt->fd);
+			break;
+		}
+	}
 
 	for (i = 0; i < g_ztp.num_zts; ++i) {
-		struct _zu_thread *zt = &g_ztp.zts[chan][i];
+		zt = g_ztp.zts[chan][i];
+		if (!zt)
+			continue;
 
 		if (zt->zbt.thread) {
 			pthread_join(zt->zbt.thread, &tret);
 			zt->zbt.thread = 0;
 		}
+		zus_node_free(zt->zbt.stack, zt->zbt.stack_size);
+		zus_node_free(zt, ZT_CB_SIZE);
+		g_ztp.zts[chan][i] = NULL;
 	}
 
 	free(g_ztp.zts[chan]);
@@ -704,6 +959,25 @@ struct _zu_mount_thread {
 	struct _zu_thread mnt_th;
 } g_mount = {};
 
+/* With tp.stop_at_umount, ZTs are stopped once the last FS is unmounted,
+ * and restarted by the next mount. So an unused zusd holds no ZT threads.
+ * While anything is mounted all ZTs stay, zuf runs each op on the ZT of
+ * the CPU it came from.
+ */
+static void _zus_account_mount(uint op)
+{
+	if (op == ZUFS_M_MOUNT) {
+		++g_ztp.nr_mounts;
+	} else if (op == ZUFS_M_UMOUNT) {
+		if (ZUS_WARN_ON(!g_ztp.nr_mounts))
+			return;
+		if (!--g_ztp.nr_mounts && g_mount.tp.stop_at_umount) {
+			INFO("No more mounts, stopping ZT threads\n");
+			zus_stop_all_threads();
+		}
+	}
+}
+
 static void *zus_mount_thread(void *callback_info)
 {
 	struct fba fba = {};
@@ -741,7 +1015,7 @@ static void *zus_mount_thread(void *callback_info)
 		if (g_mount.zbt.err || g_mount.stop)
 			break;
 
-		if (zim->hdr.operation == ZUFS_M_MOUNT && !g_ztp.num_zts) {
+		if (zim->hdr.operation == ZUFS_M_MOUNT) {
 			err = zus_start_all_threads(&g_mount.tp,
 						    zim->zmi.num_channels);
 			if (unlikely(err))
@@ -766,6 +1040,8 @@ static void *zus_mount_thread(void *callback_info)
 		default:
 			err = -EINVAL;
 		}
+		if (!err)
+			_zus_account_mount(zim->hdr.operation);
 next:
 		zim->hdr.err = _errno_UtoK(err);
 	}
@@ -885,3 +1161,9 @@ error:
 	zuf_root_close(&fba->fd);
 	return err;
 }
+
+void zus_free_exec_buff(struct fba *fba)
+{
+	munmap(fba->ptr, fba->size);
+	zuf_root_close(&fba->fd);
+}
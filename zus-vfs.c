@@ -165,6 +165,7 @@ static void _zus_sbi_fini(struct zus_sb_info *sbi)
 	// zus_iput(sbi->z_root); was this done already
 	if (sbi->zfi->op->sbi_fini)
 		sbi->zfi->op->sbi_fini(sbi);
+	zus_t2cache_fini(sbi);
 	_pmem_ungrab(sbi);
 	sbi->zfi->op->sbi_free(sbi);
 }
@@ -244,6 +245,7 @@ fail_sbi_init:
 		sbi->z_root->op->evict(sbi->z_root);
 	if (sbi->zfi->op->sbi_fini)
 		sbi->zfi->op->sbi_fini(sbi);
+	zus_t2cache_fini(sbi);
 	_pmem_ungrab(sbi);
 fail_grab:
 	zuf_private_umount(zip->mount_fd, zip);
@@ -270,6 +272,7 @@ int zus_private_umount(struct zufs_ioc_mount_private *zip)
 
 	if (sbi->zfi->op->sbi_fini)
 		err = sbi->zfi->op->sbi_fini(sbi);
+	zus_t2cache_fini(sbi);
 	_pmem_ungrab(sbi);
 	zuf_private_umount(zip->mount_fd, zip);
 	sbi->zfi->op->sbi_free(sbi);
@@ -705,31 +708,11 @@ const char *ZUFS_OP_name(enum e_zufs_operation op)
 	}
 }
 
-static void _some_pigy_put(struct zufs_ioc_hdr *hdr)
-{
-	while (hdr->flags & ZUFS_H_HAS_PIGY_PUT) {
-		/* Kernel made sure to update hdr->in_len including the
-		 * iom_n. Kernel also checks bounds.
-		 */
-		hdr = (void *)hdr + hdr->in_len;
-
-		if (unlikely(hdr->operation != ZUFS_OP_PUT_MULTY)) {
-			ERROR("Not yet, easily support pigy ANY operation(%s)\n",
-			      ZUFS_OP_name(hdr->operation));
-			break;
-		}
-		_get_put_multy(hdr);
-	}
-}
-
-int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
+static int _do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
 {
 	DBG("[%s] OP=%d off=0x%x len=0x%x\n", ZUFS_OP_name(hdr->operation),
 		hdr->operation, hdr->offset, hdr->len);
 
-	if (hdr->flags & ZUFS_H_HAS_PIGY_PUT)
-		_some_pigy_put(hdr);
-
 	switch (hdr->operation) {
 	case ZUFS_OP_NEW_INODE:
 		return _new_inode(app_ptr, hdr);
@@ -792,3 +775,53 @@ int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
 
 	return 0;
 }
+
+static int _do_command_timed(void *app_ptr, struct zufs_ioc_hdr *hdr)
+{
+	ulong start;
+	int err;
+
+	if (!zus_stats_enabled())
+		return _do_command(app_ptr, hdr);
+
+	start = zus_stats_now();
+	err = _do_command(app_ptr, hdr);
+	zus_stats_record(hdr->operation, start);
+	return err;
+}
+
+/*
+ * The Kernel may piggy-back more operations after the one in hdr, each
+ * chained by ZUFS_H_HAS_PIGY_PUT on its predecessor, so that a batch of
+ * operations costs a single ZT crossing. Run them all, in order, before
+ * the main operation. Each one gets its own result in its own hdr->err,
+ * in Kernel conventions, and its own app_ptr as mapped by its hdr->offset.
+ */
+static void _some_pigy(void *app_ptr, struct zufs_ioc_hdr *hdr)
+{
+	void *api_mem = app_ptr - hdr->offset;
+	int err;
+
+	while (hdr->flags & ZUFS_H_HAS_PIGY_PUT) {
+		/* Kernel made sure to update hdr->in_len including the
+		 * iom_n. Kernel also checks bounds.
+		 */
+		if (unlikely(!hdr->in_len)) {
+			ERROR("pigy after %s with zero in_len\n",
+			      ZUFS_OP_name(hdr->operation));
+			break;
+		}
+		hdr = (void *)hdr + hdr->in_len;
+
+		err = _do_command_timed(api_mem + hdr->offset, hdr);
+		hdr->err = _errno_UtoK(err);
+	}
+}
+
+int zus_do_command(void *app_ptr, struct zufs_ioc_hdr *hdr)
+{
+	if (hdr->flags & ZUFS_H_HAS_PIGY_PUT)
+		_some_pigy(app_ptr, hdr);
+
+	return _do_command_timed(app_ptr, hdr);
+}
@@ -91,6 +91,15 @@ int zus_increase_max_files(void);
 #	define BUILD_BUG_ON(condition) ((void)sizeof(char[1 - 2*!!(condition)]))
 #endif
 
+/*
+ * Converts user-space error code to kernel conventions: change positive errno
+ * codes to negative.
+ */
+static inline __s32 _errno_UtoK(__s32 err)
+{
+	return (err < 0) ? err : -err;
+}
+
 static inline __le32 le32_add(__le32 *val, __s16 add)
 {
 	return *val = cpu_to_le32(le32_to_cpu(*val) + add);
@@ -186,12 +195,28 @@ struct fba {
 };
 
 #define ZUS_MAX_POOLS	7
+#define ZUS_PA_MAX_NODES 16	/* Fits the page flags, see NODES_BITLEN */
+#define PA_MAX_ORDER 5
 struct pa {
 	struct fba pages;
 	struct fba data;
-	struct a_list_head head;
-	size_t size;
-	pthread_spinlock_t lock;
+	struct pa_node {
+		/* Free buddy blocks of this node, by order */
+		struct a_list_head free[PA_MAX_ORDER + 1];
+		ulong ndirty;	/* Free pages not punched yet */
+		pthread_spinlock_t lock;
+	} node[ZUS_PA_MAX_NODES];
+	size_t size;			/* Pages on the free lists */
+	size_t mapped;			/* Pages of all segments */
+	pthread_mutex_t grow_lock;	/* Protects growing the two */
+	struct pa_seg *segs;		/* Growth segments, see pa.c */
+	struct pa_seg **dir;
+	uint nsegs;
+	bool hugetlb;			/* Else tmpfs */
+	size_t hpage_size;		/* Reclaim unit if huge, else 0 */
+	struct pa_cpu *cpu;		/* Per-CPU hot pages, see pa.c */
+	int ncpus;
+	struct pa_reclaim *reclaim;
 };
 
 struct zus_sb_info {
@@ -203,6 +228,7 @@ struct zus_sb_info {
 	ulong			flags;
 	__u64			kern_sb_id;
 	struct pa		pa[ZUS_MAX_POOLS];
+	struct zus_t2cache	*t2c;	/* See t2cache.c */
 };
 
 enum E_zus_sbi_flags {
@@ -304,6 +330,47 @@ static inline void zus_std_remove_dentry(struct zus_inode *dir_zi,
 
 int zus_zt_signal_pending(void);
 
+/* ZT polling ring. Lives in the last ZUS_ZT_RING_SIZE bytes of each ZT's
+ * operation buffer, which are then not offered to zuf as command space.
+ * The ZT offers polling by setting zt_magic; only if the peer answers with
+ * peer_magic is the ring used:
+ *  - The peer increments sq_seq each time it places a new operation in
+ *    the buffer.
+ *  - The ZT sets cq_seq to the sq_seq of the operation whose result it
+ *    just wrote to hdr->err. That, not the following ZU_IOC_WAIT_OPT, is
+ *    how the peer learns the operation is done.
+ *  - Just before, the ZT sets poll to ZUS_ZT_RING_POLL and spins on it. The
+ *    peer hands it the next operation by a compare-and-swap of poll from
+ *    POLL to POSTED. If poll was SLEEP the operation goes by WAIT_OPT.
+ *  - When its budget runs out the ZT swaps poll from POLL to SLEEP. If that
+ *    fails an operation was posted, which it runs before it sleeps.
+ * So each operation is delivered exactly once, by one of the two paths.
+ */
+#define ZUS_ZT_RING_SIZE	(PAGE_SIZE)
+#define ZUS_ZT_RING_MAGIC	(0x5A5452494E47ULL) /* "ZTRING" */
+
+enum {
+	ZUS_ZT_RING_SLEEP = 0,
+	ZUS_ZT_RING_POLL,
+	ZUS_ZT_RING_POSTED,
+};
+
+struct zus_zt_ring {
+	__u64 zt_magic;
+	__u64 peer_magic;
+	__u64 sq_seq;
+	__u64 cq_seq;
+	__u32 poll;
+	__u32 __pad;
+};
+
+struct zus_zt_poll_stats {
+	ulong spin_hits;	/* next op was found while polling */
+	ulong sleeps;		/* budget ran out, went to ZU_IOC_WAIT_OPT */
+};
+
+void zus_zt_poll_stats(struct zus_zt_poll_stats *stats);
+
 int zus_numa_map_init(int fd);
 int zus_init_zuf(const char *zuf_path);
 /* Open an O_TMPFILE on the zuf-root we belong to */
@@ -329,6 +396,7 @@ int zus_current_onecpu(void);
 int zus_current_cpu(void);
 int zus_current_cpu_silent(void);
 int zus_current_nid(void);
+void zus_mbind_preferred(void *ptr, size_t size, uint nid);
 unsigned int zus_cpumask_next(int n, cpu_set_t *srcp);
 
 #define zus_num_possible_nodes() (zus_numa_map->possible_nodes)
@@ -351,6 +419,8 @@ struct zus_thread_params {
 	int rr_priority;
 	uint one_cpu;	/* either set this one. Else ZUS_CPU_ALL */
 	uint nid;	/* Or set this one. Else ZUS_NUMA_NO_NID */
+	uint poll_us;	/* ZTs: busy-poll the ring this long before sleeping */
+	bool stop_at_umount; /* ZTs: stop them all when no FS is mounted */
 	ulong __flags; /* warnings on/off */
 };
 
@@ -367,6 +437,7 @@ int zus_thread_current_init(void);
 void zus_thread_current_fini(void);
 int zus_alloc_exec_buff(struct zus_sb_info *sbi, uint max_bytes, uint pool_num,
 			struct fba *fba);
+void zus_free_exec_buff(struct fba *fba);
 
 /* zus-vfs.c */
 int zus_register_all(int fd);
@@ -384,6 +455,69 @@ int zus_private_mount(struct zus_fs_info *zfi, const char *options, ulong flags,
 		      struct zufs_ioc_mount_private **zip_out);
 int zus_private_umount(struct zufs_ioc_mount_private *zip);
 
+/* stats.c */
+int zus_stats_init(const char *path);
+void zus_stats_fini(void);
+void zus_stats_kick(bool reset);
+bool zus_stats_enabled(void);
+ulong zus_stats_now(void);
+void zus_stats_record(uint op, ulong start);
+
+/* t2cache.c - Optional, set up by an FS at sbi_init, see there */
+struct zus_t2cache;
+int zus_t2cache_init(struct zus_sb_info *sbi, ulong max_pages);
+void zus_t2cache_fini(struct zus_sb_info *sbi);
+int zus_t2cache_get(struct zus_sb_info *sbi, ulong bn, void **addr);
+void zus_t2cache_put(struct zus_sb_info *sbi, ulong bn);
+void zus_t2cache_dirty(struct zus_sb_info *sbi, ulong bn);
+void zus_t2cache_forget(struct zus_sb_info *sbi, ulong bn);
+int zus_t2cache_sync(struct zus_sb_info *sbi);
+
+/* csum.c */
+uint16_t zus_crc16(uint16_t crc, const void *data, size_t len);
+uint32_t zus_crc32c(uint32_t crc, const void *data, size_t len);
+
+/* Each implementation, for benchmarks. Returns -ENOENT past the last */
+struct zus_csum_impl {
+	const char *name;
+	uint32_t (*fn)(uint32_t crc, const void *data, size_t len);
+	bool avail;	/* This CPU can run it */
+	bool active;	/* zus_crc16/zus_crc32c use it */
+};
+int zus_csum_get_impl(uint i, struct zus_csum_impl *zci);
+
+/* zuf-emu.c - In-process stand-in for the zuf Kernel module, so zus and its
+ * FSs can be driven without it, e.g. by benchmarks. Order of calls is:
+ * zuf_emu_start, zus_mount_thread_start, zuf_emu_mount, zuf_emu_dispatch...,
+ * zuf_emu_umount, zuf_emu_stop, zus_mount_thread_stop, zuf_emu_fini.
+ */
+struct zuf_emu_mount {
+	const char *fs_name;	/* of a registered FS */
+	const char *pmem_path;	/* A formatted t1 image, best on a tmpfs */
+	const char *t2_path;	/* Optional t2 image */
+	const char *options;
+	ulong flags;
+	uint num_channels;
+
+	/* Returned */
+	__u64 sb_id;
+	struct zus_sb_info *sbi;
+	struct zus_inode_info *root_ii;
+};
+
+extern bool g_zuf_emu;
+int zuf_emu_start(void);
+void zuf_emu_stop(void);
+void zuf_emu_fini(void);
+int zuf_emu_mount(struct zuf_emu_mount *zem);
+int zuf_emu_umount(struct zuf_emu_mount *zem);
+int zuf_emu_dispatch(uint chan, uint cpu, struct zufs_ioc_hdr *hdr,
+		     void *app, size_t app_len);
+/* Hooks of zuf-root files and zuf_call.h */
+int zuf_emu_open(int *fd);
+void zuf_emu_close(int fd);
+int zuf_emu_ioctl(int fd, ulong zu_vect, struct zufs_ioc_hdr *hdr);
+
 /* dyn_pr.c */
 int zus_add_module_ddbg(const char *fs_name, void *handle);
 void zus_free_ddbg_db(void);
@@ -406,6 +540,7 @@ int fba_punch_hole(struct fba *fba, ulong index, uint nump);
  * frees the page. (pa_free is just a pa_put_page
  */
 int zus_setup_pa_size(size_t size);
+int zus_setup_pa_huge(const char *huge);
 int pa_init(struct zus_sb_info *sbi);
 void pa_fini(struct zus_sb_info *sbi);
 
@@ -477,9 +612,16 @@ static inline void zus_clear_pf(struct pa_page *p, long nr)
 	_zus_clear_bit(nr, &p->flags);
 }
 
-#define PA_MAX_ORDER 5
-
-struct pa_page *pa_alloc_order(struct zus_sb_info *sbi, int order);
+/* Pages of @nid if it has any free, else of any node. ZUS_NUMA_NO_NID is the
+ * node of the calling CPU.
+ */
+struct pa_page *pa_alloc_order_nid(struct zus_sb_info *sbi, int order,
+				   uint nid);
+static inline
+struct pa_page *pa_alloc_order(struct zus_sb_info *sbi, int order)
+{
+	return pa_alloc_order_nid(sbi, order, ZUS_NUMA_NO_NID);
+}
 static inline struct pa_page *pa_alloc(struct zus_sb_info *sbi)
 {
 	return pa_alloc_order(sbi, 0);
@@ -496,6 +638,15 @@ void __pa_free(struct pa_page *page);
 #define NODES_PGSHIFT	(ZONE_SHIFT - NODES_BITLEN) /* 4 bits */
 #define NODES_MASK	(((1UL << NODES_BITLEN)-1) << NODES_PGSHIFT)
 
+/* order + 1 on the first page of a free buddy block, else 0 */
+#define PA_ORDER_BITLEN		3
+#define PA_ORDER_PGSHIFT	(NODES_PGSHIFT - PA_ORDER_BITLEN) /* 3 bits */
+#define PA_ORDER_MASK	(((1UL << PA_ORDER_BITLEN)-1) << PA_ORDER_PGSHIFT)
+
+/* On the first page of a free buddy block, if not punched yet */
+#define PA_DIRTY_PGSHIFT	(PA_ORDER_PGSHIFT - 1)
+#define PA_DIRTY_MASK		(1UL << PA_DIRTY_PGSHIFT)
+
 static inline ulong get_bit_range(ulong x, int start_bit, ulong mask)
 {
 	return (x & mask) >> start_bit;
@@ -690,6 +841,7 @@ static inline void *pa_addr(struct zus_sb_info *sbi, ulong offset)
 #define ZUS_LIBFS_DIR		"/usr/lib/zufs"
 #define ZUFS_LIBFS_LIST		"ZUFS_LIBFS_LIST"
 #define ZUFS_PA_SIZE		"ZUFS_PA_SIZE"
+#define ZUFS_PA_HUGE		"ZUFS_PA_HUGE"
 
 /* declare so compiler will not complain */
 extern int register_fs(int fd);
@@ -721,4 +873,21 @@ void *zus_page_address(struct pa_page *page);
 void *zus_virt_to_page(void *addr);
 struct zus_sb_info *zus_global_sbi(void);
 
+struct zus_slab_stats {
+	ulong local_frees;	/* Into the freeing thread's own magazine */
+	ulong remote_frees;	/* Of elements owned by another CPU */
+	ulong remote_batches;	/* Hand-overs of remote frees to their owner */
+};
+void zus_slab_get_stats(struct zus_slab_stats *zss);
+
+struct zus_slab_class_stats {
+	size_t size;		/* Of elements in this class */
+	size_t span_size;	/* Of pa runs carved into elements */
+	ulong nspans;
+	ulong nused;		/* Including ones cached by threads */
+	ulong nfree;
+};
+/* Returns -EINVAL past the last class */
+int zus_slab_get_class_stats(int slab_index, struct zus_slab_class_stats *zcs);
+
 #endif /* define __ZUS_H__ */
@@ -13,7 +13,7 @@
 PROJ_NAME := zus
 PROJ_TARGET_TYPE := lib
 PROJ_OBJS := zus-core.o zus-vfs.o module.o md_zus.o nvml_movnt.o utils.o fs-loader.o pa.o
-PROJ_OBJS += printz.o slab.o
+PROJ_OBJS += printz.o slab.o stats.o t2cache.o csum.o zuf-emu.o
 PROJ_INCLUDES := .
 PROJ_LIBS := rt uuid unwind dl pthread systemd
 